@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "arena.h"
+
+#define ALIGN_UP(x, a)		(((x) + (a) - 1) / (a) * (a))
+
+static const char *arena_backing_name[] = {
+	[NETTEST_ARENA_PAGES]	= "regular pages",
+	[NETTEST_ARENA_THP]	= "transparent hugepages",
+	[NETTEST_ARENA_HUGETLB]	= "hugepages",
+};
+
+/*
+ * Map size bytes aligned to a hugepage, so that the kernel can back them
+ * with transparent hugepages
+ */
+static void *arena_map_aligned(size_t size)
+{
+	size_t head;
+	uint8_t *p;
+
+	p = mmap(NULL, size + NETTEST_HUGEPAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return p;
+
+	head = ALIGN_UP((uintptr_t) p, NETTEST_HUGEPAGE_SIZE) - (uintptr_t) p;
+	if (head)
+		munmap(p, head);
+	munmap(p + head + size, NETTEST_HUGEPAGE_SIZE - head);
+
+	return p + head;
+}
+
+/*
+ * Map num buffers of buf_size bytes each, with hugepages if huge: the
+ * reserved ones first, then the transparent ones, otherwise the buffers
+ * are on regular pages. The memory is touched here, not by the users.
+ */
+int nettest_arena_init(struct nettest_arena_s *a, unsigned int num,
+			size_t buf_size, bool huge)
+{
+	size_t bufs;
+	void *p = MAP_FAILED;
+	unsigned int i;
+
+	memset(a, 0, sizeof(*a));
+	if (num == 0 || buf_size == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	a->num = num;
+	a->buf_size = ALIGN_UP(buf_size, NETTEST_CACHELINE_SIZE);
+	bufs = (size_t) num * a->buf_size;
+	a->size = bufs + num * sizeof(*a->free);
+
+	if (huge) {
+		a->size = ALIGN_UP(a->size, NETTEST_HUGEPAGE_SIZE);
+		p = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		a->backing = NETTEST_ARENA_HUGETLB;
+		if (p == MAP_FAILED) {
+			p = arena_map_aligned(a->size);
+			a->backing = NETTEST_ARENA_THP;
+			if (p != MAP_FAILED &&
+			    madvise(p, a->size, MADV_HUGEPAGE) < 0)
+				a->backing = NETTEST_ARENA_PAGES;
+		}
+	} else {
+		p = mmap(NULL, a->size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		a->backing = NETTEST_ARENA_PAGES;
+	}
+	if (p == MAP_FAILED)
+		return -1;
+	a->base = p;
+	memset(a->base, 0, a->size);
+
+	/* The free-list follows the buffers, the first one on top */
+	a->free = (void **) (a->base + bufs);
+	for (i = 0; i < num; i++)
+		a->free[i] = nettest_arena_buf(a, num - 1 - i);
+	a->free_num = num;
+
+	return 0;
+}
+
+void nettest_arena_destroy(struct nettest_arena_s *a)
+{
+	if (a->base)
+		munmap(a->base, a->size);
+	memset(a, 0, sizeof(*a));
+}
+
+const char *nettest_arena_backing_name(const struct nettest_arena_s *a)
+{
+	return arena_backing_name[a->backing];
+}
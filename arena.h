@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Packet buffer arena
+ *
+ * The packet buffers of a thread all come from a single mapping made and
+ * prefaulted at startup, so the hot loops never call the allocator nor
+ * take page faults, and with 2MB hugepages thousands of packets need a
+ * few TLB entries. Buffers are cache line aligned and handed out by a
+ * free-list kept as a stack: the buffer just released, still in cache,
+ * is the next one taken. An arena is not locked, each thread makes its
+ * own.
+ */
+
+#define NETTEST_CACHELINE_SIZE	64
+#define NETTEST_HUGEPAGE_SIZE	((size_t) 2 << 20)
+
+enum nettest_arena_backing_e {
+	NETTEST_ARENA_PAGES,		/* regular pages */
+	NETTEST_ARENA_THP,		/* transparent hugepages, if possible */
+	NETTEST_ARENA_HUGETLB,		/* reserved hugepages */
+};
+
+struct nettest_arena_s {
+	uint8_t *base;
+	size_t size;			/* mapped bytes */
+	size_t buf_size;		/* rounded up to the cache line */
+	unsigned int num;
+	enum nettest_arena_backing_e backing;
+
+	void **free;			/* stack of the free buffers */
+	unsigned int free_num;
+};
+
+extern int nettest_arena_init(struct nettest_arena_s *a, unsigned int num,
+			size_t buf_size, bool huge);
+extern void nettest_arena_destroy(struct nettest_arena_s *a);
+extern const char *nettest_arena_backing_name(const struct nettest_arena_s *a);
+
+/* Return a free buffer or NULL if all of them are in use */
+static inline void *nettest_arena_get(struct nettest_arena_s *a)
+{
+	return a->free_num ? a->free[--a->free_num] : NULL;
+}
+
+static inline void nettest_arena_put(struct nettest_arena_s *a, void *buf)
+{
+	a->free[a->free_num++] = buf;
+}
+
+/* The i-th buffer, for the users handling them as an array (i.e. a ring) */
+static inline void *nettest_arena_buf(const struct nettest_arena_s *a,
+			unsigned int i)
+{
+	return a->base + (size_t) i * a->buf_size;
+}
+
+#endif /* _ARENA_H */
@@ -0,0 +1,138 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "nettest.h"
+
+/*
+ * Interface counters
+ */
+
+/* Open the netlink socket, the interface is chosen later */
+void nettest_setup_ifmon(struct comm_info_s *comm)
+{
+	int ret;
+
+	ret = nettest_ifmon_open(&comm->ifmon);
+	warn_if(ret < 0, "cannot open netlink socket, no interface "
+		"counters: %m");
+}
+
+/*
+ * Follow the counters of the interface the packets to or from dest go
+ * through, from now on
+ */
+void nettest_ifmon_follow(struct comm_info_s *comm,
+			const struct comm_dest_s *dest)
+{
+	struct nettest_ifmon_s *m = &comm->ifmon;
+	int ifindex;
+
+	if (m->nl < 0)
+		return;
+	if (comm->type == NETTEST_INFO_TYPE_ETHERNET)
+		ifindex = comm->proto.eth.raw_address.sll_ifindex;
+	else
+		ifindex = nettest_ifmon_route(m, dest->addr.in.sin_addr);
+	if (ifindex < 0 || nettest_ifmon_start(m, ifindex) < 0) {
+		warn("cannot read the interface counters: %m");
+		return;
+	}
+	dbg("following the counters of %s", m->name);
+}
+
+/*
+ * Print the counters of the interface since the last report, or since
+ * the start of the test if total
+ */
+void nettest_report_ifstats(struct comm_info_s *comm,
+			bool total)
+{
+	struct nettest_ifmon_s *m = &comm->ifmon;
+	struct nettest_ifstats_s cur;
+	char buf[320];
+
+	if (!nettest_ifmon_active(m))
+		return;
+	if (nettest_ifmon_read(m, &cur) < 0) {
+		dbg("cannot read the interface counters: %m");
+		return;
+	}
+	nettest_ifstats_snprintf(buf, sizeof(buf), m->name, &cur,
+				total ? &m->start : &m->prev);
+	info("interface %s", buf);
+	m->prev = cur;
+}
+
+/*
+ * Socket buffers sizing
+ */
+
+/*
+ * Return the socket buffer size needed to hold NETTEST_BUF_MS of traffic
+ * at the given mean period in us (0 means wire speed), or a whole burst
+ * of packets, and packet length.
+ */
+int nettest_bufsize(unsigned int period_us, unsigned int burst,
+				size_t len)
+{
+	uint64_t pps, size;
+
+	pps = period_us ? 1000000 / period_us : NETTEST_BUF_WIRE_PPS;
+	size = max(pps * NETTEST_BUF_MS / 1000, (uint64_t) NETTEST_BUF_MIN_PKTS);
+	size = max(size, (uint64_t) burst);
+	size *= len + NETTEST_BUF_OVERHEAD;
+
+	return min(size, (uint64_t) NETTEST_BUF_MAX);
+}
+
+/*
+ * Enlarge the receive (rx is true) or send buffer of the socket to size
+ * bytes. We first try the *BUFFORCE options, which ignore the
+ * net.core.[rw]mem_max limits but need CAP_NET_ADMIN.
+ */
+void nettest_set_bufsize(int s, bool rx, int size)
+{
+	int opt = rx ? SO_RCVBUF : SO_SNDBUF;
+	int opt_force = rx ? SO_RCVBUFFORCE : SO_SNDBUFFORCE;
+	const char *name = rx ? "receive" : "send";
+	socklen_t len = sizeof(int);
+	int cur;
+	int ret;
+
+	/* The kernel doubles the value we set, so does getsockopt() */
+	ret = getsockopt(s, SOL_SOCKET, opt, &cur, &len);
+	if (ret == 0 && cur / 2 >= size)
+		return;
+
+	ret = setsockopt(s, SOL_SOCKET, opt_force, &size, sizeof(size));
+	if (ret < 0)
+		setsockopt(s, SOL_SOCKET, opt, &size, sizeof(size));
+
+	len = sizeof(int);
+	ret = getsockopt(s, SOL_SOCKET, opt, &cur, &len);
+	if (ret < 0)
+		return;
+	if (cur / 2 < size)
+		warn("socket %s buffer is %d bytes while %d are needed, "
+			"raise net.core.%cmem_max or run as root",
+			name, cur / 2, size, rx ? 'r' : 'w');
+	else
+		dbg("socket %s buffer set to %d bytes", name, cur / 2);
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "nettest.h"
+
+/* Send a message, return 0 or a negative errno */
+int nettest_ctrl_send(int s, unsigned int type,
+				const void *body, size_t len)
+{
+	struct nettest_ctrl_msg_s msg;
+	size_t size = sizeof(msg.hdr) + len;
+	ssize_t ret;
+
+	msg.hdr.magic = NETTEST_CTRL_MAGIC;
+	msg.hdr.type = type;
+	msg.hdr.len = len;
+	memcpy(&msg.body, body, len);
+
+	ret = send(s, &msg, size, MSG_NOSIGNAL);
+	if (ret < 0)
+		return -errno;
+
+	return ret == size ? 0 : -EIO;
+}
+
+/*
+ * Receive a message and return its type, 0 if the peer has closed the
+ * connection or a negative errno. With MSG_DONTWAIT in flags nothing is
+ * read (and -EAGAIN returned) until the whole message has arrived.
+ */
+int nettest_ctrl_recv(int s, struct nettest_ctrl_msg_s *msg,
+				int flags)
+{
+	size_t size;
+	ssize_t ret;
+
+	ret = recv(s, &msg->hdr, sizeof(msg->hdr),
+			flags & MSG_DONTWAIT ? MSG_PEEK | MSG_DONTWAIT :
+						MSG_PEEK | MSG_WAITALL);
+	if (ret <= 0)
+		return ret < 0 ? -errno : 0;
+	if (ret < sizeof(msg->hdr))
+		return -EAGAIN;
+	if (msg->hdr.magic != NETTEST_CTRL_MAGIC ||
+	    msg->hdr.len > sizeof(msg->body))
+		return -EPROTO;
+
+	size = sizeof(msg->hdr) + msg->hdr.len;
+	if (flags & MSG_DONTWAIT) {
+		ret = recv(s, msg, size, MSG_PEEK | MSG_DONTWAIT);
+		if (ret < 0)
+			return -errno;
+		if (ret < size)
+			return -EAGAIN;
+	}
+
+	ret = recv(s, msg, size, MSG_WAITALL);
+	if (ret <= 0)
+		return ret < 0 ? -errno : 0;
+	if (ret < size)
+		return -EIO;
+
+	return msg->hdr.type;
+}
+
+/* Set the timeout of the blocking operations of a socket */
+int nettest_set_timeout(int s, int opt, unsigned int ms)
+{
+	struct timeval tv = {
+		.tv_sec = ms / 1000,
+		.tv_usec = ms % 1000 * 1000,
+	};
+
+	return setsockopt(s, SOL_SOCKET, opt, &tv, sizeof(tv));
+}
@@ -0,0 +1,291 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/gen_stats.h>
+#include <linux/if_link.h>
+#include <linux/netlink.h>
+#include <linux/pkt_sched.h>
+#include <linux/rtnetlink.h>
+
+#include "ifstats.h"
+
+#define IFMON_BUF_SIZE		32768
+
+typedef int (*ifmon_cb_t)(const struct nlmsghdr *nh, void *arg);
+
+/*
+ * Send the request and pass each message of the reply to cb, until the
+ * end of a dump or the first message otherwise
+ */
+static int ifmon_talk(struct nettest_ifmon_s *m, struct nlmsghdr *req,
+			ifmon_cb_t cb, void *arg)
+{
+	static uint8_t buf[IFMON_BUF_SIZE]
+			__attribute__((aligned(NLMSG_ALIGNTO)));
+	bool dump = req->nlmsg_flags & NLM_F_DUMP;
+	const struct nlmsgerr *nerr;
+	struct nlmsghdr *nh;
+	ssize_t n;
+	int ret;
+
+	req->nlmsg_flags |= NLM_F_REQUEST;
+	req->nlmsg_seq = ++m->seq;
+	if (send(m->nl, req, req->nlmsg_len, 0) < 0)
+		return -1;
+
+	while (1) {
+		n = recv(m->nl, buf, sizeof(buf), 0);
+		if (n < 0)
+			return -1;
+
+		for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, n);
+		     nh = NLMSG_NEXT(nh, n)) {
+			if (nh->nlmsg_seq != m->seq)
+				continue;
+			if (nh->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if (nh->nlmsg_type == NLMSG_ERROR) {
+				nerr = NLMSG_DATA(nh);
+				errno = -nerr->error;
+				return nerr->error ? -1 : 0;
+			}
+
+			ret = cb(nh, arg);
+			if (ret < 0 || !dump)
+				return ret;
+		}
+	}
+}
+
+static int ifmon_route_cb(const struct nlmsghdr *nh, void *arg)
+{
+	const struct rtmsg *rtm = NLMSG_DATA(nh);
+	int len = RTM_PAYLOAD(nh);
+	struct rtattr *rta;
+
+	for (rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len))
+		if (rta->rta_type == RTA_OIF)
+			*(unsigned int *) arg = *(uint32_t *) RTA_DATA(rta);
+
+	return 0;
+}
+
+static int ifmon_link_cb(const struct nlmsghdr *nh, void *arg)
+{
+	const struct if_stats_msg *ifsm = NLMSG_DATA(nh);
+	int len = NLMSG_PAYLOAD(nh, sizeof(*ifsm));
+	struct nettest_ifstats_s *s = arg;
+	struct rtnl_link_stats64 st;
+	struct rtattr *rta;
+
+	for (rta = (struct rtattr *) ((uint8_t *) ifsm +
+			NLMSG_ALIGN(sizeof(*ifsm)));
+	     RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type != IFLA_STATS_LINK_64)
+			continue;
+
+		/* Older kernels may give a shorter structure */
+		memset(&st, 0, sizeof(st));
+		memcpy(&st, RTA_DATA(rta), RTA_PAYLOAD(rta) < sizeof(st) ?
+					RTA_PAYLOAD(rta) : sizeof(st));
+		s->rx_packets = st.rx_packets;
+		s->tx_packets = st.tx_packets;
+		s->rx_dropped = st.rx_dropped;
+		s->tx_dropped = st.tx_dropped;
+		s->rx_errors = st.rx_errors;
+		s->tx_errors = st.tx_errors;
+		/* Drivers tell a full ring by one of them */
+		s->rx_missed = st.rx_missed_errors + st.rx_fifo_errors +
+				st.rx_over_errors;
+	}
+
+	return 0;
+}
+
+struct ifmon_qdisc_arg_s {
+	unsigned int ifindex;
+	struct nettest_ifstats_s *s;
+};
+
+/* Only the root qdisc, whose counters include the ones of its children */
+static int ifmon_qdisc_cb(const struct nlmsghdr *nh, void *arg)
+{
+	const struct tcmsg *tcm = NLMSG_DATA(nh);
+	struct ifmon_qdisc_arg_s *qa = arg;
+	int len = NLMSG_PAYLOAD(nh, sizeof(*tcm)), nlen;
+	struct gnet_stats_queue q;
+	struct rtattr *rta, *nrta;
+
+	if (nh->nlmsg_type != RTM_NEWQDISC ||
+	    (unsigned int) tcm->tcm_ifindex != qa->ifindex ||
+	    tcm->tcm_parent != TC_H_ROOT)
+		return 0;
+
+	for (rta = TCA_RTA(tcm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type != TCA_STATS2)
+			continue;
+
+		nlen = RTA_PAYLOAD(rta);
+		for (nrta = RTA_DATA(rta); RTA_OK(nrta, nlen);
+		     nrta = RTA_NEXT(nrta, nlen)) {
+			if (nrta->rta_type != TCA_STATS_QUEUE ||
+			    RTA_PAYLOAD(nrta) < sizeof(q))
+				continue;
+
+			memcpy(&q, RTA_DATA(nrta), sizeof(q));
+			qa->s->qdisc = true;
+			qa->s->qdisc_drops = q.drops;
+			qa->s->qdisc_overlimits = q.overlimits;
+			qa->s->qdisc_requeues = q.requeues;
+		}
+	}
+
+	return 0;
+}
+
+int nettest_ifmon_open(struct nettest_ifmon_s *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->nl = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+	return m->nl < 0 ? -1 : 0;
+}
+
+/* Return the index of the interface the packets to dst go through */
+int nettest_ifmon_route(struct nettest_ifmon_s *m, struct in_addr dst)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct rtmsg rtm;
+		struct rtattr rta;
+		struct in_addr dst;
+	} req = {
+		.nh.nlmsg_len = sizeof(req),
+		.nh.nlmsg_type = RTM_GETROUTE,
+		.rtm.rtm_family = AF_INET,
+		.rtm.rtm_dst_len = 32,
+		.rta.rta_len = RTA_LENGTH(sizeof(dst)),
+		.rta.rta_type = RTA_DST,
+		.dst = dst,
+	};
+	unsigned int ifindex = 0;
+	int ret;
+
+	ret = ifmon_talk(m, &req.nh, ifmon_route_cb, &ifindex);
+	if (ret < 0)
+		return ret;
+	if (!ifindex) {
+		errno = ENETUNREACH;
+		return -1;
+	}
+
+	return ifindex;
+}
+
+/* Monitor the interface ifindex from now on */
+int nettest_ifmon_start(struct nettest_ifmon_s *m, unsigned int ifindex)
+{
+	int ret;
+
+	if (!if_indextoname(ifindex, m->name))
+		return -1;
+	m->ifindex = ifindex;
+	ret = nettest_ifmon_read(m, &m->start);
+	if (ret < 0) {
+		m->ifindex = 0;
+		return ret;
+	}
+	m->prev = m->start;
+
+	return 0;
+}
+
+int nettest_ifmon_read(struct nettest_ifmon_s *m, struct nettest_ifstats_s *s)
+{
+	struct {
+		struct nlmsghdr nh;
+		struct if_stats_msg ifsm;
+	} link_req = {
+		.nh.nlmsg_len = sizeof(link_req),
+		.nh.nlmsg_type = RTM_GETSTATS,
+		.ifsm.ifindex = m->ifindex,
+		.ifsm.filter_mask = IFLA_STATS_FILTER_BIT(IFLA_STATS_LINK_64),
+	};
+	struct {
+		struct nlmsghdr nh;
+		struct tcmsg tcm;
+	} qdisc_req = {
+		.nh.nlmsg_len = sizeof(qdisc_req),
+		.nh.nlmsg_type = RTM_GETQDISC,
+		.nh.nlmsg_flags = NLM_F_DUMP,
+		.tcm.tcm_family = AF_UNSPEC,
+		.tcm.tcm_ifindex = m->ifindex,
+	};
+	struct ifmon_qdisc_arg_s qa = {
+		.ifindex = m->ifindex,
+		.s = s,
+	};
+	int ret;
+
+	memset(s, 0, sizeof(*s));
+	ret = ifmon_talk(m, &link_req.nh, ifmon_link_cb, s);
+	if (ret < 0)
+		return ret;
+
+	/* Not having a qdisc (i.e. noqueue) is fine */
+	return ifmon_talk(m, &qdisc_req.nh, ifmon_qdisc_cb, &qa);
+}
+
+void nettest_ifmon_close(struct nettest_ifmon_s *m)
+{
+	if (m->nl >= 0)
+		close(m->nl);
+	m->nl = -1;
+	m->ifindex = 0;
+}
+
+/* Print the counters of the interface name since prev */
+int nettest_ifstats_snprintf(char *buf, size_t len, const char *name,
+			const struct nettest_ifstats_s *cur,
+			const struct nettest_ifstats_s *prev)
+{
+	int n;
+
+	n = snprintf(buf, len, "%s: rx %lu packets (%lu dropped, %lu missed, "
+		"%lu errors), tx %lu packets (%lu dropped, %lu errors)", name,
+		cur->rx_packets - prev->rx_packets,
+		cur->rx_dropped - prev->rx_dropped,
+		cur->rx_missed - prev->rx_missed,
+		cur->rx_errors - prev->rx_errors,
+		cur->tx_packets - prev->tx_packets,
+		cur->tx_dropped - prev->tx_dropped,
+		cur->tx_errors - prev->tx_errors);
+	if (cur->qdisc && prev->qdisc && n >= 0 && (size_t) n < len)
+		n += snprintf(buf + n, len - n, ", qdisc %lu dropped "
+			"(%lu overlimits, %lu requeues)",
+			cur->qdisc_drops - prev->qdisc_drops,
+			cur->qdisc_overlimits - prev->qdisc_overlimits,
+			cur->qdisc_requeues - prev->qdisc_requeues);
+
+	return n;
+}
@@ -0,0 +1,73 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _IFSTATS_H
+#define _IFSTATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+/*
+ * Interface counters
+ *
+ * The counters of the interface in use (RTM_GETSTATS, IFLA_STATS_LINK_64)
+ * and of its root qdisc (RTM_GETQDISC) are read over netlink at each
+ * report, so that the packets a test lost can be attributed to the host
+ * (the NIC ring, the driver or the stack, the qdisc on the sending side)
+ * or to the wire without running ip and tc by hand. The deltas are about
+ * the whole interface, not just our traffic.
+ */
+
+struct nettest_ifstats_s {
+	uint64_t rx_packets, tx_packets;
+	uint64_t rx_dropped, tx_dropped;	/* by the driver or the stack */
+	uint64_t rx_errors, tx_errors;
+	uint64_t rx_missed;		/* NIC ring overflows */
+	bool qdisc;			/* the counters below are valid */
+	uint64_t qdisc_drops, qdisc_overlimits, qdisc_requeues;
+};
+
+struct nettest_ifmon_s {
+	int nl;				/* -1 if disabled */
+	uint32_t seq;
+	unsigned int ifindex;		/* 0 if not chosen yet */
+	char name[IF_NAMESIZE];
+	struct nettest_ifstats_s start;	/* of the test */
+	struct nettest_ifstats_s prev;	/* of the last report */
+};
+
+extern int nettest_ifmon_open(struct nettest_ifmon_s *m);
+extern int nettest_ifmon_route(struct nettest_ifmon_s *m, struct in_addr dst);
+extern int nettest_ifmon_start(struct nettest_ifmon_s *m,
+			unsigned int ifindex);
+extern int nettest_ifmon_read(struct nettest_ifmon_s *m,
+			struct nettest_ifstats_s *s);
+extern void nettest_ifmon_close(struct nettest_ifmon_s *m);
+extern int nettest_ifstats_snprintf(char *buf, size_t len,
+			const char *name, const struct nettest_ifstats_s *cur,
+			const struct nettest_ifstats_s *prev);
+
+static inline bool nettest_ifmon_active(const struct nettest_ifmon_s *m)
+{
+	return m->nl >= 0 && m->ifindex;
+}
+
+#endif /* _IFSTATS_H */
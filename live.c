@@ -0,0 +1,188 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "misc.h"
+#include "live.h"
+
+/* Shared memory object names must start with a slash */
+static const char *live_name(const char *name, char *buf, size_t len)
+{
+	if (name[0] == '/')
+		return name;
+	snprintf(buf, len, "/%s", name);
+
+	return buf;
+}
+
+/*
+ * Writer side
+ */
+
+struct nettest_live_s *nettest_live_create(const char *name,
+			unsigned int flows_max)
+{
+	struct nettest_live_s *l;
+	size_t size = nettest_live_size(flows_max);
+	char buf[NAME_MAX];
+	int fd, ret;
+
+	fd = shm_open(live_name(name, buf, sizeof(buf)),
+			O_CREAT | O_RDWR, 0644);
+	if (fd < 0)
+		return NULL;
+	ret = ftruncate(fd, size);
+	if (ret < 0) {
+		close(fd);
+		return NULL;
+	}
+
+	/* Don't take page faults into the hot loop */
+	l = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, 0);
+	close(fd);
+	if (l == MAP_FAILED)
+		return NULL;
+
+	memset(l, 0, size);
+	l->version = NETTEST_LIVE_VERSION;
+	l->pid = getpid();
+	l->flows_max = flows_max;
+	l->flows = 1;
+	/* Readers check the magic last */
+	__atomic_store_n(&l->magic, NETTEST_LIVE_MAGIC, __ATOMIC_RELEASE);
+
+	return l;
+}
+
+void nettest_live_destroy(struct nettest_live_s *l, const char *name)
+{
+	char buf[NAME_MAX];
+
+	munmap(l, nettest_live_size(l->flows_max));
+	shm_unlink(live_name(name, buf, sizeof(buf)));
+}
+
+/* Start a new test of the given flows, zeroing their counters */
+void nettest_live_reset(struct nettest_live_s *l, unsigned int flows,
+			uint64_t start_ns)
+{
+	struct nettest_live_flow_s *f;
+	uint32_t seq = l->seq, fseq;
+	unsigned int i;
+
+	flows = min(flows, l->flows_max);
+
+	__atomic_store_n(&l->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	for (i = 0; i < flows; i++) {
+		f = &l->flow[i];
+		fseq = f->seq;
+		__atomic_store_n(&f->seq, fseq + 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memset((char *) f + sizeof(f->seq) + sizeof(f->__pad), 0,
+				sizeof(*f) - sizeof(f->seq) - sizeof(f->__pad));
+		__atomic_store_n(&f->seq, fseq + 2, __ATOMIC_RELEASE);
+	}
+	l->flows = flows;
+	l->tests++;
+	l->start_ns = start_ns;
+	l->unknown = 0;
+
+	__atomic_store_n(&l->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Reader side
+ */
+
+struct nettest_live_s *nettest_live_open(const char *name)
+{
+	struct nettest_live_s *l;
+	struct stat sb;
+	char buf[NAME_MAX];
+	int fd, ret;
+
+	fd = shm_open(live_name(name, buf, sizeof(buf)), O_RDONLY, 0);
+	if (fd < 0)
+		return NULL;
+	ret = fstat(fd, &sb);
+	if (ret < 0 || sb.st_size < sizeof(*l)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	l = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (l == MAP_FAILED)
+		return NULL;
+
+	if (__atomic_load_n(&l->magic, __ATOMIC_ACQUIRE) !=
+						NETTEST_LIVE_MAGIC ||
+	    l->version != NETTEST_LIVE_VERSION ||
+	    sb.st_size < nettest_live_size(l->flows_max)) {
+		munmap(l, sb.st_size);
+		errno = EPROTO;
+		return NULL;
+	}
+
+	return l;
+}
+
+void nettest_live_close(struct nettest_live_s *l)
+{
+	munmap(l, nettest_live_size(l->flows_max));
+}
+
+void nettest_live_read_header(const struct nettest_live_s *l,
+			uint64_t *tests, unsigned int *flows,
+			uint64_t *start_ns)
+{
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE);
+		*tests = l->tests;
+		*flows = l->flows;
+		*start_ns = l->start_ns;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) ||
+		 seq != __atomic_load_n(&l->seq, __ATOMIC_RELAXED));
+}
+
+void nettest_live_read_flow(const struct nettest_live_s *l,
+			unsigned int flow, struct nettest_live_flow_s *f)
+{
+	const struct nettest_live_flow_s *src = &l->flow[flow];
+	uint32_t seq;
+
+	do {
+		seq = __atomic_load_n(&src->seq, __ATOMIC_ACQUIRE);
+		memcpy(f, src, sizeof(*f));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) ||
+		 seq != __atomic_load_n(&src->seq, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _LIVE_H
+#define _LIVE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "misc.h"
+#include "stats.h"
+
+/*
+ * Live statistics
+ *
+ * The server can publish its per flow counters into a POSIX shared memory
+ * segment so that external tools (i.e. nettestmon) can sample them while
+ * the test is running. There is only one writer, which never waits for
+ * the readers: each flow is protected by a sequence counter which is odd
+ * while the writer is updating it, so a reader retries if the counter
+ * was odd or it has changed while copying the data. The header has its
+ * own sequence counter for test restarts.
+ *
+ * The writer doesn't need any system call: counters are updated with
+ * plain stores into the mapped memory.
+ */
+
+#define NETTEST_LIVE_MAGIC	0x6e746c76	/* "ntlv" */
+#define NETTEST_LIVE_VERSION	1
+#define NETTEST_LIVE_IPT_SLOTS	32		/* log2 buckets of ns */
+
+struct nettest_live_flow_s {
+	uint32_t seq;			/* odd while being updated */
+	uint32_t __pad;
+	uint64_t received;
+	uint64_t bytes;
+	uint64_t lost;
+	uint64_t lost_local;
+	uint64_t dup;
+	uint64_t reordered;
+	uint64_t ipt_max_ns;
+	uint64_t last_ns;		/* CLOCK_MONOTONIC of the last packet */
+	uint64_t ipt[NETTEST_LIVE_IPT_SLOTS];	/* slot i is [2^i, 2^(i+1)) ns */
+};
+
+struct nettest_live_s {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t pid;			/* of the writer */
+	uint32_t flows_max;		/* flow[] entries */
+
+	uint32_t seq;			/* odd while a test is being reset */
+	uint32_t flows;			/* active flows */
+	uint64_t tests;			/* number of tests started so far */
+	uint64_t start_ns;		/* CLOCK_MONOTONIC of the test start */
+	uint64_t unknown;		/* packets of flows out of the table */
+
+	struct nettest_live_flow_s flow[];
+};
+
+static inline size_t nettest_live_size(unsigned int flows_max)
+{
+	return sizeof(struct nettest_live_s) +
+			flows_max * sizeof(struct nettest_live_flow_s);
+}
+
+static inline unsigned int nettest_live_ipt_index(uint64_t ns)
+{
+	if (ns == 0)
+		return 0;
+
+	return min(63 - __builtin_clzll(ns), NETTEST_LIVE_IPT_SLOTS - 1);
+}
+
+/* Writer side */
+extern struct nettest_live_s *nettest_live_create(const char *name,
+			unsigned int flows_max);
+extern void nettest_live_destroy(struct nettest_live_s *l, const char *name);
+extern void nettest_live_reset(struct nettest_live_s *l, unsigned int flows,
+			uint64_t start_ns);
+
+/*
+ * Copy the counters of the given flow into the segment, account the last
+ * inter packet time too if ipt is true
+ */
+static inline void nettest_live_publish(struct nettest_live_s *l,
+			unsigned int flow, const struct nettest_stats_s *st,
+			bool ipt)
+{
+	struct nettest_live_flow_s *f = &l->flow[flow];
+	uint32_t seq = f->seq;
+
+	__atomic_store_n(&f->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	f->received = st->received;
+	f->bytes = st->bytes;
+	f->lost = st->lost;
+	f->lost_local = st->lost_local;
+	f->dup = st->dup;
+	f->reordered = st->reordered;
+	f->ipt_max_ns = st->ipt_max_ns;
+	f->last_ns = st->last_ns;
+	if (ipt)
+		f->ipt[nettest_live_ipt_index(st->ipt_ns)]++;
+
+	__atomic_store_n(&f->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static inline void nettest_live_unknown(struct nettest_live_s *l,
+			uint64_t unknown)
+{
+	__atomic_store_n(&l->unknown, unknown, __ATOMIC_RELAXED);
+}
+
+/* Reader side */
+extern struct nettest_live_s *nettest_live_open(const char *name);
+extern void nettest_live_close(struct nettest_live_s *l);
+extern void nettest_live_read_header(const struct nettest_live_s *l,
+			uint64_t *tests, unsigned int *flows,
+			uint64_t *start_ns);
+extern void nettest_live_read_flow(const struct nettest_live_s *l,
+			unsigned int flow, struct nettest_live_flow_s *f);
+
+#endif /* _LIVE_H */
@@ -0,0 +1,486 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include "misc.h"
+#include "log.h"
+
+bool __log_async;
+
+/*
+ * A message: where it goes, its format and the arguments it refers to,
+ * packed as 64 bit integers, doubles or inline strings.
+ */
+struct log_rec_s {
+	FILE *stream;
+	const char *fmt, *func, *file;
+	int line;
+	int layout;
+	int saved_errno;		/* for %m */
+	bool has_time;
+	struct timespec ts;
+	uint16_t args_len;
+	unsigned char args[NETTEST_LOG_ARGS_SIZE];
+};
+
+static struct log_ring_s {
+	struct log_rec_s *slot;
+	uint64_t head __attribute__((aligned(64)));	/* written by callers */
+	uint64_t tail __attribute__((aligned(64)));	/* written by thread */
+	uint64_t dropped __attribute__((aligned(64)));
+	bool stop;
+	pthread_t tid;
+} ring;
+
+/*
+ * Conversion specifications
+ */
+
+struct log_spec_s {
+	const char *flags;		/* flags, width and precision */
+	size_t flags_len;
+	bool width_arg, prec_arg;	/* given as '*' */
+	char len;			/* H for hh, L for ll, D for long double */
+	char conv;
+};
+
+/* Parse the specification after the '%' at p, return what follows it */
+static const char *parse_spec(const char *p, struct log_spec_s *sp)
+{
+	memset(sp, 0, sizeof(*sp));
+	sp->flags = p;
+	p += strspn(p, "-+ #0'");
+	if (*p == '*') {
+		sp->width_arg = true;
+		p++;
+	} else
+		p += strspn(p, "0123456789");
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			sp->prec_arg = true;
+			p++;
+		} else
+			p += strspn(p, "0123456789");
+	}
+	sp->flags_len = p - sp->flags;
+
+	switch (*p) {
+	case 'h':
+	case 'l':
+		sp->len = *p++;
+		if (*p == sp->len) {
+			sp->len = sp->len == 'h' ? 'H' : 'L';
+			p++;
+		}
+		break;
+	case 'j':
+	case 'z':
+	case 't':
+		sp->len = *p++;
+		break;
+	case 'L':
+		sp->len = 'D';
+		p++;
+		break;
+	}
+
+	sp->conv = *p;
+	return *p ? p + 1 : p;
+}
+
+/*
+ * Producer
+ */
+
+static inline bool put(struct log_rec_s *r, const void *v, size_t n)
+{
+	if (r->args_len + n > sizeof(r->args))
+		return false;
+	memcpy(r->args + r->args_len, v, n);
+	r->args_len += n;
+
+	return true;
+}
+
+static inline bool put_str(struct log_rec_s *r, const char *str)
+{
+	size_t room = sizeof(r->args) - r->args_len;
+	size_t n;
+
+	if (!str)
+		str = "(null)";
+	if (room == 0)
+		return false;
+	n = strnlen(str, room - 1);
+	memcpy(r->args + r->args_len, str, n);
+	r->args[r->args_len + n] = '\0';
+	r->args_len += n + 1;
+
+	return true;
+}
+
+/* Copy the arguments the specification refers to */
+static bool put_arg(struct log_rec_s *r, const struct log_spec_s *sp,
+			va_list *ap)
+{
+	int64_t i;
+	double d;
+	int n;
+
+	if (sp->width_arg) {
+		n = va_arg(*ap, int);
+		if (!put(r, &n, sizeof(n)))
+			return false;
+	}
+	if (sp->prec_arg) {
+		n = va_arg(*ap, int);
+		if (!put(r, &n, sizeof(n)))
+			return false;
+	}
+
+	switch (sp->conv) {
+	case 'd':
+	case 'i':
+	case 'u':
+	case 'x':
+	case 'X':
+	case 'o':
+	case 'c':
+		switch (sp->len) {
+		case 'l':
+			i = va_arg(*ap, long);
+			break;
+		case 'L':
+			i = va_arg(*ap, long long);
+			break;
+		case 'j':
+			i = va_arg(*ap, intmax_t);
+			break;
+		case 'z':
+			i = va_arg(*ap, ssize_t);
+			break;
+		case 't':
+			i = va_arg(*ap, ptrdiff_t);
+			break;
+		default:
+			i = va_arg(*ap, int);
+			break;
+		}
+		return put(r, &i, sizeof(i));
+
+	case 'p':
+		i = (intptr_t) va_arg(*ap, void *);
+		return put(r, &i, sizeof(i));
+
+	case 's':
+		return put_str(r, va_arg(*ap, const char *));
+
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		if (sp->len == 'D')
+			d = va_arg(*ap, long double);
+		else
+			d = va_arg(*ap, double);
+		return put(r, &d, sizeof(d));
+
+	case 'm':
+	case '%':
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+/* Store a message, never blocking, from the (single) producer thread */
+void nettest_log_record(FILE *stream, int layout, const char *func,
+			const char *file, int line, const char *fmt, ...)
+{
+	struct log_rec_s *r;
+	struct log_spec_s sp;
+	uint64_t head = ring.head;
+	const char *p;
+	va_list ap;
+
+	if (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) >=
+						NETTEST_LOG_SLOTS) {
+		__atomic_add_fetch(&ring.dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	r = &ring.slot[head & (NETTEST_LOG_SLOTS - 1)];
+	r->saved_errno = errno;
+	r->stream = stream;
+	r->layout = layout;
+	r->func = func;
+	r->file = file;
+	r->line = line;
+	r->fmt = fmt;
+	r->has_time = __add_time;
+	if (r->has_time)
+		clock_gettime(CLOCK_MONOTONIC, &r->ts);
+	r->args_len = 0;
+
+	va_start(ap, fmt);
+	for (p = strchr(fmt, '%'); p; p = strchr(p, '%')) {
+		p = parse_spec(p + 1, &sp);
+		if (!put_arg(r, &sp, &ap))
+			break;		/* the message will be truncated */
+	}
+	va_end(ap);
+
+	__atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Consumer
+ */
+
+static inline bool get(const struct log_rec_s *r, size_t *off, void *v,
+			size_t n)
+{
+	if (*off + n > r->args_len)
+		return false;
+	memcpy(v, r->args + *off, n);
+	*off += n;
+
+	return true;
+}
+
+/*
+ * Print a single conversion of the message, with the length modifier
+ * matching how its argument has been stored. Return false when the
+ * arguments are over.
+ */
+static bool print_arg(FILE *f, const struct log_rec_s *r,
+			const struct log_spec_s *sp, size_t *off)
+{
+	char spec[64];
+	const char *str;
+	int star[2], stars = 0, n = 0;
+	size_t j;
+	int64_t i;
+	double d;
+
+	if (sp->conv == '%') {
+		fputc('%', f);
+		return true;
+	}
+	if (sp->conv == 'm') {
+		fputs(strerror(r->saved_errno), f);
+		return true;
+	}
+
+	if ((sp->width_arg && !get(r, off, &star[stars++], sizeof(int))) ||
+	    (sp->prec_arg && !get(r, off, &star[stars++], sizeof(int))))
+		return false;
+
+	/* Rebuild the specification with the stars replaced */
+	spec[n++] = '%';
+	for (j = 0, stars = 0; j < sp->flags_len && n < sizeof(spec) - 16; j++)
+		if (sp->flags[j] == '*')
+			n += sprintf(spec + n, "%d", star[stars++]);
+		else
+			spec[n++] = sp->flags[j];
+
+	switch (sp->conv) {
+	case 's':
+		str = (const char *) r->args + *off;
+		if (*off >= r->args_len)
+			return false;
+		*off += strlen(str) + 1;
+		snprintf(spec + n, sizeof(spec) - n, "s");
+		fprintf(f, spec, str);
+		return true;
+
+	case 'p':
+		if (!get(r, off, &i, sizeof(i)))
+			return false;
+		snprintf(spec + n, sizeof(spec) - n, "p");
+		fprintf(f, spec, (void *) (intptr_t) i);
+		return true;
+
+	case 'c':
+		if (!get(r, off, &i, sizeof(i)))
+			return false;
+		snprintf(spec + n, sizeof(spec) - n, "c");
+		fprintf(f, spec, (int) i);
+		return true;
+
+	case 'e':
+	case 'E':
+	case 'f':
+	case 'F':
+	case 'g':
+	case 'G':
+	case 'a':
+	case 'A':
+		if (!get(r, off, &d, sizeof(d)))
+			return false;
+		snprintf(spec + n, sizeof(spec) - n, "%c", sp->conv);
+		fprintf(f, spec, d);
+		return true;
+
+	default:
+		if (!get(r, off, &i, sizeof(i)))
+			return false;
+		/* Signed values have been extended, unsigned ones may not */
+		if (sp->conv != 'd' && sp->conv != 'i') {
+			switch (sp->len) {
+			case 'H':
+				i = (uint8_t) i;
+				break;
+			case 'h':
+				i = (uint16_t) i;
+				break;
+			case '\0':
+				i = (uint32_t) i;
+				break;
+			}
+		}
+		snprintf(spec + n, sizeof(spec) - n, "ll%c", sp->conv);
+		fprintf(f, spec, (long long) i);
+		return true;
+	}
+}
+
+/* Print the message as __message() does */
+static void print_rec(const struct log_rec_s *r)
+{
+	FILE *f = r->stream;
+	struct log_spec_s sp;
+	const char *p, *q;
+	size_t off = 0;
+
+	if (r->layout != 0 && r->has_time)
+		fprintf(f, "%ld.%09ld ", r->ts.tv_sec, r->ts.tv_nsec);
+	switch (r->layout) {
+	case 0:
+		fprintf(f, "[%s] ", NAME);
+		break;
+	case 1:
+		fprintf(f, "[%s] %s: ", NAME, r->func);
+		break;
+	default:
+		fprintf(f, "[%s](%s@%d) %s: ", NAME, r->file, r->line,
+			r->func);
+		break;
+	}
+
+	for (p = r->fmt; (q = strchr(p, '%')); ) {
+		fwrite(p, 1, q - p, f);
+		p = parse_spec(q + 1, &sp);
+		if (!print_arg(f, r, &sp, &off)) {
+			fputs("...", f);
+			p = "";
+			break;
+		}
+	}
+	fputs(p, f);
+	fputc('\n', f);
+}
+
+static void *log_thread(void *arg)
+{
+	uint64_t head, tail = 0, dropped = 0, n;
+	bool stop;
+
+	while (1) {
+		stop = __atomic_load_n(&ring.stop, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+
+		n = __atomic_load_n(&ring.dropped, __ATOMIC_RELAXED);
+		if (n != dropped) {
+			fprintf(stderr, "[%s] %lu log messages dropped\n",
+				NAME, n - dropped);
+			dropped = n;
+		}
+
+		if (tail == head) {
+			if (stop)
+				break;
+			usleep(NETTEST_LOG_POLL_US);
+			continue;
+		}
+
+		for (; tail != head; tail++)
+			print_rec(&ring.slot[tail & (NETTEST_LOG_SLOTS - 1)]);
+		fflush(stdout);
+		fflush(stderr);
+		__atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/*
+ * Start and stop
+ */
+
+int nettest_log_start(void)
+{
+	static bool registered;
+	int ret;
+
+	if (__log_async)
+		return 0;
+
+	memset(&ring, 0, sizeof(ring));
+	ring.slot = calloc(NETTEST_LOG_SLOTS, sizeof(*ring.slot));
+	if (!ring.slot)
+		return -1;
+
+	ret = pthread_create(&ring.tid, NULL, log_thread, NULL);
+	if (ret) {
+		free(ring.slot);
+		errno = ret;
+		return -1;
+	}
+
+	/* Don't lose the last messages, i.e. the ones before exit() */
+	if (!registered) {
+		atexit(nettest_log_stop);
+		registered = true;
+	}
+	__log_async = true;
+
+	return 0;
+}
+
+/* Print all the pending messages and go back to synchronous output */
+void nettest_log_stop(void)
+{
+	if (!__log_async)
+		return;
+
+	__atomic_store_n(&ring.stop, true, __ATOMIC_RELEASE);
+	pthread_join(ring.tid, NULL);
+	__log_async = false;
+	free(ring.slot);
+	ring.slot = NULL;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _LOG_H
+#define _LOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Asynchronous logging
+ *
+ * Once started, the messages of the misc.h macros are not printed by the
+ * caller, which just stores the format and a copy of its arguments into
+ * a lock-free ring, but by a background thread. When the ring is full the
+ * messages are dropped (and counted) rather than waiting. There must be
+ * one producer only, that is the program must be single threaded.
+ */
+
+#define NETTEST_LOG_SLOTS	4096	/* must be a power of 2 */
+#define NETTEST_LOG_ARGS_SIZE	192	/* bytes of arguments per message */
+#define NETTEST_LOG_POLL_US	1000	/* consumer sleep on empty ring */
+
+extern bool __log_async;
+
+extern int nettest_log_start(void);
+extern void nettest_log_stop(void);
+extern void nettest_log_record(FILE *stream, int layout, const char *func,
+			const char *file, int line, const char *fmt, ...)
+			__attribute__ ((format (printf, 6, 7)));
+
+#endif /* _LOG_H */
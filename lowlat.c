@@ -0,0 +1,178 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "nettest.h"
+
+/* Fault in (and dirty) every page of a buffer before the hot loop */
+void nettest_prefault(void *buf, size_t len)
+{
+	volatile char *p = buf;
+	size_t i;
+
+	for (i = 0; i < len; i += PAGE_SIZE)
+		p[i] = p[i];
+	if (len)
+		p[len - 1] = p[len - 1];
+}
+
+/*
+ * Pin the process, set real-time scheduling, lock the memory and enable
+ * busy polling on the socket according to the low-latency settings.
+ * Failures are not fatal, we just run with a bit more latency, but for the
+ * pinning: a CPU given by the user that can't be used is a mistake.
+ */
+void nettest_setup_lowlat(int s, struct comm_info_s *comm)
+{
+	cpu_set_t set;
+	struct sched_param param;
+	int val;
+	int locked;
+	int ret;
+
+	if (comm->lowlat.cpu >= 0) {
+		CPU_ZERO(&set);
+		CPU_SET(comm->lowlat.cpu, &set);
+		ret = sched_setaffinity(0, sizeof(set), &set);
+		err_if_exit(ret < 0, EXIT_FAILURE,
+				"cannot pin to CPU%d: %m", comm->lowlat.cpu);
+		info("hot loop pinned to CPU%d", comm->lowlat.cpu);
+	}
+
+	if (comm->lowlat.rt_prio > 0) {
+		param.sched_priority = comm->lowlat.rt_prio;
+		ret = sched_setscheduler(0, SCHED_FIFO, &param);
+		warn_if(ret < 0, "cannot set SCHED_FIFO priority %d: %m",
+				comm->lowlat.rt_prio);
+		if (ret == 0)
+			info("using SCHED_FIFO priority %d",
+					comm->lowlat.rt_prio);
+	}
+
+	if (!comm->lowlat.enabled)
+		return;
+
+	locked = mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+	warn_if(!locked, "cannot lock memory: %m");
+
+	val = NETTEST_BUSY_POLL_US;
+	ret = setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &val, sizeof(val));
+	warn_if(ret < 0, "cannot enable busy polling: %m");
+
+	info("low-latency mode enabled: spinning receive%s%s",
+		locked ? ", memory locked" : "",
+		ret == 0 ? ", busy polling" : "");
+}
+
+/*
+ * Run all the threads on the CPUs of the NUMA node of the interface in
+ * use, or of the forced one, and allocate the memory of the calling thread,
+ * and of the ones it starts later, there. The memory policy of the threads
+ * already running can't be changed. The packet buffers already made, if
+ * any, are moved. Return true if the node has changed.
+ */
+bool nettest_setup_numa(struct comm_info_s *comm,
+			struct nettest_arena_s *a)
+{
+	struct comm_lowlat_s *ll = &comm->lowlat;
+	const char *if_name = NULL;
+	int node = ll->numa;
+	int threads = 1;
+	cpu_set_t set;
+	int ret;
+
+	if (comm->type == NETTEST_INFO_TYPE_ETHERNET)
+		if_name = comm->proto.eth.if_name;
+	else if (nettest_ifmon_active(&comm->ifmon))
+		if_name = comm->ifmon.name;
+
+	if (node == NETTEST_NUMA_OFF)
+		return false;
+	if (node == NETTEST_NUMA_AUTO) {
+		/* Not known yet, i.e. a server before its client */
+		if (!if_name)
+			return false;
+		if (nettest_numa_nodes() < 2) {
+			if (ll->numa_placed < 0)
+				info("topology: single NUMA node");
+			ll->numa_placed = 0;
+			return false;
+		}
+		node = nettest_numa_node_of(if_name);
+		if (node < 0) {
+			info("topology: %s has no NUMA node, no placement",
+				if_name);
+			return false;
+		}
+	}
+	if (node == ll->numa_placed)
+		return false;
+
+	ret = nettest_numa_cpus(node, &set);
+	err_if_exit(ret < 0, EXIT_FAILURE,
+			"cannot get the CPUs of NUMA node %d: %m", node);
+	if (ll->cpu >= 0)
+		warn_if(!CPU_ISSET(ll->cpu, &set),
+			"CPU%d is not on NUMA node %d", ll->cpu, node);
+	else {
+		threads = nettest_numa_run_on(&set);
+		warn_if(threads < 0, "cannot run on NUMA node %d: %m", node);
+	}
+	ret = nettest_numa_prefer(node);
+	warn_if(ret < 0, "cannot allocate memory on NUMA node %d: %m", node);
+	if (ret == 0 && a->base) {
+		ret = nettest_numa_move(a->base, a->size, node);
+		warn_if(ret < 0, "cannot move packet buffers to NUMA "
+			"node %d: %m", node);
+	}
+	ll->numa_placed = node;
+
+	if (ll->numa >= 0)
+		info("topology: NUMA node %d forced", node);
+	else
+		info("topology: %s is on NUMA node %d", if_name, node);
+	info("topology: running on %s%d CPUs, memory allocated there",
+		ll->cpu >= 0 ? "1 of its " : "its ", CPU_COUNT(&set));
+	if (threads > 1)
+		info("topology: memory of the %d threads already running "
+			"left where it is", threads - 1);
+	return true;
+}
+
+/*
+ * Make the packet buffers of the calling thread, on hugepages if requested,
+ * and tell their footprint
+ */
+void nettest_setup_arena(struct comm_info_s *comm,
+			struct nettest_arena_s *a, unsigned int num, size_t size)
+{
+	int ret;
+
+	ret = nettest_arena_init(a, num, size, comm->lowlat.hugepages);
+	err_if_exit(ret < 0, EXIT_FAILURE,
+			"cannot allocate %u packet buffers: %m", num);
+	warn_if(comm->lowlat.hugepages &&
+		a->backing != NETTEST_ARENA_HUGETLB,
+		"no hugepages reserved (see vm.nr_hugepages), using %s",
+		nettest_arena_backing_name(a));
+	info("packet buffers: %u of %zu bytes, %zuKB on %s", a->num,
+		a->buf_size, a->size >> 10, nettest_arena_backing_name(a));
+}
@@ -26,6 +26,8 @@
 #include <string.h>
 #include <time.h>
 
+#include "log.h"
+
 /*
  * Misc definitions & macros
  */
@@ -68,6 +70,12 @@ extern int __add_time;
 #define __message(stream, layout, fmt, args...)				\
         do {                                                            \
 		struct timespec t;					\
+		if (unlikely(__log_async) &&				\
+		    (layout == 0 || __debug_level >= layout)) {		\
+			nettest_log_record(stream, layout, __func__,	\
+					__FILE__, __LINE__, fmt, ## args);\
+			break;						\
+		}							\
 		if (__add_time)						\
 			clock_gettime(CLOCK_MONOTONIC, &t);		\
                 switch (layout) {					\
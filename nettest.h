@@ -17,6 +17,7 @@
  */
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/time.h>
@@ -26,36 +27,117 @@
 #include <net/if.h>
 #include <netinet/ether.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sched.h>
 
 #include "misc.h"
+#include "stats.h"
+#include "schedule.h"
+#include "transport.h"
+#include "arena.h"
+#include "ifstats.h"
+#include "numa.h"
 
 #define NETTEST_VERSION		__VERSION
 #define NETTEST_PERIOD_MS	1000
+#define NETTEST_FLOWS_MAX	4096	/* flows (multicast groups) per test */
+#define NETTEST_CLASSES_MAX	8	/* traffic classes per test */
+#define NETTEST_BURST_MAX	1024	/* packets per burst */
 #define NETTEST_UDP_PORT	5000
 #define NETTEST_ETH_P		0xabba
 #define NETTEST_PACKET_SIZE	1000
 #define NETTEST_FILLER_SIZE	1500
+#define NETTEST_BUSY_POLL_US	50
+#define NETTEST_REPORT_MAX	86400	/* longest report interval in secs */
+
+#define NETTEST_BUF_MS		200	/* traffic socket buffers must absorb */
+#define NETTEST_BUF_OVERHEAD	640	/* kernel memory overhead per packet */
+#define NETTEST_BUF_MIN_PKTS	64
+#define NETTEST_BUF_MAX		(64 << 20)
+#define NETTEST_BUF_WIRE_PPS	1000000	/* rate assumed at wire speed */
 
 #define NETTEST_INFO_TYPE_UDP	1
 #define NETTEST_INFO_TYPE_ETHERNET	2
+#define NETTEST_INFO_TYPE_TCP	3
+
+/* The Ethernet header of 802.1Q tagged frames */
+struct nettest_vlan_header_s {
+	uint8_t ether_dhost[ETH_ALEN];
+	uint8_t ether_shost[ETH_ALEN];
+	uint16_t tpid;
+	uint16_t tci;
+	uint16_t ether_type;
+} __attribute__ ((packed));
+
+/* A destination of the client with its own sequence numbers space */
+struct comm_dest_s {
+	union comm_dest_addr_u {
+		struct sockaddr_in in;
+		struct sockaddr_ll ll;
+	} addr;
+	uint32_t seq;
+	union {				/* link header, see prepare_dest() */
+		struct ether_header eth;
+		struct nettest_vlan_header_s vlan;
+	} hdr;
+	unsigned int hdr_len;
+};
+
+/* A traffic class with its own marking and rate */
+struct comm_class_s {
+	int prio;		/* PCP (Ethernet) or DSCP (UDP), -1 is none */
+	unsigned int vlan;	/* VLAN ID (Ethernet only) */
+	unsigned int period_us;	/* mean period, 0 means wire speed */
+	struct nettest_sched_s sched;	/* empty at wire speed */
+	unsigned int sched_pos;
+	int s;			/* socket used by the class */
+	uint64_t t_next;	/* next departure time */
+	unsigned int dest;	/* next destination (round robin) */
+	unsigned int burst_dest, burst_left;
+};
+
 struct comm_info_s {
 	unsigned int type;
+	const struct nettest_transport_s *tr;	/* backend of the type */
 	size_t packet_size;
-	unsigned int period_ms;
+	unsigned int period_us;
 	unsigned int packets_num;
+	unsigned int report_s;		/* interval report period, 0 is off */
 	bool use_ack;
+	uint32_t rx_drops;		/* packets dropped by our socket so far */
+	struct comm_dest_s *dests;	/* client destinations */
+	unsigned int dests_num;
+	struct comm_class_s classes[NETTEST_CLASSES_MAX];
+	unsigned int classes_num;
+	int rx_prio;			/* PCP or DSCP of the last packet */
+	struct comm_dest_s peer;	/* last sender, the server ACKs it */
+	struct comm_ctrl_s {
+		char *address;		/* server address (client only) */
+		unsigned int port;	/* 0 means no control channel */
+		int s;			/* listening or connected socket */
+		int conn;		/* server side connection */
+	} ctrl;
+	struct comm_lowlat_s {
+		bool enabled;
+		int cpu;		/* -1 means no pinning */
+		int rt_prio;		/* 0 means no SCHED_FIFO */
+		bool hugepages;		/* packet buffers on 2MB pages */
+		int numa;		/* node or NETTEST_NUMA_AUTO/OFF */
+		int numa_placed;	/* -1 if not placed yet */
+	} lowlat;
+	struct nettest_ifmon_s ifmon;	/* counters of the interface in use */
 	union comm_proto_u {
-		struct comm_udp_data_s {
+		struct comm_udp_data_s {	/* TCP too */
 			struct sockaddr_in raw_address;
 			unsigned int port;
 			char *multicast_address;
-			struct sockaddr_in raw_peer_address;
+			unsigned int groups_num;
+			char *source_address;
 		} udp;
 		struct comm_ethernt_data_s {
 			char *if_name;
 			uint8_t raw_if_address[ETH_ALEN];
 			struct sockaddr_ll raw_address;
-			struct sockaddr_ll raw_peer_address;
 		} eth;
 	} proto;
 };
@@ -65,23 +147,44 @@ struct comm_info_s {
 #define NETTEST_CMD_STOP	2
 #define NETTEST_MODE_NONE 0
 #define NETTEST_MODE_ACK  1
+
+/*
+ * Version of the packets format, to be changed with the layout of struct
+ * data_packet_s. The first format had none, and zeros where it is now, so
+ * it counts as version 1.
+ */
+#define NETTEST_PKT_VERSION	2
+
 struct data_packet_s {
 	union data_packet_u {
 		struct data_udp_packet_u {
 		} udp;
+		struct data_tcp_packet_u {
+			uint32_t len;		/* of the record */
+		} tcp;
 		struct data_ethernet_packet_u {
 			struct ether_header eth;
 		} eth;
 	} proto;
 	unsigned char command;
 	unsigned char mode;
-	unsigned int period_ms;
+	unsigned char version;		/* NETTEST_PKT_VERSION */
+	unsigned int period_us;
 	unsigned int pkt_num;
+	unsigned short flow;		/* index of the flow within the test */
+	unsigned short flows;		/* number of flows of the test */
+	unsigned char cls;		/* traffic class of the flow */
+	unsigned char classes;		/* number of traffic classes */
+	signed char prio;		/* marking of the class, -1 is none */
+	unsigned short burst;		/* packets per burst of the class */
+	uint64_t tx_ns;			/* sender CLOCK_REALTIME timestamp */
+	uint64_t ack_rx_ns;		/* ACKs only, when the server got it */
+	uint64_t ack_tx_ns;		/* ACKs only, when the server sent it */
 	char filler[NETTEST_FILLER_SIZE];
 };
 
 /* Get the index of an interface */
-static int get_ifindex(int sock, char *name)
+static inline int get_ifindex(int sock, char *name)
 {
         struct ifreq ifr;
         int ret;
@@ -97,7 +200,7 @@ static int get_ifindex(int sock, char *name)
 }
 
 /* Get the MAC address of an interface */
-static int get_ifaddr(int sock, char *name, uint8_t if_addr[ETH_ALEN])
+static inline int get_ifaddr(int sock, char *name, uint8_t if_addr[ETH_ALEN])
 {
         struct ifreq ifr;
         int ret;
@@ -113,7 +216,7 @@ static int get_ifaddr(int sock, char *name, uint8_t if_addr[ETH_ALEN])
         return 0;
 }
 
-static int parse_mac(char *str, uint8_t data[])
+static inline int parse_mac(char *str, uint8_t data[])
 {
         unsigned int d;
         int n = strlen(str);
@@ -146,7 +249,7 @@ static int parse_mac(char *str, uint8_t data[])
                         return 0;
         }
 
-        return 1;
+        return i == 6;
 }
 
 static inline void nettest_set_address(struct comm_info_s *comm,
@@ -156,14 +259,15 @@ static inline void nettest_set_address(struct comm_info_s *comm,
 
         switch (comm->type) {
         case NETTEST_INFO_TYPE_UDP:
+        case NETTEST_INFO_TYPE_TCP:
 		ret = inet_aton(address, &comm->proto.udp.raw_address.sin_addr);
-                err_if_exit(ret < 0, EXIT_FAILURE,
+                err_if_exit(ret == 0, EXIT_FAILURE,
                                         "cannot convert address");
 		break;
 
 	case NETTEST_INFO_TYPE_ETHERNET:
 		ret = parse_mac(address, comm->proto.eth.raw_address.sll_addr);
-                err_if_exit(ret < 0, EXIT_FAILURE,
+                err_if_exit(ret == 0, EXIT_FAILURE,
                                         "cannot convert address");
 		break;
 
@@ -180,6 +284,7 @@ static inline char *nettest_get_address(struct comm_info_s *comm)
 
         switch (comm->type) {
         case NETTEST_INFO_TYPE_UDP:
+        case NETTEST_INFO_TYPE_TCP:
                 ret = asprintf(&s, "%s:%u",
                         inet_ntoa(comm->proto.udp.raw_address.sin_addr),
                         ntohs(comm->proto.udp.raw_address.sin_port));
@@ -207,16 +312,17 @@ static inline char *nettest_get_peer_address(struct comm_info_s *comm)
 
         switch (comm->type) {
         case NETTEST_INFO_TYPE_UDP:
+        case NETTEST_INFO_TYPE_TCP:
 		ret = asprintf(&s, "%s:%u",
-			inet_ntoa(comm->proto.udp.raw_peer_address.sin_addr),
-			ntohs(comm->proto.udp.raw_peer_address.sin_port));
+			inet_ntoa(comm->peer.addr.in.sin_addr),
+			ntohs(comm->peer.addr.in.sin_port));
 		err_if_exit(ret < 0, EXIT_FAILURE,
 					"cannot convert peer address");
 		return s;
 
         case NETTEST_INFO_TYPE_ETHERNET:
                 ret = asprintf(&s, "%s",
-                        ether_ntoa((struct ether_addr *) &comm->proto.eth.raw_peer_address.sll_addr));
+                        ether_ntoa((struct ether_addr *) comm->peer.addr.ll.sll_addr));
                 err_if_exit(ret < 0, EXIT_FAILURE,
                                         "cannot convert peer address");
                 return s;
@@ -233,6 +339,9 @@ static inline char *nettest_get_proto(struct comm_info_s *comm)
         case NETTEST_INFO_TYPE_UDP:
                 return "UDP";
 
+        case NETTEST_INFO_TYPE_TCP:
+                return "TCP";
+
         case NETTEST_INFO_TYPE_ETHERNET:
                 return "Ethernet";
 
@@ -241,3 +350,106 @@ static inline char *nettest_get_proto(struct comm_info_s *comm)
                 exit(EXIT_FAILURE);
         }
 }
+
+/*
+ * Control channel
+ *
+ * A TCP connection on a side port where the client negotiates the test
+ * parameters with the server, which sends back its statistics at the
+ * end of the test. Like the data packets, messages are in host byte
+ * order.
+ */
+
+#define NETTEST_CTRL_MAGIC	0x6e746374	/* "ntct" */
+#define NETTEST_CTRL_VERSION	1
+#define NETTEST_CTRL_POLL_MS	100	/* server polling period */
+#define NETTEST_CTRL_TIMEOUT_MS	2000	/* client waiting for answers */
+
+#define NETTEST_EXIT_LOSS	2	/* the server detected troubles */
+#define NETTEST_EXIT_NO_RESULT	3	/* the server didn't answer */
+
+enum nettest_ctrl_type_e {
+	NETTEST_CTRL_HELLO = 1,		/* test parameters (to server) */
+	NETTEST_CTRL_ACCEPT,		/* negotiation result (to client) */
+	NETTEST_CTRL_RESULT_REQ,	/* send the results now (to server) */
+	NETTEST_CTRL_RESULT,		/* server statistics (to client) */
+};
+
+struct nettest_ctrl_hello_s {
+	uint32_t version;
+	uint32_t type;			/* NETTEST_INFO_TYPE_* */
+	uint32_t packet_size;
+	uint32_t period_us;		/* combined mean period */
+	uint32_t packets_num;
+	uint32_t flows;
+	uint32_t classes;
+	uint32_t burst;
+	uint32_t use_ack;
+} __attribute__ ((packed));
+
+struct nettest_ctrl_accept_s {
+	int32_t status;			/* 0 or a negative errno */
+	char reason[128];
+} __attribute__ ((packed));
+
+struct nettest_ctrl_class_s {
+	int32_t prio;
+	uint64_t received, lost, remarked;
+	uint64_t latency_p50_us, latency_p99_us, latency_max_us;
+} __attribute__ ((packed));
+
+struct nettest_ctrl_result_s {
+	uint64_t received, lost, lost_local, dup, reordered;
+	uint64_t outages, outage_max_ns;
+	uint32_t flows, flows_received, flows_lossy;
+	uint64_t unknown;
+	uint32_t classes;
+	struct nettest_ctrl_class_s cls[NETTEST_CLASSES_MAX];
+} __attribute__ ((packed));
+
+struct nettest_ctrl_msg_s {
+	struct nettest_ctrl_header_s {
+		uint32_t magic;
+		uint16_t type;
+		uint16_t len;		/* of the body */
+	} __attribute__ ((packed)) hdr;
+	union nettest_ctrl_body_u {
+		struct nettest_ctrl_hello_s hello;
+		struct nettest_ctrl_accept_s accept;
+		struct nettest_ctrl_result_s result;
+	} body;
+} __attribute__ ((packed));
+
+extern int nettest_ctrl_send(int s, unsigned int type,
+				const void *body, size_t len);
+extern int nettest_ctrl_recv(int s, struct nettest_ctrl_msg_s *msg,
+				int flags);
+extern int nettest_set_timeout(int s, int opt, unsigned int ms);
+
+/*
+ * Low-latency mode
+ */
+
+extern void nettest_prefault(void *buf, size_t len);
+extern void nettest_setup_lowlat(int s, struct comm_info_s *comm);
+extern bool nettest_setup_numa(struct comm_info_s *comm,
+			struct nettest_arena_s *a);
+extern void nettest_setup_arena(struct comm_info_s *comm,
+			struct nettest_arena_s *a, unsigned int num, size_t size);
+
+/*
+ * Interface counters
+ */
+
+extern void nettest_setup_ifmon(struct comm_info_s *comm);
+extern void nettest_ifmon_follow(struct comm_info_s *comm,
+			const struct comm_dest_s *dest);
+extern void nettest_report_ifstats(struct comm_info_s *comm, bool total);
+
+/*
+ * Socket buffers sizing
+ */
+
+extern int nettest_bufsize(unsigned int period_us, unsigned int burst,
+				size_t len);
+extern void nettest_set_bufsize(int s, bool rx, int size);
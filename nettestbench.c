@@ -0,0 +1,345 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include "misc.h"
+#include "stats.h"
+#include "transport.h"
+
+int __debug_level;
+int __add_time;
+
+#define CHUNK_SIZE		65536
+#define DEFAULT_PACKETS		10000000
+#define DEFAULT_SIZE		1000
+#define DISPATCH_RUNS		5
+
+struct tuple_s {
+	uint32_t seq;
+	uint32_t size;
+	uint64_t ts_ns;
+};
+
+struct pattern_s {
+	double loss;		/* probability a loss burst starts */
+	unsigned int burst;	/* packets lost per burst */
+	double reorder;		/* probability to swap two packets */
+	double dup;		/* probability to duplicate a packet */
+	unsigned int period_ns;
+	unsigned int size;
+
+	/* What has been injected so far */
+	uint64_t n_lost, n_reordered, n_dup;
+};
+
+static uint64_t rnd_state = 88172645463325252ULL;
+
+/* Marsaglia's xorshift, we need speed not quality */
+static inline double rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 7;
+	rnd_state ^= rnd_state << 17;
+
+	return (rnd_state >> 11) * (1.0 / (1ULL << 53));
+}
+
+/*
+ * Fill the tuples array following the pattern and return the number of
+ * generated entries, the next sequence number to use is in *seq.
+ */
+static size_t generate(struct tuple_s *t, size_t n, uint32_t *seq,
+			uint64_t *ts, struct pattern_s *p)
+{
+	struct tuple_s tmp;
+	size_t i = 0;
+
+	while (i < n) {
+		if (p->loss && rnd() < p->loss) {
+			*seq += p->burst;
+			p->n_lost += p->burst;
+		}
+
+		*ts += p->period_ns;
+		t[i].seq = (*seq)++;
+		t[i].ts_ns = *ts;
+		t[i].size = p->size;
+		i++;
+
+		if (p->dup && i < n && rnd() < p->dup) {
+			t[i] = t[i - 1];
+			p->n_dup++;
+			i++;
+		}
+	}
+
+	/*
+	 * Swap adjacent packets, never across chunk boundaries nor with a
+	 * duplicated one (which would turn the duplicate into a late packet)
+	 */
+	if (p->reorder)
+		for (i = 0; i + 1 < n; i++)
+			if (t[i].seq + 1 == t[i + 1].seq &&
+			    (i == 0 || t[i - 1].seq != t[i].seq) &&
+			    rnd() < p->reorder) {
+				tmp = t[i];
+				t[i] = t[i + 1];
+				t[i + 1] = tmp;
+				p->n_reordered++;
+				i++;
+			}
+
+	return n;
+}
+
+/*
+ * Transport dispatch
+ *
+ * The packets are sent through the operations table of a sink backend,
+ * which does what a real one does before the system call (an iovec and a
+ * message header per packet) and then drops the batch, and through a
+ * direct call to the same function: the difference is the cost of the
+ * indirect call, paid once per batch.
+ */
+
+static __attribute__ ((noinline)) int sink_send(int s,
+			struct nettest_tx_s *tx, unsigned int n, int flags)
+{
+	struct mmsghdr msgs[NETTEST_TRANSPORT_BATCH];
+	struct iovec iov[NETTEST_TRANSPORT_BATCH];
+	unsigned int i;
+
+	n = min(n, (unsigned int) NETTEST_TRANSPORT_BATCH);
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = tx[i].pkt;
+		iov[i].iov_len = tx[i].len;
+		msgs[i].msg_hdr.msg_name = tx[i].dest;
+		msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		msgs[i].msg_hdr.msg_control = NULL;
+		msgs[i].msg_hdr.msg_controllen = 0;
+		msgs[i].msg_hdr.msg_flags = 0;
+	}
+	/* Where sendmmsg() would read them */
+	__asm__ __volatile__ ("" : : "r" (msgs), "r" (iov) : "memory");
+
+	return n;
+}
+
+static const struct nettest_transport_s sink_transport = {
+	.name = "sink",
+	.send = sink_send,
+};
+
+/* Return the ns per packet of sending packets in batches of n */
+static double dispatch_run(unsigned long packets, unsigned int n, bool table)
+{
+	/* Read at each call, so that the compiler can't call it directly */
+	const struct nettest_transport_s *volatile tr = &sink_transport;
+	static uint8_t pkt[DEFAULT_SIZE];
+	struct nettest_tx_s tx[NETTEST_TRANSPORT_BATCH];
+	unsigned long done;
+	uint64_t t0;
+	unsigned int i;
+
+	for (i = 0; i < n; i++) {
+		tx[i].dest = NULL;
+		tx[i].pkt = (struct data_packet_s *) pkt;
+		tx[i].len = sizeof(pkt);
+	}
+
+	t0 = nettest_now_ns();
+	if (table)
+		for (done = 0; done < packets; done += n)
+			tr->send(-1, tx, n, 0);
+	else
+		for (done = 0; done < packets; done += n)
+			sink_send(-1, tx, n, 0);
+
+	return (nettest_now_ns() - t0) / (double) done;
+}
+
+static void dispatch_bench(unsigned long packets)
+{
+	unsigned int batch[] = { 1, NETTEST_TRANSPORT_BATCH };
+	double direct, table;
+	unsigned int i, r;
+
+	for (i = 0; i < ARRAY_SIZE(batch); i++) {
+		/* Warm up the caches and the branch predictor first */
+		dispatch_run(packets / 10, batch[i], true);
+
+		/* The best of some alternated runs, the others had noise */
+		direct = table = INFINITY;
+		for (r = 0; r < DISPATCH_RUNS; r++) {
+			direct = min(direct, dispatch_run(packets / DISPATCH_RUNS,
+						batch[i], false));
+			table = min(table, dispatch_run(packets / DISPATCH_RUNS,
+						batch[i], true));
+		}
+		info("batches of %u packets: direct call %.2fns, ops table "
+			"%.2fns per packet (%+.2fns)", batch[i], direct, table,
+			table - direct);
+	}
+}
+
+/*
+ * Usage
+ */
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: %s [-h | --help] [-n <packets>] [-l <loss%%>]\n"
+		"               [-b <burst>] [-r <reorder%%>] [-D <dup%%>]\n"
+		"               [-f <period_ns>] [-s <size>]\n"
+		"               [-T | --transport]\n"
+		"  defaults are:\n"
+		"    - packets are %d\n"
+		"    - no loss, reordering or duplication\n"
+		"    - lost burst is 1 packet\n"
+		"    - the sequence analysis is measured, otherwise the\n"
+		"      dispatch of the packets through the transport table\n",
+			NAME, DEFAULT_PACKETS);
+
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Main
+ */
+
+int main(int argc, char **argv)
+{
+	int c;
+	struct option long_options[] = {
+		{ "help",		no_argument,		NULL, 'h'},
+		{ "transport",		no_argument,		NULL, 'T'},
+		{ 0, 0, 0, 0    /* END */ }
+	};
+	int option_index = 0;
+	struct pattern_s pat = {
+		.burst = 1,
+		.period_ns = 1000,
+		.size = DEFAULT_SIZE,
+	};
+	unsigned long packets = DEFAULT_PACKETS;
+	bool transport = false;
+	static struct tuple_s tuples[CHUNK_SIZE];
+	static struct nettest_stats_s stats;
+	uint32_t seq, missed;
+	uint64_t ts, t0, elapsed_ns, done;
+	size_t i, n;
+	char buf[256];
+
+	opterr = 0;          /* disbale default error message */
+	while (1) {
+		option_index = 0; /* getopt_long stores the option index here */
+
+		c = getopt_long(argc, argv, "hn:l:b:r:D:f:s:T",
+				long_options, &option_index);
+
+		/* Detect the end of the options */
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage();
+
+		case 'n':
+			packets = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'l':
+			pat.loss = strtod(optarg, NULL) / 100.;
+			break;
+
+		case 'b':
+			pat.burst = strtoul(optarg, NULL, 10);
+			err_if_exit(pat.burst < 1, EXIT_FAILURE,
+				    "burst must be at least 1 packet");
+			break;
+
+		case 'r':
+			pat.reorder = strtod(optarg, NULL) / 100.;
+			break;
+
+		case 'D':
+			pat.dup = strtod(optarg, NULL) / 100.;
+			break;
+
+		case 'f':
+			pat.period_ns = strtoul(optarg, NULL, 10);
+			break;
+
+		case 's':
+			pat.size = strtoul(optarg, NULL, 10);
+			break;
+
+		case 'T':
+			transport = true;
+			break;
+
+		case ':':
+		case '?':
+			err("invalid option %s", argv[optind - 1]);
+			exit(EXIT_FAILURE);
+
+		default:
+			BUG();
+		}
+	}
+
+	if (transport) {
+		dispatch_bench(packets);
+		return 0;
+	}
+
+	nettest_stats_reset(&stats);
+	seq = 0;
+	ts = 0;
+	elapsed_ns = 0;
+	for (done = 0; done < packets; done += n) {
+		n = generate(tuples, min((uint64_t) CHUNK_SIZE, packets - done),
+				&seq, &ts, &pat);
+
+		t0 = nettest_now_ns();
+		for (i = 0; i < n; i++)
+			nettest_stats_update(&stats, tuples[i].seq,
+					tuples[i].ts_ns, tuples[i].size,
+					&missed);
+		elapsed_ns += nettest_now_ns() - t0;
+	}
+
+	info("processed %lu packets in %.3fs: %.2fns per packet (%.1f Mpps)",
+		packets, elapsed_ns / (double) NSEC_PER_SEC,
+		elapsed_ns / (double) packets,
+		packets * 1000. / elapsed_ns);
+	info("injected %lu lost, %lu dup, %lu reordered",
+		pat.n_lost, pat.n_dup, pat.n_reordered);
+	nettest_stats_snprintf(buf, sizeof(buf), &stats);
+	info("detected %s", buf);
+
+	return 0;
+}
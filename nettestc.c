@@ -17,197 +17,564 @@
  */
 
 #include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
 #include "nettest.h"
+#include "prof.h"
+#include "pcap.h"
+#include "offset.h"
 
 int __debug_level;
 int __add_time;
 
+#define STREAM_CHUNKS		8	/* of the TCP send ring */
+#define STREAM_CHUNK_SIZE	(64 << 10)	/* bytes per send */
+
+#define REPLAY_BATCH		64	/* packets per send batch */
+
+/* Traffic replay from a capture file */
+static struct replay_s {
+	char *file;
+	struct nettest_pcap_s pcap;
+	double speed;			/* 0 means as fast as possible */
+	bool frames;			/* copy the frames contents too */
+	uint64_t clamped;		/* frames out of the packet sizes */
+} replay = {
+	.speed = 1,
+};
+
+#define SWEEP_MAX		65536	/* destinations */
+#define SWEEP_LINGER_MS		1000	/* wait for the last ACKs */
+#define SWEEP_RESOLVE_MS	3000	/* the kernel gives up an ARP lookup */
+#define SWEEP_ACK_BATCH		16	/* ACKs per receive */
+
+/* Sweep of many destinations, each one a single flow test */
+static struct sweep_s {
+	char *file;
+	struct sweep_dest_s {
+		uint64_t errors;	/* packets the kernel refused to send */
+		uint64_t acked;
+		uint64_t acked_report;	/* at the last interval report */
+		uint64_t rtt_min_ns;
+		uint64_t rtt_max_ns;
+		uint64_t rtt_sum_ns;
+	} *dest;
+	uint32_t *hash;			/* destination index + 1 by address */
+	unsigned int hash_mask;
+	uint64_t unknown;		/* ACKs from unknown addresses */
+} sweep;
+
+/* The packet buffers of the main thread, the most any loop takes */
+#define ARENA_BUFS		REPLAY_BATCH
+static struct nettest_arena_s arena;
+
 /*
  * Local functions
  */
 
-static int open_socket(struct comm_info_s *comm)
+/*
+ * Setup the traffic classes: UDP classes get their own socket marked with
+ * the class DSCP and the matching SO_PRIORITY, while Ethernet ones share
+ * the socket s and get an 802.1Q tag per frame.
+ */
+static void setup_classes(int s, struct comm_info_s *comm)
 {
-	int s;
-	int on;
-	u_char ttl;
+	struct comm_class_s *cls;
+	unsigned int i;
+	int val;
 	int ret;
 
-	switch (comm->type) {
-	case NETTEST_INFO_TYPE_UDP:
-		dbg("selected communication protocol is UDP");
+	for (i = 0; i < comm->classes_num; i++) {
+		cls = &comm->classes[i];
+		cls->s = s;
+		if (cls->prio < 0 ||
+		    !(comm->tr->caps & NETTEST_CAP_CLASS_SOCKET))
+			continue;
 
-		s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-		err_if_exit(s < 0, EXIT_FAILURE, "unable to open socket: %m");
+		if (i > 0)
+			cls->s = comm->tr->open(comm, false);
 
-		/* Set socket to allow broadcast */
-		on = 1;
-		ret = setsockopt(s, SOL_SOCKET, SO_BROADCAST,
-					(void *) &on, sizeof(on));
+		val = cls->prio << 2;
+		ret = setsockopt(cls->s, IPPROTO_IP, IP_TOS, &val, sizeof(val));
 		err_if_exit(ret < 0, EXIT_FAILURE,
-					"cannot set broadcast permission: %m");
+				"cannot set DSCP %d: %m", cls->prio);
 
-		/* Set multicast TTL for multicast packets */
-		ttl = 5;
-		ret = setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
-		err_if_exit(ret < 0, EXIT_FAILURE,
-					"cannot set multicast TTL: %m");
+		/* Class selector to priority, i.e. EF (46) goes to 5 */
+		val = cls->prio >> 3;
+		ret = setsockopt(cls->s, SOL_SOCKET, SO_PRIORITY,
+					&val, sizeof(val));
+		warn_if(ret < 0, "cannot set priority %d: %m", val);
+	}
+}
 
-		/* Complete UDP struct sockaddr_in data */
-		comm->proto.udp.raw_address.sin_family = AF_INET;
-		comm->proto.udp.raw_address.sin_port =
-					htons(comm->proto.udp.port);
-		break;
+/*
+ * Setup the destinations: groups_num consecutive IPv4 addresses starting
+ * from the server one (i.e. multicast groups) for each traffic class,
+ * each one is a flow with its headers built once here.
+ */
+static void setup_dests(struct comm_info_s *comm, unsigned int groups_num)
+{
+	struct comm_dest_s *dest;
+	in_addr_t addr;
+	unsigned int i;
 
-	case NETTEST_INFO_TYPE_ETHERNET:
-		dbg("selected communication protocol is Ethernet");
-
-		s = socket(AF_PACKET, SOCK_RAW, IPPROTO_RAW);
-		err_if_exit(s < 0, EXIT_FAILURE, "unable to open socket: %m");
-
-		/* Complete the Ethernet sockaddr_ll data */
-		ret = get_ifindex(s, comm->proto.eth.if_name);
-                err_if_exit(ret < 0, EXIT_FAILURE,
-                                        "cannot get interface index");
-		comm->proto.eth.raw_address.sll_ifindex = ret;
-		comm->proto.eth.raw_address.sll_family = AF_PACKET;
-		comm->proto.eth.raw_address.sll_protocol = htons(ETH_P_ALL);
-		comm->proto.eth.raw_address.sll_halen = ETH_ALEN;
-
-		ret = bind(s, (struct sockaddr *) &comm->proto.eth.raw_address,
-				sizeof(comm->proto.eth.raw_address));
-                err_if_exit(ret < 0, EXIT_FAILURE,
-                                        "cannot bind interface");
-
-	        /* Get the MAC address of the interface to send on */
-		ret = get_ifaddr(s, comm->proto.eth.if_name,
-					comm->proto.eth.raw_if_address);
-		err_if_exit(ret < 0, EXIT_FAILURE,
-					"cannot get MAC address: %m");
+	comm->dests_num = groups_num * comm->classes_num;
+	comm->dests = calloc(comm->dests_num, sizeof(*comm->dests));
+	err_if_exit(!comm->dests, EXIT_FAILURE,
+			"cannot allocate destinations");
 
-		break;
+	for (i = 0; i < comm->dests_num; i++) {
+		dest = &comm->dests[i];
+		switch (comm->type) {
+		case NETTEST_INFO_TYPE_UDP:
+		case NETTEST_INFO_TYPE_TCP:
+			dest->addr.in = comm->proto.udp.raw_address;
+			addr = ntohl(dest->addr.in.sin_addr.s_addr);
+			dest->addr.in.sin_addr.s_addr =
+					htonl(addr + i % groups_num);
+			break;
+
+		case NETTEST_INFO_TYPE_ETHERNET:
+			dest->addr.ll = comm->proto.eth.raw_address;
+			break;
+		}
+		comm->tr->prepare_dest(comm, &comm->classes[i / groups_num],
+					dest);
+	}
+}
 
-	default:
-		err("unsupported communication protocol!");
-		exit(EXIT_FAILURE);
+/*
+ * Return the class whose packet must be sent next: the paced class with
+ * the earliest deadline if it is due, otherwise the wire speed classes
+ * fill the gaps round robin. When nothing is ready the paced class to
+ * wait for is returned.
+ */
+static struct comm_class_s *next_class(struct comm_info_s *comm,
+				uint64_t now)
+{
+	static unsigned int rr;
+	struct comm_class_s *cls, *best = NULL;
+	unsigned int i;
+
+	for (i = 0; i < comm->classes_num; i++) {
+		cls = &comm->classes[i];
+		if (cls->sched.num && (!best || cls->t_next < best->t_next))
+			best = cls;
 	}
+	if (best && best->t_next <= now)
+		return best;
 
-	return s;
+	for (i = 0; i < comm->classes_num; i++) {
+		cls = &comm->classes[rr++ % comm->classes_num];
+		if (cls->sched.num == 0)
+			return cls;
+	}
+
+	return best;
 }
 
-static ssize_t send_data(int s, struct comm_info_s *comm,
+static ssize_t recv_data(int s, struct comm_info_s *comm,
 				struct data_packet_s *pkt, size_t len)
 {
-	switch (comm->type) {
-	case NETTEST_INFO_TYPE_UDP:
-		return sendto(s, pkt, len, 0,
-				(struct sockaddr *) &comm->proto.udp.raw_address,
-				sizeof(comm->proto.udp.raw_address));
+	struct nettest_rx_s rx = {
+		.pkt = pkt,
+		.size = len,
+	};
+	int ret;
 
-	case NETTEST_INFO_TYPE_ETHERNET:
-		memcpy(pkt->proto.eth.eth.ether_shost,
-				comm->proto.eth.raw_if_address, ETH_ALEN);
-		memcpy(pkt->proto.eth.eth.ether_dhost,
-				comm->proto.eth.raw_address.sll_addr, ETH_ALEN);
-		pkt->proto.eth.eth.ether_type = htons(0xabba);
+	if (!comm->lowlat.enabled) {
+		ret = comm->tr->recv(s, comm, &rx, 1, 0);
+		prof_syscall(PROF_RECV, ret < 0 ? ret : rx.len);
 
-		return sendto(s, pkt, len, 0, NULL, 0);
+		return ret < 0 ? ret : rx.len;
+	}
+
+	/* Spin on the socket instead of sleeping into the kernel */
+	do {
+		ret = comm->tr->recv(s, comm, &rx, 1, MSG_DONTWAIT);
+		prof_syscall(PROF_RECV, ret < 0 ? ret : rx.len);
+	} while (ret < 0 && errno == EAGAIN);
 
-        default:
-                err("unsupported communication protocol!");
-                exit(EXIT_FAILURE);
-        }
+	return ret < 0 ? ret : rx.len;
 }
 
-static ssize_t recv_data(int s, struct comm_info_s *comm,
-				struct data_packet_s *pkt, size_t len)
+/* Sleep, or spin in low-latency mode, until the absolute time t_ns */
+static void wait_until(struct comm_info_s *comm, uint64_t t_ns)
 {
-	struct sockaddr_in addr;
-	socklen_t addr_len;
+	struct timespec ts;
 
-        switch (comm->type) {
-        case NETTEST_INFO_TYPE_UDP:
-		bzero(&addr, sizeof(addr));
-		addr_len = sizeof(addr);
-		return recvfrom(s, pkt, len, 0,
-				(struct sockaddr *) &addr, &addr_len);
+	if (comm->lowlat.enabled) {
+		while (nettest_now_ns() < t_ns)
+			;
+		return;
+	}
 
-        default:
-                err("unsupported communication protocol!");
-                exit(EXIT_FAILURE);
-        }
+	ts.tv_sec = t_ns / NSEC_PER_SEC;
+	ts.tv_nsec = t_ns % NSEC_PER_SEC;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+				NULL) == EINTR)
+		;
 }
 
-static void mainloop(int s, struct comm_info_s *comm)
+/*
+ * Control channel
+ */
+
+/* Connect to the server and negotiate the test parameters */
+static void ctrl_connect(struct comm_info_s *comm)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(comm->ctrl.port),
+	};
+	struct nettest_ctrl_hello_s hello = {
+		.version = NETTEST_CTRL_VERSION,
+		.type = comm->type,
+		.packet_size = sizeof(struct data_packet_s) -
+				NETTEST_FILLER_SIZE + comm->packet_size,
+		.period_us = comm->period_us,
+		.packets_num = comm->packets_num,
+		.flows = comm->dests_num,
+		.classes = comm->classes_num,
+		.use_ack = comm->use_ack,
+	};
+	struct nettest_ctrl_msg_s msg;
+	unsigned int i;
+	int ret;
+
+	if (comm->ctrl.address) {
+		ret = inet_aton(comm->ctrl.address, &addr.sin_addr);
+		err_if_exit(ret == 0, EXIT_FAILURE,
+				"invalid control address %s", comm->ctrl.address);
+	} else {
+		err_if_exit(comm->type == NETTEST_INFO_TYPE_ETHERNET ||
+			    IN_MULTICAST(ntohl(comm->proto.udp.raw_address.sin_addr.s_addr)),
+			    EXIT_FAILURE, "the control channel needs the "
+			    "server address, use -k <addr>:<port>");
+		addr.sin_addr = comm->proto.udp.raw_address.sin_addr;
+	}
+	for (i = 0; i < comm->classes_num; i++)
+		hello.burst = max(hello.burst, comm->classes[i].sched.burst);
+
+	comm->ctrl.s = socket(AF_INET, SOCK_STREAM, 0);
+	err_if_exit(comm->ctrl.s < 0, EXIT_FAILURE,
+			"unable to open control socket: %m");
+	nettest_set_timeout(comm->ctrl.s, SO_SNDTIMEO, NETTEST_CTRL_TIMEOUT_MS);
+	nettest_set_timeout(comm->ctrl.s, SO_RCVTIMEO, NETTEST_CTRL_TIMEOUT_MS);
+	ret = connect(comm->ctrl.s, (struct sockaddr *) &addr, sizeof(addr));
+	err_if_exit(ret < 0, EXIT_FAILURE, "cannot connect to %s:%u: %m",
+			inet_ntoa(addr.sin_addr), comm->ctrl.port);
+
+	ret = nettest_ctrl_send(comm->ctrl.s, NETTEST_CTRL_HELLO,
+				&hello, sizeof(hello));
+	err_if_exit(ret < 0, EXIT_FAILURE, "cannot send test parameters: %s",
+			strerror(-ret));
+	ret = nettest_ctrl_recv(comm->ctrl.s, &msg, 0);
+	err_if_exit(ret != NETTEST_CTRL_ACCEPT, EXIT_FAILURE,
+			"no answer to the test parameters from the server");
+	err_if_exit(msg.body.accept.status < 0, EXIT_FAILURE,
+			"server refused the test: %s", msg.body.accept.reason);
+	info("test parameters accepted by the server");
+}
+
+/*
+ * Wait for the results the server sends at the end of the test, if the
+ * STOP packet got lost we ask for them. Return the exit code.
+ */
+static int ctrl_report(struct comm_info_s *comm, unsigned int sent)
+{
+	struct nettest_ctrl_msg_s msg;
+	struct nettest_ctrl_result_s *res = &msg.body.result;
+	struct nettest_ctrl_class_s *rc;
+	uint64_t unique, missing;
+	unsigned int i;
+	int ret;
+
+	ret = nettest_ctrl_recv(comm->ctrl.s, &msg, 0);
+	if (ret == -EAGAIN) {
+		dbg("no results at the end of the test, asking for them");
+		ret = nettest_ctrl_send(comm->ctrl.s, NETTEST_CTRL_RESULT_REQ,
+					NULL, 0);
+		if (ret == 0)
+			ret = nettest_ctrl_recv(comm->ctrl.s, &msg, 0);
+	}
+	close(comm->ctrl.s);
+	if (ret != NETTEST_CTRL_RESULT) {
+		err("no results from the server");
+		return NETTEST_EXIT_NO_RESULT;
+	}
+
+	/*
+	 * The packets lost at the beginning or at the end of the stream
+	 * can't be seen by the server, but we know how many we sent
+	 */
+	unique = res->received - res->dup;
+	missing = sent > unique ? sent - unique : 0;
+	info("server received %lu packets (%lu lost, %lu by local drops, "
+		"%lu dup, %lu reordered)", res->received, res->lost,
+		res->lost_local, res->dup, res->reordered);
+	info("server outages: %lu, max %.3fms", res->outages,
+		res->outage_max_ns / (double) NSEC_PER_MSEC);
+	if (res->flows > 1)
+		info("server flows: %u/%u received, %u with losses, "
+			"%lu unknown packets", res->flows_received, res->flows,
+			res->flows_lossy, res->unknown);
+	for (i = 0; i < min(res->classes, (uint32_t) NETTEST_CLASSES_MAX); i++) {
+		rc = &res->cls[i];
+		if (res->classes == 1 && rc->prio < 0)
+			break;
+		info("server class %u (prio %d): %lu received, %lu lost, "
+			"%lu remarked, latency p50/p99/max %lu/%lu/%luus",
+			i, rc->prio, rc->received, rc->lost, rc->remarked,
+			rc->latency_p50_us, rc->latency_p99_us,
+			rc->latency_max_us);
+	}
+	info("result: %u sent, %lu missing (%.3f%%)", sent, missing,
+		sent ? 100. * missing / sent : 0);
+
+	return missing || res->lost ? NETTEST_EXIT_LOSS : EXIT_SUCCESS;
+}
+
+/*
+ * One-way delay
+ */
+
+/*
+ * Estimate the offset of the server clock by the timestamps of the ACK
+ * received at t_ack, and with it the one-way delays of the packet (in
+ * us) in both directions.
+ */
+static void account_ack(struct nettest_offset_s *o,
+			struct nettest_hist_s *owd, struct data_packet_s *pkt,
+			uint64_t t_ack)
+{
+	int64_t theta, fwd, back;
+
+	/* A server not stamping the ACKs */
+	if (!pkt->ack_rx_ns || !pkt->ack_tx_ns)
+		return;
+	if (!nettest_offset_add(o, pkt->tx_ns, pkt->ack_rx_ns,
+				pkt->ack_tx_ns, t_ack)) {
+		dbg("inconsistent ACK timestamps");
+		return;
+	}
+
+	theta = nettest_offset_get(o, pkt->tx_ns);
+	fwd = (int64_t) (pkt->ack_rx_ns - pkt->tx_ns) - theta;
+	back = (int64_t) (t_ack - pkt->ack_tx_ns) + theta;
+	nettest_hist_add(&owd[0], max(fwd, (int64_t) 0) / NSEC_PER_USEC);
+	nettest_hist_add(&owd[1], max(back, (int64_t) 0) / NSEC_PER_USEC);
+}
+
+/*
+ * Account the time the packet spent into the server, which stamped its
+ * arrival and the departure of the ACK by the same clock (in ns), and the
+ * RTT without it (in us)
+ */
+static void account_residence(struct nettest_hist_s *res,
+			struct nettest_hist_s *net,
+			const struct data_packet_s *pkt, unsigned int rtt_us)
+{
+	uint64_t res_us;
+
+	if (!pkt->ack_rx_ns || pkt->ack_tx_ns < pkt->ack_rx_ns)
+		return;
+
+	nettest_hist_add(res, pkt->ack_tx_ns - pkt->ack_rx_ns);
+	res_us = (pkt->ack_tx_ns - pkt->ack_rx_ns) / NSEC_PER_USEC;
+	nettest_hist_add(net, rtt_us > res_us ? rtt_us - res_us : 0);
+}
+
+static void report_residence(struct nettest_hist_s *res,
+			struct nettest_hist_s *net)
+{
+	if (res->count == 0)
+		return;
+
+	info("server residence min/p50/p90/p99/max: "
+		"%.1f/%.1f/%.1f/%.1f/%.1fus",
+		res->min / (double) NSEC_PER_USEC,
+		nettest_hist_percentile(res, 50) / (double) NSEC_PER_USEC,
+		nettest_hist_percentile(res, 90) / (double) NSEC_PER_USEC,
+		nettest_hist_percentile(res, 99) / (double) NSEC_PER_USEC,
+		res->max / (double) NSEC_PER_USEC);
+	info("RTT without it min/p50/p90/p99/max: %lu/%lu/%lu/%lu/%luus",
+		net->min,
+		nettest_hist_percentile(net, 50),
+		nettest_hist_percentile(net, 90),
+		nettest_hist_percentile(net, 99),
+		net->max);
+}
+
+static void report_offset(struct nettest_offset_s *o)
+{
+	info("server clock offset %+.1fus (+/-%.1fus), drift %+.3fppm",
+		nettest_offset_get(o, nettest_realtime_ns()) /
+					(double) NSEC_PER_USEC,
+		o->bound / (double) NSEC_PER_USEC, o->drift * 1e6);
+}
+
+static void report_owd(const char *dir, struct nettest_hist_s *h,
+			int64_t bound)
+{
+	info("%s one-way delay min/p50/p90/p99/max: %lu/%lu/%lu/%lu/%luus "
+		"(+/-%.1fus)", dir, h->min,
+		nettest_hist_percentile(h, 50),
+		nettest_hist_percentile(h, 90),
+		nettest_hist_percentile(h, 99),
+		h->max, bound / (double) NSEC_PER_USEC);
+}
+
+/* Return the number of packets sent */
+static unsigned int mainloop(int s, struct comm_info_s *comm)
 {
 	int done;
-	struct data_packet_s pkt_sent, pkt_recv;
+	struct data_packet_s *pkt_sent, *pkt_recv;
 	int data_size = sizeof(unsigned int) + comm->packet_size;
 	ssize_t nsent, nrecv;
-	struct timeval t1, t2, t_after;
+	struct timeval t1, t2;
 	long delta_s, delta_u;
-	unsigned int elapsed_us, period_us;
+	unsigned int elapsed_us;
+	uint64_t t_now, t_report;
+	uint64_t report_ns = comm->report_s * NSEC_PER_SEC;
+	struct comm_class_s *cls;
+	struct comm_dest_s *dest;
+	unsigned int groups_num = comm->dests_num / comm->classes_num;
+	unsigned int sent, report_sent, flow;
 	unsigned long long rtt_us_avg;
+	static struct nettest_hist_s rtt_hist;
+	static struct nettest_hist_s res_hist, net_hist;
+	static struct nettest_hist_s owd_hist[2];
+	static struct nettest_offset_s offset;
+	uint64_t t_ack;
 	unsigned int cnt;
 	int i;
 
+	pkt_sent = nettest_arena_get(&arena);
+	pkt_recv = nettest_arena_get(&arena);
+	BUG_ON(!pkt_sent || !pkt_recv);
+
 	/*
 	 * The command on the first packet of the stream should be the
 	 * NETTEST_CMD_START command.
 	 */
-	pkt_sent.command = NETTEST_CMD_START;
+	pkt_sent->command = NETTEST_CMD_START;
 
 	/* enable ACK mode if required */
-	pkt_sent.mode = comm->use_ack ? NETTEST_MODE_ACK : NETTEST_MODE_NONE;
+	pkt_sent->mode = comm->use_ack ? NETTEST_MODE_ACK : NETTEST_MODE_NONE;
 
 	/* Initialize the rest of transmitted structure */
-	pkt_sent.pkt_num = 0;
-	pkt_sent.period_ms = comm->period_ms;
+	pkt_sent->version = NETTEST_PKT_VERSION;
+	pkt_sent->pkt_num = 0;
+	pkt_sent->period_us = comm->period_us;
+	pkt_sent->ack_rx_ns = pkt_sent->ack_tx_ns = 0;
+	pkt_sent->flows = comm->dests_num;
+	pkt_sent->classes = comm->classes_num;
 	for (i = 0; i < comm->packet_size; i++)
-		pkt_sent.filler[i] = i;
+		pkt_sent->filler[i] = i;
 
 	/* Compute the size of the packet to transmit.
 	 * The packet structure is declared with a static payload of
 	 * NETTEST_FILLER_SIZE bytes.
 	 */
-	data_size = sizeof(pkt_sent) - NETTEST_FILLER_SIZE + comm->packet_size;
+	data_size = sizeof(*pkt_sent) - NETTEST_FILLER_SIZE + comm->packet_size;
 
-	period_us = comm->period_ms * 1000;
+	/* Make room for the packets queued at the requested rates */
+	for (i = 0; i < comm->classes_num; i++)
+		nettest_set_bufsize(comm->classes[i].s, false,
+			nettest_bufsize(comm->classes[i].period_us,
+					comm->classes[i].sched.burst,
+					data_size));
+
+	t_report = nettest_now_ns();
+	for (i = 0; i < comm->classes_num; i++)
+		comm->classes[i].t_next = t_report;
+	sent = report_sent = 0;
+	prof_init();
+	nettest_offset_init(&offset);
 	rtt_us_avg = 0;
 	cnt = 0;
 	done = 0;
 	while (!done) {
+		/*
+		 * Pick the class of the next packet and wait for its
+		 * absolute deadline, so that the time spent sending doesn't
+		 * add up to the period. With ACKs we just go as fast as the
+		 * partner answers.
+		 */
+		prof_start(PROF_PACING);
+		cls = next_class(comm, nettest_now_ns());
+		if (cls->sched.num) {
+			if (!comm->use_ack)
+				wait_until(comm, cls->t_next);
+			cls->t_next += nettest_sched_next(&cls->sched,
+							&cls->sched_pos);
+		}
+		prof_end(PROF_PACING);
+
+		/*
+		 * Round robin over the groups, each flow with its numbering.
+		 * Bursts are not split so that the receiver can tell the
+		 * position of a packet into its burst.
+		 */
+		if (cls->burst_left == 0) {
+			cls->burst_dest = cls->dest++ % groups_num;
+			cls->burst_left = max(cls->sched.burst, 1U);
+		}
+		cls->burst_left--;
+		flow = (cls - comm->classes) * groups_num + cls->burst_dest;
+		dest = &comm->dests[flow];
+		pkt_sent->flow = flow;
+		pkt_sent->cls = cls - comm->classes;
+		pkt_sent->prio = cls->prio;
+		pkt_sent->burst = cls->sched.burst;
+		pkt_sent->pkt_num = dest->seq++;
+
 		if (comm->use_ack)
 			gettimeofday(&t1, NULL);
+		pkt_sent->tx_ns = nettest_realtime_ns();
 
-		nsent = send_data(s, comm, &pkt_sent, data_size);
+		prof_start(PROF_SEND);
+		nsent = nettest_send_one(comm->tr, cls->s, dest, pkt_sent,
+						data_size, 0);
+		prof_syscall(PROF_SEND, nsent);
+		prof_end(PROF_SEND);
 		err_if_exit(nsent < 0, EXIT_FAILURE, "cannot send packet: %m");
-		gettimeofday(&t_after, NULL);
+		prof_packet();
 		dbg("transmitted %ld bytes", nsent);
 
 		/* Switch com CMD_NONE after sending the first packet */
-		if (pkt_sent.pkt_num == 0)
-			pkt_sent.command = NETTEST_CMD_NONE;
-		if (pkt_sent.command == NETTEST_CMD_STOP)
+		if (sent == 0)
+			pkt_sent->command = NETTEST_CMD_NONE;
+		if (pkt_sent->command == NETTEST_CMD_STOP)
 			done = 1;
-		pkt_sent.pkt_num++;
+		sent++;
 
 		/*
 		 * if we have choosen to send a predefined number of packets
 		 * send a CMD_STOP for signaling the last packet.
 		 */
-		if (comm->packets_num && pkt_sent.pkt_num > comm->packets_num)
-			pkt_sent.command = NETTEST_CMD_STOP;
+		if (comm->packets_num && sent > comm->packets_num)
+			pkt_sent->command = NETTEST_CMD_STOP;
 
 		/*
 		 * If we have enabled packets acknowledge we shoud wait for a
 		 * response from the partner
 		 */
 		if (comm->use_ack) {
-			nrecv = recv_data(s, comm, &pkt_recv, sizeof(pkt_recv));
+			prof_start(PROF_RECV);
+			nrecv = recv_data(cls->s, comm, pkt_recv,
+						sizeof(*pkt_recv));
+			prof_end(PROF_RECV);
 			err_if_exit(nrecv < 0, EXIT_FAILURE,
 					"cannot receive ACK  packet: %m");
 			gettimeofday(&t2, NULL);
+			t_ack = nettest_realtime_ns();
+			if (nrecv >= offsetof(struct data_packet_s, filler))
+				account_ack(&offset, owd_hist, pkt_recv,
+						t_ack);
 
 			delta_s = t2.tv_sec - t1.tv_sec;
 			delta_u = t2.tv_usec - t1.tv_usec;
@@ -216,15 +583,828 @@ static void mainloop(int s, struct comm_info_s *comm)
 
 			elapsed_us = (delta_s) * 1000000 + delta_u;
 			rtt_us_avg += elapsed_us;
+			nettest_hist_add(&rtt_hist, elapsed_us);
+			if (nrecv >= offsetof(struct data_packet_s, filler))
+				account_residence(&res_hist, &net_hist,
+						pkt_recv, elapsed_us);
 			dbg("got ACK (RTT=%uus)", elapsed_us);
-		} else {
-			if (period_us)
-				usleep(period_us);
+		}
+
+		if (report_ns) {
+			t_now = nettest_now_ns();
+			if (t_now - t_report >= report_ns) {
+				info("interval: sent %u packets (%.0f pps)",
+					sent - report_sent,
+					(sent - report_sent) *
+					(double) NSEC_PER_SEC / (t_now - t_report));
+				if (nettest_offset_valid(&offset))
+					report_offset(&offset);
+				nettest_report_ifstats(comm, false);
+				prof_report();
+				report_sent = sent;
+				t_report = t_now;
+			}
 		}
 	}
-	info("transmitted %u packets of %d bytes", pkt_sent.pkt_num, data_size);
-	if (comm->use_ack)
+	info("transmitted %u packets of %d bytes", sent, data_size);
+	if (comm->use_ack && cnt) {
 		info("average RTT: %lluus", rtt_us_avg / cnt);
+		info("RTT min/p50/p90/p99/max: %lu/%lu/%lu/%lu/%luus",
+			rtt_hist.min,
+			nettest_hist_percentile(&rtt_hist, 50),
+			nettest_hist_percentile(&rtt_hist, 90),
+			nettest_hist_percentile(&rtt_hist, 99),
+			rtt_hist.max);
+		report_residence(&res_hist, &net_hist);
+	}
+	if (nettest_offset_valid(&offset)) {
+		report_offset(&offset);
+		report_owd("forward", &owd_hist[0], offset.bound);
+		report_owd("backward", &owd_hist[1], offset.bound);
+	}
+	prof_report_total();
+	nettest_arena_put(&arena, pkt_recv);
+	nettest_arena_put(&arena, pkt_sent);
+
+	return sent;
+}
+
+/*
+ * TCP stream
+ *
+ * The records are written into a ring of chunks, each one sent by a single
+ * call, with MSG_ZEROCOPY when it is large enough: a chunk is written again
+ * only once the kernel told us it is done with its pages.
+ */
+
+static void stream_report(int s, struct comm_info_s *comm,
+			struct nettest_tcp_info_s *prev, uint64_t elapsed_ns)
+{
+	struct nettest_tcp_info_s ti;
+	char buf[256];
+
+	if (comm->tr->tcp_info(s, &ti) < 0) {
+		dbg("cannot get TCP info: %m");
+		return;
+	}
+	nettest_tcp_info_snprintf(buf, sizeof(buf), &ti, prev, elapsed_ns);
+	info("%s", buf);
+	if (prev)
+		*prev = ti;
+}
+
+/* Wait until the kernel releases the chunk sent with the notification id */
+static void stream_wait_zc(int s, struct nettest_zc_s *zc, int64_t id)
+{
+	int ret;
+
+	while (!nettest_zc_done(zc, id)) {
+		ret = nettest_zc_reap(s, zc, 1000);
+		err_if_exit(ret < 0, EXIT_FAILURE,
+				"cannot read zero-copy notifications: %m");
+	}
+}
+
+static unsigned int stream_loop(int s, struct comm_info_s *comm)
+{
+	struct comm_class_s *cls = &comm->classes[0];
+	struct comm_dest_s *dest = &comm->dests[0];
+	size_t hdr_size = offsetof(struct data_packet_s, filler);
+	size_t data_size = hdr_size + comm->packet_size;
+	unsigned int per_chunk = STREAM_CHUNK_SIZE / data_size;
+	static struct data_packet_s pkt;
+	static int64_t id[STREAM_CHUNKS];
+	struct nettest_tcp_info_s ti_prev = { 0 };
+	struct nettest_zc_s zc;
+	uint64_t t_start, t_now, t_report;
+	uint64_t report_ns = comm->report_s * NSEC_PER_SEC;
+	unsigned int sent, report_sent, chunk, n, i;
+	uint8_t *buf;
+	int done = 0;
+	int ret;
+
+	/* Only the headers change, the whole records are written once */
+	pkt.command = NETTEST_CMD_START;
+	pkt.mode = NETTEST_MODE_NONE;
+	pkt.version = NETTEST_PKT_VERSION;
+	pkt.period_us = comm->period_us;
+	pkt.flows = comm->dests_num;
+	pkt.classes = comm->classes_num;
+	pkt.cls = 0;
+	pkt.prio = cls->prio;
+	pkt.burst = cls->sched.burst;
+	pkt.proto.tcp.len = data_size;
+	for (i = 0; i < comm->packet_size; i++)
+		pkt.filler[i] = i;
+	for (chunk = 0; chunk < STREAM_CHUNKS; chunk++) {
+		buf = nettest_arena_buf(&arena, chunk);
+		for (i = 0; i < per_chunk; i++)
+			memcpy(buf + i * data_size, &pkt, data_size);
+		id[chunk] = NETTEST_ZC_NONE;
+	}
+
+	nettest_zc_init(s, &zc);
+
+	t_start = t_report = cls->t_next = nettest_now_ns();
+	sent = report_sent = 0;
+	chunk = 0;
+	prof_init();
+	while (!done) {
+		buf = nettest_arena_buf(&arena, chunk);
+		stream_wait_zc(s, &zc, id[chunk]);
+
+		/*
+		 * At wire speed fill the whole chunk, otherwise put in it the
+		 * records due so far, waiting for the first one.
+		 */
+		prof_start(PROF_PACING);
+		for (n = 0; n < per_chunk && !done; n++) {
+			if (cls->sched.num) {
+				if (n > 0 && cls->t_next > nettest_now_ns())
+					break;
+				wait_until(comm, cls->t_next);
+				cls->t_next += nettest_sched_next(&cls->sched,
+								&cls->sched_pos);
+			}
+
+			pkt.pkt_num = dest->seq++;
+			pkt.tx_ns = nettest_realtime_ns();
+			memcpy(buf + n * data_size, &pkt, hdr_size);
+			prof_packet();
+
+			/* The same commands sequence of the datagrams */
+			if (sent == 0)
+				pkt.command = NETTEST_CMD_NONE;
+			if (pkt.command == NETTEST_CMD_STOP)
+				done = 1;
+			sent++;
+			if (comm->packets_num && sent > comm->packets_num)
+				pkt.command = NETTEST_CMD_STOP;
+		}
+		prof_end(PROF_PACING);
+
+		prof_start(PROF_SEND);
+		ret = nettest_zc_send(s, &zc, buf, n * data_size, &id[chunk]);
+		prof_syscall(PROF_SEND, ret < 0 ? ret : n * data_size);
+		prof_end(PROF_SEND);
+		err_if_exit(ret < 0, EXIT_FAILURE, "cannot send records: %m");
+		if (zc.enabled) {
+			ret = nettest_zc_reap(s, &zc, 0);
+			err_if_exit(ret < 0, EXIT_FAILURE,
+				"cannot read zero-copy notifications: %m");
+		}
+		chunk = (chunk + 1) % STREAM_CHUNKS;
+
+		if (report_ns) {
+			t_now = nettest_now_ns();
+			if (t_now - t_report >= report_ns) {
+				info("interval: sent %u records (%.2fMbit/s)",
+					sent - report_sent,
+					(sent - report_sent) * data_size *
+					8e3 / (t_now - t_report));
+				stream_report(s, comm, &ti_prev,
+						t_now - t_report);
+				nettest_report_ifstats(comm, false);
+				prof_report();
+				report_sent = sent;
+				t_report = t_now;
+			}
+		}
+	}
+
+	/* The last notifications, unless the peer stopped reading */
+	for (chunk = 0; chunk < STREAM_CHUNKS; chunk++)
+		while (!nettest_zc_done(&zc, id[chunk]) &&
+		       nettest_zc_reap(s, &zc, 1000) > 0)
+			;
+
+	t_now = nettest_now_ns();
+	info("transmitted %u records of %zu bytes (%.2fMbit/s)", sent,
+		data_size, (double) sent * data_size * 8e3 /
+		max(t_now - t_start, 1UL));
+	stream_report(s, comm, NULL, t_now - t_start);
+	if (zc.enabled)
+		info("zero-copy: %lu sends, %lu copied by the kernel, "
+			"%lu fallbacks to copy", zc.sends, zc.copied,
+			zc.fallbacks);
+	prof_report_total();
+
+	return sent;
+}
+
+/*
+ * Fill the packet with the size, and the contents if requested, of the
+ * frame of rec and return the length to send. The frame is seen as an
+ * Ethernet one and its bytes fill our packet from the same offset, after
+ * the UDP/IP headers in UDP mode.
+ */
+static size_t replay_fill(struct comm_info_s *comm, struct data_packet_s *pkt,
+				const struct nettest_pcap_rec_s *rec)
+{
+	size_t hdr_size = sizeof(*pkt) - NETTEST_FILLER_SIZE;
+	size_t offset = 0, len, n;
+	const uint8_t *data;
+
+	len = nettest_pcap_eth_len(rec);
+	if (comm->type == NETTEST_INFO_TYPE_UDP) {
+		offset = sizeof(struct ether_header) + sizeof(struct iphdr) +
+				sizeof(struct udphdr);
+		len = len > offset ? len - offset : 0;
+	}
+	if (len < hdr_size || len > sizeof(*pkt)) {
+		len = min(max(len, hdr_size), sizeof(*pkt));
+		replay.clamped++;
+	}
+
+	if (replay.frames) {
+		n = nettest_pcap_eth_data(rec, offset + hdr_size, &data);
+		if (n)
+			memcpy(pkt->filler, data, min(n, len - hdr_size));
+	}
+
+	return len;
+}
+
+/* Time to send the frame captured at ts_ns, frames out of order go at once */
+static inline uint64_t replay_deadline(uint64_t t_base, uint64_t r_base,
+				uint64_t ts_ns)
+{
+	if (!replay.speed || ts_ns <= r_base)
+		return t_base;
+
+	return t_base + (ts_ns - r_base) / replay.speed;
+}
+
+/*
+ * Replay the capture: each frame becomes one of our packets of the same
+ * size sent with the same timing, scaled by the replay speed. Packets
+ * already due are sent together in a batch so that we don't fall
+ * behind at high rates. Return the number of packets sent.
+ */
+static unsigned int replay_loop(int s, struct comm_info_s *comm)
+{
+	struct data_packet_s *pkts[REPLAY_BATCH];
+	static struct nettest_tx_s tx[REPLAY_BATCH];
+	struct comm_class_s *cls = &comm->classes[0];
+	struct data_packet_s *pkt;
+	struct comm_dest_s *dest;
+	struct nettest_pcap_rec_s rec;
+	uint64_t t_base, r_base, t_next, t_now, t_report;
+	uint64_t report_ns = comm->report_s * NSEC_PER_SEC;
+	unsigned int sent, report_sent, n, i;
+	size_t len;
+	int ret, done, stop;
+
+	for (n = 0; n < REPLAY_BATCH; n++) {
+		pkt = pkts[n] = nettest_arena_get(&arena);
+		BUG_ON(!pkt);
+		pkt->mode = NETTEST_MODE_NONE;
+		pkt->version = NETTEST_PKT_VERSION;
+		pkt->period_us = comm->period_us;
+		pkt->flows = comm->dests_num;
+		pkt->cls = 0;
+		pkt->classes = 1;
+		pkt->prio = cls->prio;
+		pkt->burst = 0;
+		for (i = 0; i < NETTEST_FILLER_SIZE; i++)
+			pkt->filler[i] = i;
+	}
+
+	/* Make room for the frames queued at wire speed */
+	nettest_set_bufsize(cls->s, false,
+			nettest_bufsize(0, REPLAY_BATCH, sizeof(*pkt)));
+
+	if (comm->lowlat.enabled)
+		nettest_prefault(tx, sizeof(tx));
+
+	ret = nettest_pcap_next(&replay.pcap, &rec);
+	err_if_exit(ret <= 0, EXIT_FAILURE, "no frames into %s", replay.file);
+	t_base = t_report = nettest_now_ns();
+	r_base = rec.ts_ns;
+	sent = report_sent = 0;
+	prof_init();
+	done = stop = 0;
+	while (!done) {
+		t_next = replay_deadline(t_base, r_base, rec.ts_ns);
+
+		prof_start(PROF_PACING);
+		wait_until(comm, t_next);
+		prof_end(PROF_PACING);
+
+		/* Take all the packets already due */
+		n = 0;
+		do {
+			pkt = pkts[n];
+			dest = &comm->dests[cls->dest++ % comm->dests_num];
+			pkt->flow = dest - comm->dests;
+			pkt->pkt_num = dest->seq++;
+			if (stop) {
+				pkt->command = NETTEST_CMD_STOP;
+				len = sizeof(*pkt) - NETTEST_FILLER_SIZE;
+				done = 1;
+			} else {
+				pkt->command = sent + n == 0 ?
+					NETTEST_CMD_START : NETTEST_CMD_NONE;
+				len = replay_fill(comm, pkt, &rec);
+			}
+			pkt->tx_ns = nettest_realtime_ns();
+			tx[n].dest = dest;
+			tx[n].pkt = pkt;
+			tx[n].len = len;
+			n++;
+			if (done)
+				break;
+
+			/*
+			 * Move to the next frame, the whole capture is
+			 * replayed again until we sent the requested packets
+			 */
+			if (comm->packets_num && sent + n >= comm->packets_num) {
+				stop = 1;
+				continue;
+			}
+			ret = nettest_pcap_next(&replay.pcap, &rec);
+			warn_if(ret < 0, "last frame of %s is truncated",
+				replay.file);
+			if (ret <= 0 && comm->packets_num) {
+				nettest_pcap_rewind(&replay.pcap);
+				ret = nettest_pcap_next(&replay.pcap, &rec);
+				t_base = t_next;
+				r_base = rec.ts_ns;
+			} else if (ret <= 0) {
+				stop = 1;
+				continue;
+			}
+			t_next = replay_deadline(t_base, r_base, rec.ts_ns);
+		} while (n < REPLAY_BATCH &&
+			 (stop || t_next <= nettest_now_ns()));
+
+		prof_start(PROF_SEND);
+		for (i = 0; i < n; i += ret) {
+			ret = comm->tr->send(cls->s, tx + i, n - i, 0);
+			prof_syscall(PROF_SEND, ret);
+			err_if_exit(ret < 0, EXIT_FAILURE,
+					"cannot send packets: %m");
+		}
+		prof_end(PROF_SEND);
+		for (i = 0; i < n; i++)
+			prof_packet();
+		dbg("transmitted %u packets", n);
+		sent += n;
+
+		if (report_ns) {
+			t_now = nettest_now_ns();
+			if (t_now - t_report >= report_ns) {
+				info("interval: sent %u packets (%.0f pps)",
+					sent - report_sent,
+					(sent - report_sent) *
+					(double) NSEC_PER_SEC / (t_now - t_report));
+				nettest_report_ifstats(comm, false);
+				prof_report();
+				report_sent = sent;
+				t_report = t_now;
+			}
+		}
+	}
+	info("replayed %u packets of %s", sent, replay.file);
+	warn_if(replay.clamped, "%lu frames were out of the packet sizes "
+		"[%ld, %ld] and have been resized", replay.clamped,
+		sizeof(*pkt) - NETTEST_FILLER_SIZE, sizeof(*pkt));
+	prof_report_total();
+
+	return sent;
+}
+
+/*
+ * Sweep mode
+ */
+
+/* Hash key of a destination address, IPv4 or MAC */
+static uint64_t sweep_key(struct comm_info_s *comm,
+				const union comm_dest_addr_u *addr)
+{
+	uint64_t key = 0;
+
+	if (comm->type == NETTEST_INFO_TYPE_UDP)
+		return addr->in.sin_addr.s_addr;
+	memcpy(&key, addr->ll.sll_addr, ETH_ALEN);
+
+	return key;
+}
+
+static unsigned int sweep_slot(uint64_t key)
+{
+	return (key * 0x9e3779b97f4a7c15ULL) >> 32;
+}
+
+/* Return the index of the destination with the given address or -1 */
+static int sweep_lookup(struct comm_info_s *comm,
+				const union comm_dest_addr_u *addr)
+{
+	uint64_t key = sweep_key(comm, addr);
+	unsigned int i;
+	uint32_t idx;
+
+	for (i = sweep_slot(key); ; i++) {
+		idx = sweep.hash[i & sweep.hash_mask];
+		if (!idx)
+			return -1;
+		if (sweep_key(comm, &comm->dests[idx - 1].addr) == key)
+			return idx - 1;
+	}
+}
+
+static void dest_name(struct comm_info_s *comm, struct comm_dest_s *dest,
+				char *buf, size_t len)
+{
+	if (comm->type == NETTEST_INFO_TYPE_UDP)
+		inet_ntop(AF_INET, &dest->addr.in.sin_addr, buf, len);
+	else
+		ether_ntoa_r((struct ether_addr *) dest->addr.ll.sll_addr, buf);
+}
+
+/*
+ * Load the destinations, one IPv4 or MAC address per line, from the
+ * file. Empty lines and the ones starting with '#' are skipped.
+ */
+static void sweep_load(struct comm_info_s *comm)
+{
+	struct comm_dest_s *dest;
+	FILE *f;
+	char *line = NULL, *str, *end;
+	size_t size = 0, max_dests = 0;
+	unsigned int n = 0, i;
+	int ret;
+
+	f = fopen(sweep.file, "r");
+	err_if_exit(!f, EXIT_FAILURE, "cannot open %s: %m", sweep.file);
+	while (getline(&line, &size, f) > 0) {
+		n++;
+		str = line + strspn(line, " \t");
+		end = str + strcspn(str, " \t\r\n#");
+		if (end == str)
+			continue;
+		*end = '\0';
+
+		err_if_exit(comm->dests_num == SWEEP_MAX, EXIT_FAILURE,
+			"too many destinations, max is %d", SWEEP_MAX);
+		if (comm->dests_num == max_dests) {
+			max_dests = max_dests ? 2 * max_dests : 256;
+			comm->dests = realloc(comm->dests,
+					max_dests * sizeof(*comm->dests));
+			err_if_exit(!comm->dests, EXIT_FAILURE,
+					"cannot allocate destinations");
+		}
+		dest = &comm->dests[comm->dests_num];
+		memset(dest, 0, sizeof(*dest));
+		switch (comm->type) {
+		case NETTEST_INFO_TYPE_UDP:
+		case NETTEST_INFO_TYPE_TCP:
+			dest->addr.in = comm->proto.udp.raw_address;
+			ret = inet_aton(str, &dest->addr.in.sin_addr);
+			break;
+		case NETTEST_INFO_TYPE_ETHERNET:
+			dest->addr.ll = comm->proto.eth.raw_address;
+			ret = parse_mac(str, dest->addr.ll.sll_addr);
+			break;
+		default:
+			BUG();
+		}
+		err_if_exit(ret == 0, EXIT_FAILURE,
+			"%s:%u: invalid address %s", sweep.file, n, str);
+		comm->tr->prepare_dest(comm, &comm->classes[0], dest);
+		comm->dests_num++;
+	}
+	free(line);
+	fclose(f);
+	err_if_exit(comm->dests_num == 0, EXIT_FAILURE,
+		"no destinations into %s", sweep.file);
+
+	/* Index the destinations by address to match their ACKs */
+	for (sweep.hash_mask = 1; sweep.hash_mask < 2 * comm->dests_num; )
+		sweep.hash_mask <<= 1;
+	sweep.hash = calloc(sweep.hash_mask, sizeof(*sweep.hash));
+	sweep.dest = calloc(comm->dests_num, sizeof(*sweep.dest));
+	err_if_exit(!sweep.hash || !sweep.dest, EXIT_FAILURE,
+			"cannot allocate destinations");
+	sweep.hash_mask--;
+	for (n = 0; n < comm->dests_num; n++) {
+		err_if_exit(sweep_lookup(comm, &comm->dests[n].addr) >= 0,
+			EXIT_FAILURE, "destination %u is duplicated", n + 1);
+		for (i = sweep_slot(sweep_key(comm, &comm->dests[n].addr));
+		     sweep.hash[i & sweep.hash_mask]; i++)
+			;
+		sweep.hash[i & sweep.hash_mask] = n + 1;
+	}
+}
+
+/* Account an ACK, the RTT is measured against its receive timestamp */
+static void sweep_ack_one(struct comm_info_s *comm, struct nettest_rx_s *rx)
+{
+	struct sweep_dest_s *d;
+	uint64_t rx_ns, rtt;
+	int idx;
+
+	if (rx->len < offsetof(struct data_packet_s, filler))
+		return;
+	rx_ns = rx->ts_ns ? rx->ts_ns : nettest_realtime_ns();
+
+	idx = sweep_lookup(comm, rx->from);
+	if (idx < 0) {
+		sweep.unknown++;
+		return;
+	}
+	d = &sweep.dest[idx];
+	rtt = rx_ns - rx->pkt->tx_ns;
+	if (d->acked == 0 || rtt < d->rtt_min_ns)
+		d->rtt_min_ns = rtt;
+	d->rtt_max_ns = max(d->rtt_max_ns, rtt);
+	d->rtt_sum_ns += rtt;
+	d->acked++;
+	dbg("got ACK from destination %d (RTT=%luus)", idx,
+		rtt / NSEC_PER_USEC);
+}
+
+/*
+ * Account the ACKs queued into the socket, a batch at a time, with flags
+ * 0 wait for them until the receive timeout. Thanks to the kernel
+ * receive timestamps the ACKs can be read late.
+ */
+static void sweep_ack(int s, struct comm_info_s *comm, int flags)
+{
+	static union comm_dest_addr_u from[SWEEP_ACK_BATCH];
+	struct nettest_rx_s rx[SWEEP_ACK_BATCH];
+	int i, n;
+
+	for (i = 0; i < SWEEP_ACK_BATCH; i++) {
+		rx[i].pkt = nettest_arena_get(&arena);
+		BUG_ON(!rx[i].pkt);
+		rx[i].size = sizeof(*rx[i].pkt);
+		rx[i].from = &from[i];
+	}
+
+	while (1) {
+		n = comm->tr->recv(s, comm, rx, SWEEP_ACK_BATCH, flags);
+		prof_syscall(PROF_RECV, n);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		err_if_exit(n < 0, EXIT_FAILURE,
+				"cannot receive ACK packet: %m");
+
+		for (i = 0; i < n; i++)
+			sweep_ack_one(comm, &rx[i]);
+	}
+
+	for (i = SWEEP_ACK_BATCH - 1; i >= 0; i--)
+		nettest_arena_put(&arena, rx[i].pkt);
+}
+
+/* Report the destinations which didn't answer since the last report */
+static void sweep_report_silent(struct comm_info_s *comm)
+{
+	char name[32], list[256] = "";
+	unsigned int i, silent = 0;
+	size_t len = 0;
+
+	for (i = 0; i < comm->dests_num; i++) {
+		if (sweep.dest[i].acked == sweep.dest[i].acked_report) {
+			if (silent++ < 8) {
+				dest_name(comm, &comm->dests[i], name,
+						sizeof(name));
+				len += snprintf(list + len, sizeof(list) - len,
+						" %s", name);
+			}
+		}
+		sweep.dest[i].acked_report = sweep.dest[i].acked;
+	}
+
+	if (silent)
+		info("%u of %u destinations silent:%s%s", silent,
+			comm->dests_num, list, silent > 8 ? " ..." : "");
+	else
+		info("all the %u destinations answered", comm->dests_num);
+}
+
+static void sweep_report(struct comm_info_s *comm)
+{
+	struct sweep_dest_s *d;
+	char name[32];
+	unsigned int i, answered = 0;
+
+	info("%-17s %10s %10s %10s %8s  %s", "destination", "sent",
+		"errors", "acked", "lost", "RTT min/avg/max");
+	for (i = 0; i < comm->dests_num; i++) {
+		d = &sweep.dest[i];
+		dest_name(comm, &comm->dests[i], name, sizeof(name));
+		info("%-17s %10u %10lu %10lu %7.2f%%  %lu/%lu/%luus", name,
+			comm->dests[i].seq, d->errors, d->acked,
+			100. * (comm->dests[i].seq - min(d->acked,
+					(uint64_t) comm->dests[i].seq)) /
+					max(comm->dests[i].seq, 1U),
+			d->rtt_min_ns / NSEC_PER_USEC,
+			d->acked ? d->rtt_sum_ns / d->acked / NSEC_PER_USEC : 0,
+			d->rtt_max_ns / NSEC_PER_USEC);
+		if (d->acked)
+			answered++;
+	}
+	info("%u of %u destinations answered", answered, comm->dests_num);
+	warn_if(sweep.unknown, "%lu ACKs from unknown addresses",
+		sweep.unknown);
+}
+
+/*
+ * Send the packets to all the destinations in turn, each one gets a
+ * whole test (from START to STOP) with its own numbering and it is sent
+ * a packet every period. In ACK mode the answers are collected without
+ * waiting for them. Return the number of packets sent.
+ */
+static unsigned int sweep_loop(int s, struct comm_info_s *comm)
+{
+	struct data_packet_s *pkt = nettest_arena_get(&arena);
+	struct comm_class_s *cls = &comm->classes[0];
+	struct comm_dest_s *dest;
+	size_t data_size = sizeof(*pkt) - NETTEST_FILLER_SIZE +
+				comm->packet_size;
+	uint64_t gap_ns = comm->period_us * NSEC_PER_USEC / comm->dests_num;
+	uint64_t t_next, t_now, t_report;
+	uint64_t report_ns = comm->report_s * NSEC_PER_SEC;
+	unsigned int sent, report_sent, i;
+	uint64_t held;
+	int on = 1, ret, done;
+	ssize_t nsent;
+
+	BUG_ON(!pkt);
+	pkt->mode = comm->use_ack ? NETTEST_MODE_ACK : NETTEST_MODE_NONE;
+	pkt->version = NETTEST_PKT_VERSION;
+	pkt->period_us = comm->period_us;
+	pkt->flow = 0;
+	pkt->flows = 1;
+	pkt->cls = 0;
+	pkt->classes = 1;
+	pkt->prio = cls->prio;
+	pkt->burst = 0;
+	for (i = 0; i < comm->packet_size; i++)
+		pkt->filler[i] = i;
+
+	/*
+	 * Make room for the packets, and the ACKs, of all destinations. The
+	 * packets to a missing node stay charged to our send buffer until
+	 * the kernel gives up resolving its address.
+	 */
+	held = (uint64_t) comm->dests_num * max(SWEEP_RESOLVE_MS *
+			NSEC_PER_MSEC / max(comm->period_us * NSEC_PER_USEC,
+					1UL), 1UL);
+	nettest_set_bufsize(s, false, nettest_bufsize(gap_ns / NSEC_PER_USEC,
+					min(held, (uint64_t) UINT_MAX),
+					data_size));
+	if (comm->use_ack) {
+		nettest_set_bufsize(s, true, nettest_bufsize(
+				gap_ns / NSEC_PER_USEC, 0, data_size));
+		ret = setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &on,
+					sizeof(on));
+		warn_if(ret < 0, "cannot enable receive timestamps: %m");
+	}
+
+	if (comm->lowlat.enabled) {
+		nettest_prefault(comm->dests,
+				comm->dests_num * sizeof(*comm->dests));
+		nettest_prefault(sweep.dest,
+				comm->dests_num * sizeof(*sweep.dest));
+	}
+
+	t_next = t_report = nettest_now_ns();
+	sent = report_sent = 0;
+	prof_init();
+	done = 0;
+	while (!done) {
+		for (i = 0; i < comm->dests_num; i++) {
+			dest = &comm->dests[i];
+			if (dest->seq == 0)
+				pkt->command = NETTEST_CMD_START;
+			else if (comm->packets_num &&
+				 dest->seq > comm->packets_num) {
+				pkt->command = NETTEST_CMD_STOP;
+				done = 1;
+			} else
+				pkt->command = NETTEST_CMD_NONE;
+			pkt->pkt_num = dest->seq++;
+
+			prof_start(PROF_PACING);
+			if (gap_ns)
+				wait_until(comm, t_next);
+			t_next += gap_ns;
+			prof_end(PROF_PACING);
+
+			pkt->tx_ns = nettest_realtime_ns();
+			prof_start(PROF_SEND);
+			nsent = nettest_send_one(comm->tr, cls->s, dest, pkt,
+						data_size, MSG_DONTWAIT);
+			prof_syscall(PROF_SEND, nsent);
+			prof_end(PROF_SEND);
+			/* Neither a missing node nor a full buffer stop the others */
+			if (nsent < 0 && (errno == ENETUNREACH ||
+					  errno == EHOSTUNREACH ||
+					  errno == EHOSTDOWN ||
+					  errno == ENETDOWN ||
+					  errno == EAGAIN ||
+					  errno == ENOBUFS)) {
+				dbg("cannot send to destination %u: %m", i);
+				sweep.dest[i].errors++;
+			} else
+				err_if_exit(nsent < 0, EXIT_FAILURE,
+					"cannot send packet: %m");
+			prof_packet();
+			sent++;
+
+			if (comm->use_ack) {
+				prof_start(PROF_RECV);
+				sweep_ack(s, comm, MSG_DONTWAIT);
+				prof_end(PROF_RECV);
+			}
+
+			if (!report_ns)
+				continue;
+			t_now = nettest_now_ns();
+			if (t_now - t_report < report_ns)
+				continue;
+			info("interval: sent %u packets (%.0f pps)",
+				sent - report_sent, (sent - report_sent) *
+				(double) NSEC_PER_SEC / (t_now - t_report));
+			if (comm->use_ack)
+				sweep_report_silent(comm);
+			nettest_report_ifstats(comm, false);
+			prof_report();
+			report_sent = sent;
+			t_report = t_now;
+		}
+	}
+
+	if (comm->use_ack) {
+		nettest_set_timeout(s, SO_RCVTIMEO, SWEEP_LINGER_MS);
+		sweep_ack(s, comm, 0);
+		sweep_report(comm);
+	}
+	info("transmitted %u packets of %ld bytes to %u destinations", sent,
+		data_size, comm->dests_num);
+	prof_report_total();
+
+	return sent;
+}
+
+/*
+ * Parse a traffic class specification <prio>[:<period>[:<vlan>]] where
+ * the period is in ms, a missing one (or a negative value stored into
+ * *period_ms) means the default period.
+ */
+static int parse_class(char *str, struct comm_class_s *cls, double *period_ms)
+{
+	char *end;
+
+	cls->prio = strtol(str, &end, 10);
+	if (end == str || cls->prio < 0)
+		return -1;
+	*period_ms = -1;
+	if (*end == ':') {
+		str = end + 1;
+		*period_ms = strtod(str, &end);
+		if (end == str || *period_ms < 0 ||
+		    *period_ms * 1000 > UINT_MAX)
+			return -1;
+	}
+	if (*end == ':') {
+		str = end + 1;
+		cls->vlan = strtoul(str, &end, 10);
+		if (end == str || cls->vlan > 4094)
+			return -1;
+	}
+
+	return *end == '\0' ? 0 : -1;
+}
+
+/*
+ * Build the schedule of a traffic pattern, one of:
+ *   burst:<n>:<period_ms>	n packets back to back every period
+ *   poisson:<pps>		Poisson arrivals at the mean rate
+ *   ramp:<from_pps>:<to_pps>:<secs>	linear rate ramp (then restart)
+ */
+static int parse_pattern(char *str, struct nettest_sched_s *sched)
+{
+	unsigned int n;
+	double a, b, c;
+
+	if (sscanf(str, "burst:%u:%lf", &n, &a) == 2) {
+		if (n < 1 || n > NETTEST_BURST_MAX || a <= 0 || a * 1e3 > UINT_MAX)
+			return -1;
+		return nettest_sched_burst(sched, n, a * 1e6);
+	}
+	if (sscanf(str, "poisson:%lf", &a) == 1)
+		return nettest_sched_poisson(sched, a, nettest_now_ns());
+	if (sscanf(str, "ramp:%lf:%lf:%lf", &a, &b, &c) == 3)
+		return nettest_sched_ramp(sched, a, b, c);
+
+	return -1;
 }
 
 /*
@@ -237,13 +1417,50 @@ static void usage(void)
                 "usage: %s [-h | --help] [-d | --debug] [-t | --print-time]\n"
                 "               [-v | --version]\n"
                 "               [-p <port>] [-i | --use-ethernet <iface>]\n"
-                "               [-s <size>] [-f <period>] [-n <packets>] [-a]  <addr>\n"
+                "               [-T | --tcp]\n"
+                "               [-s <size>] [-f <period>] [-n <packets>] [-a]\n"
+                "               [-g | --groups <num>]\n"
+                "               [-L | --low-latency] [-c | --cpu <cpu>]\n"
+                "               [-r | --rt-prio <prio>] [-R | --report <secs>]\n"
+                "               [-H | --hugepages] [-N | --numa-node <node>]\n"
+                "               [-C | --class <prio>[:<period>[:<vlan>]]]\n"
+                "               [-P | --pattern <pattern>]\n"
+                "               [-k | --control [<addr>:]<port>]\n"
+                "               [-x | --replay <pcap>] [-X | --speed <factor>]\n"
+                "               [-F | --frames] [-A | --async-log]\n"
+                "               <addr> | -D | --dests <file>\n"
 		"  defaults are:\n"
 		"    - port is %d\n"
 		"    - size is %d bytes for payload\n"
-		"    - period is %dms\n",
+		"    - period is %dms (fractions allowed)\n"
+		"    - 1 destination, otherwise packets are sent round robin\n"
+		"      to <num> consecutive addresses starting from <addr>\n"
+		"    - 1 unmarked traffic class, otherwise each -C adds a class\n"
+		"      with its DSCP (UDP) or PCP (Ethernet, 802.1Q tagged)\n"
+		"      priority, period and VLAN ID\n"
+		"    - constant period, otherwise the classes without a period\n"
+		"      follow <pattern>: burst:<n>:<period>, poisson:<pps> or\n"
+		"      ramp:<from_pps>:<to_pps>:<secs>\n"
+		"    - no control channel, otherwise the results of the server\n"
+		"      are printed and the exit code is %d on losses\n"
+		"    - no replay, otherwise the sizes and the timing of the\n"
+		"      frames of <pcap> are reproduced at <factor> times\n"
+		"      their speed (0 is as fast as possible, default 1),\n"
+		"      with -F their contents are copied after our header\n"
+		"    - 1 server, otherwise the addresses listed into <file>\n"
+		"      (one per line) are sent a packet every <period> each\n"
+		"      in turn, and with -a their RTT and loss are reported\n"
+		"    - messages printed at once, otherwise by a background\n"
+		"      thread not to slow down the packets\n"
+		"    - packet buffers on regular pages, otherwise on 2MB\n"
+		"      hugepages (if reserved, transparent ones if not)\n"
+		"    - threads and packet buffers on the NUMA node of the\n"
+		"      interface in use, otherwise on <node> (off is anywhere)\n"
+		"    - UDP datagrams, otherwise with -T a TCP connection\n"
+		"      carries the packets as records (reported every second\n"
+		"      with the TCP statistics) and large sends are zero-copy\n",
 			NAME, NETTEST_UDP_PORT, NETTEST_PACKET_SIZE,
-				NETTEST_PERIOD_MS);
+				NETTEST_PERIOD_MS, NETTEST_EXIT_LOSS);
 
         exit(EXIT_FAILURE);
 }
@@ -261,6 +1478,22 @@ int main(int argc, char **argv)
                 { "print-time",         no_argument,            NULL, 't'},
                 { "version",            no_argument,            NULL, 'v'},
                 { "use-ethernet",	required_argument,      NULL, 'i'},
+                { "tcp",		no_argument,		NULL, 'T'},
+                { "low-latency",	no_argument,		NULL, 'L'},
+		{ "async-log",		no_argument,		NULL, 'A'},
+		{ "hugepages",		no_argument,		NULL, 'H'},
+		{ "numa-node",		required_argument,	NULL, 'N'},
+                { "cpu",		required_argument,	NULL, 'c'},
+                { "rt-prio",		required_argument,	NULL, 'r'},
+                { "report",		required_argument,	NULL, 'R'},
+                { "groups",		required_argument,	NULL, 'g'},
+                { "class",		required_argument,	NULL, 'C'},
+                { "pattern",		required_argument,	NULL, 'P'},
+                { "control",		required_argument,	NULL, 'k'},
+                { "replay",		required_argument,	NULL, 'x'},
+                { "speed",		required_argument,	NULL, 'X'},
+                { "frames",		no_argument,		NULL, 'F'},
+                { "dests",		required_argument,	NULL, 'D'},
                 { 0, 0, 0, 0    /* END */ }
         };
         int option_index = 0;
@@ -268,14 +1501,31 @@ int main(int argc, char **argv)
 				NETTEST_FILLER_SIZE + 2,
 	    max_packet_size = sizeof(struct data_packet_s) + 2;
 	int s;
-	struct comm_info_s comm = { .type = NETTEST_INFO_TYPE_UDP };
+	struct comm_info_s comm = {
+		.type = NETTEST_INFO_TYPE_UDP,
+		.lowlat.cpu = -1,
+		.lowlat.numa = NETTEST_NUMA_AUTO,
+		.lowlat.numa_placed = -1,
+	};
 	unsigned int port = NETTEST_UDP_PORT;
 	char *if_name = NULL;
 	size_t packet_size = NETTEST_PACKET_SIZE;
-	unsigned int period_ms = NETTEST_PERIOD_MS;
+	double period_ms = NETTEST_PERIOD_MS;
+	unsigned int groups_num = 1;
+	double class_period_ms[NETTEST_CLASSES_MAX];
+	struct comm_class_s *cls;
+	struct nettest_sched_s pattern = { .num = 0 };
+	char *pattern_str = NULL;
+	unsigned int sent;
+	bool async_log = false;
+	bool use_tcp = false;
+	long report_s = -1;
+	double pps;
 	bool use_ack = 0;
 	static unsigned int packets_num = 0;
-	char *str;
+	char *str, *end;
+	long val;
+	int i, ret;
 
         /*
          * Parse options in command line
@@ -285,7 +1535,7 @@ int main(int argc, char **argv)
         while (1) {
                 option_index = 0; /* getopt_long stores the option index here */
 
-                c = getopt_long(argc, argv, "hdtvp:i:s:f:n:a",
+                c = getopt_long(argc, argv, "hdtvp:i:Ts:f:n:g:C:P:k:x:X:FD:aALHN:c:r:R:",
                                 long_options, &option_index);
 
                 /* Detect the end of the options */
@@ -312,6 +1562,56 @@ int main(int argc, char **argv)
 			use_ack = 1;
 			break;
 
+		case 'L':
+			comm.lowlat.enabled = true;
+			break;
+
+		case 'H':
+			comm.lowlat.hugepages = true;
+			break;
+
+		case 'N':
+			if (strcmp(optarg, "off") == 0) {
+				comm.lowlat.numa = NETTEST_NUMA_OFF;
+				break;
+			}
+			comm.lowlat.numa = strtol(optarg, &end, 10);
+			err_if_exit(end == optarg || *end ||
+				    comm.lowlat.numa < 0 ||
+				    comm.lowlat.numa >= nettest_numa_nodes(),
+				    EXIT_FAILURE, "NUMA node must be in [0, %d] "
+				    "or off", nettest_numa_nodes() - 1);
+			break;
+
+		case 'A':
+			async_log = true;
+			break;
+
+		case 'c':
+			val = strtol(optarg, &end, 10);
+			err_if_exit(end == optarg || *end || val < 0 ||
+				    val >= CPU_SETSIZE ||
+				    !nettest_cpu_online(val), EXIT_FAILURE,
+				    "invalid or offline CPU %s", optarg);
+			comm.lowlat.cpu = val;
+			break;
+
+		case 'r':
+			comm.lowlat.rt_prio = strtol(optarg, &end, 10);
+			err_if_exit(end == optarg || *end ||
+				    comm.lowlat.rt_prio < 1 ||
+				    comm.lowlat.rt_prio > 99, EXIT_FAILURE,
+				    "real-time priority must be in [1, 99]");
+			break;
+
+		case 'R':
+			report_s = strtol(optarg, &end, 10);
+			err_if_exit(end == optarg || *end || report_s < 0 ||
+				    report_s > NETTEST_REPORT_MAX, EXIT_FAILURE,
+				    "report interval must be in [0, %d] seconds",
+				    NETTEST_REPORT_MAX);
+			break;
+
 		case 's':
 			packet_size = strtoul(optarg, NULL, 10);
 			err_if_exit(packet_size < min_packet_size, EXIT_FAILURE,
@@ -323,7 +1623,66 @@ int main(int argc, char **argv)
 			break;
 
 		case 'f':
-			period_ms = strtoul(optarg, NULL, 10);
+			period_ms = strtod(optarg, NULL);
+			err_if_exit(period_ms < 0 || period_ms * 1000 > UINT_MAX,
+				    EXIT_FAILURE, "invalid period %s", optarg);
+			break;
+
+		case 'g':
+			groups_num = strtoul(optarg, NULL, 10);
+			err_if_exit(groups_num < 1 ||
+				    groups_num > NETTEST_FLOWS_MAX, EXIT_FAILURE,
+				    "groups number must be in [1, %d]",
+				    NETTEST_FLOWS_MAX);
+			break;
+
+		case 'C':
+			err_if_exit(comm.classes_num == NETTEST_CLASSES_MAX,
+				    EXIT_FAILURE, "too many classes, max is %d",
+				    NETTEST_CLASSES_MAX);
+			ret = parse_class(optarg,
+					&comm.classes[comm.classes_num],
+					&class_period_ms[comm.classes_num]);
+			err_if_exit(ret < 0, EXIT_FAILURE,
+				    "invalid class %s", optarg);
+			comm.classes_num++;
+			break;
+
+		case 'P':
+			ret = parse_pattern(optarg, &pattern);
+			err_if_exit(ret < 0, EXIT_FAILURE,
+				    "invalid pattern %s", optarg);
+			pattern_str = optarg;
+			break;
+
+		case 'k':
+			str = strrchr(optarg, ':');
+			if (str) {
+				*str++ = '\0';
+				comm.ctrl.address = optarg;
+			} else
+				str = optarg;
+			comm.ctrl.port = strtoul(str, NULL, 10);
+			err_if_exit(comm.ctrl.port == 0 || comm.ctrl.port > 65535,
+				EXIT_FAILURE, "port number must in in [1, 65535]");
+			break;
+
+		case 'x':
+			replay.file = optarg;
+			break;
+
+		case 'X':
+			replay.speed = strtod(optarg, NULL);
+			err_if_exit(replay.speed < 0, EXIT_FAILURE,
+				    "invalid replay speed %s", optarg);
+			break;
+
+		case 'F':
+			replay.frames = true;
+			break;
+
+		case 'D':
+			sweep.file = optarg;
 			break;
 
 		case 'n':
@@ -332,7 +1691,7 @@ int main(int argc, char **argv)
 
 		case 'p':
 			port = strtoul(optarg, NULL, 10);
-			err_if_exit(port = 0 || port > 65535,
+			err_if_exit(port == 0 || port > 65535,
 				EXIT_FAILURE, "port number must in in [1, 65535]");
 			comm.type = NETTEST_INFO_TYPE_UDP;
 			break;
@@ -342,6 +1701,10 @@ int main(int argc, char **argv)
 			comm.type = NETTEST_INFO_TYPE_ETHERNET;
 			break;
 
+		case 'T':
+			use_tcp = true;
+			break;
+
 		case ':':
 		case '?':
 			err("invalid option %s", argv[optind - 1]);
@@ -351,44 +1714,190 @@ int main(int argc, char **argv)
 			BUG();
 		}
 	}
-	if (argc - optind < 1)
+	if (argc - optind < 1 && !sweep.file)
 		usage();
+	err_if_exit(argc - optind > 0 && sweep.file, EXIT_FAILURE,
+		"destinations are given by <addr> or by -D, not both");
 
 	/* Setup communication information */
+	if (use_tcp) {
+		err_if_exit(comm.type == NETTEST_INFO_TYPE_ETHERNET,
+			EXIT_FAILURE, "TCP and Ethernet are mutually exclusive");
+		comm.type = NETTEST_INFO_TYPE_TCP;
+	}
+	comm.tr = nettest_transport_get(comm.type);
+	BUG_ON(!comm.tr);
 	switch (comm.type) {
 	case NETTEST_INFO_TYPE_UDP:
+	case NETTEST_INFO_TYPE_TCP:
 		comm.proto.udp.port = port;
 		break;
 	case NETTEST_INFO_TYPE_ETHERNET:
 		comm.proto.eth.if_name = if_name;
 		break;
 	}
-	nettest_set_address(&comm, argv[optind]);
+	if (!sweep.file)
+		nettest_set_address(&comm, argv[optind]);
 	comm.packet_size = packet_size;
-	comm.period_ms = period_ms;
+	comm.period_us = period_ms * 1000;
 	comm.packets_num = packets_num;
 	comm.use_ack = use_ack;
+	/* A stream is worth nothing without its throughput */
+	if (report_s < 0)
+		report_s = comm.tr->caps & NETTEST_CAP_STREAM ? 1 : 0;
+	comm.report_s = report_s;
+
+	/* Without classes we have a single unmarked one */
+	if (comm.classes_num == 0) {
+		comm.classes[0].prio = -1;
+		class_period_ms[0] = -1;
+		comm.classes_num = 1;
+	}
+	pps = 0;
+	for (i = 0; i < comm.classes_num; i++) {
+		cls = &comm.classes[i];
+		if (class_period_ms[i] < 0 && pattern.num)
+			cls->sched = pattern;
+		else {
+			cls->period_us = class_period_ms[i] < 0 ?
+					comm.period_us :
+					class_period_ms[i] * 1000;
+			ret = cls->period_us ? nettest_sched_periodic(
+				&cls->sched, cls->period_us * NSEC_PER_USEC) : 0;
+			err_if_exit(ret < 0, EXIT_FAILURE,
+					"cannot allocate the schedule");
+		}
+		if (cls->sched.num) {
+			cls->period_us = nettest_sched_mean_ns(&cls->sched) /
+						NSEC_PER_USEC;
+			pps += 1e6 / max(cls->period_us, 1U);
+		} else
+			pps = INFINITY;
+
+		err_if_exit(cls->prio > comm.tr->prio_max, EXIT_FAILURE,
+			    "%s must be in [0, %d]", comm.tr->prio_name,
+			    comm.tr->prio_max);
+		err_if_exit(!(comm.tr->caps & NETTEST_CAP_VLAN) &&
+			    cls->vlan, EXIT_FAILURE,
+			    "VLAN ID is supported by Ethernet only");
+	}
+	/* Announce the combined rate to let the server size its buffers */
+	comm.period_us = isinf(pps) ? 0 : max(1e6 / pps, 1.);
+
+	err_if_exit(groups_num * comm.classes_num > NETTEST_FLOWS_MAX,
+			EXIT_FAILURE, "too many flows, max is %d",
+			NETTEST_FLOWS_MAX);
+
+	/* The capture gives the timing, which is unknown in advance */
+	if (replay.file) {
+		err_if_exit(comm.classes_num > 1 || pattern.num || use_ack,
+			EXIT_FAILURE, "replay doesn't support classes, "
+			"patterns or ACKs");
+		ret = nettest_pcap_open(&replay.pcap, replay.file);
+		err_if_exit(ret < 0, EXIT_FAILURE, "cannot open capture %s: %m",
+			replay.file);
+		comm.period_us = 0;
+	}
+	err_if_exit(sweep.file && (comm.classes_num > 1 || pattern.num ||
+		groups_num > 1 || replay.file || comm.ctrl.port), EXIT_FAILURE,
+		"sweep doesn't support classes, patterns, groups, replay "
+		"or the control channel");
+	err_if_exit((comm.tr->caps & NETTEST_CAP_STREAM) &&
+		(comm.classes_num > 1 || use_ack || replay.file || sweep.file),
+		EXIT_FAILURE, "TCP doesn't support multiple classes, ACKs, "
+		"replay or sweep");
 
 	/* Print some useful information and do the job */
 	info("running client ver %s.", NETTEST_VERSION);
-	info("connecting with %s server at %s",
+	if (!sweep.file) {
+		info("connecting with %s server at %s",
 				nettest_get_proto(&comm),
 				str = nettest_get_address(&comm));
-	free(str);
-	if (comm.period_ms)
-		info("sending %ld bytes packets every %dms",
-				comm.packet_size, comm.period_ms);
-	else
-		info("sending %ld bytes packets at wire speed",
+		free(str);
+	}
+	if (replay.file)
+		info("replaying %s%s at %s", replay.file,
+			replay.frames ? " (frames contents too)" : "",
+			replay.speed ? "its timing" : "wire speed");
+	if (replay.file && replay.speed && replay.speed != 1)
+		info("replay speed is %gx", replay.speed);
+	for (i = 0; i < comm.classes_num; i++) {
+		cls = &comm.classes[i];
+		if (cls->prio >= 0 && !(comm.tr->caps & NETTEST_CAP_VLAN))
+			info("class %d: %s %d", i, comm.tr->prio_name,
+				cls->prio);
+		else if (cls->prio >= 0)
+			info("class %d: %s %d, VLAN %u", i, comm.tr->prio_name,
+				cls->prio, cls->vlan);
+		if (replay.file)
+			continue;
+		if (cls->sched.num && cls->sched.num > 1)
+			info("sending %ld bytes packets following %s "
+				"(1 packet every %gms on average)",
+				comm.packet_size, pattern_str,
+				cls->period_us / 1000.);
+		else if (cls->sched.num)
+			info("sending %ld bytes packets every %gms",
+				comm.packet_size, cls->period_us / 1000.);
+		else
+			info("sending %ld bytes packets at wire speed",
 				comm.packet_size);
+	}
 	if (comm.packets_num)
 		info("total packets number to transmit is %u",
 				comm.packets_num);
 	if (comm.use_ack)
 		info("ACK reception is enabled");
+	err_if_exit(groups_num > 1 && !(comm.tr->caps & NETTEST_CAP_GROUPS),
+			EXIT_FAILURE, "multiple groups are supported by UDP only");
+	if (groups_num > 1)
+		info("packets are sent round robin to %u destinations",
+				groups_num);
+
+	s = comm.tr->open(&comm, false);
+	setup_classes(s, &comm);
+	if (sweep.file) {
+		sweep_load(&comm);
+		info("sweeping %u %s servers listed into %s",
+			comm.dests_num, nettest_get_proto(&comm), sweep.file);
+	} else
+		setup_dests(&comm, groups_num);
+	nettest_setup_ifmon(&comm);
+	nettest_ifmon_follow(&comm, &comm.dests[0]);
+	/* Before any thread or packet buffer is made */
+	nettest_setup_numa(&comm, &arena);
+	if (comm.ctrl.port)
+		ctrl_connect(&comm);
+	/* Before the low-latency setup, which must not apply to its thread */
+	if (async_log) {
+		ret = nettest_log_start();
+		err_if_exit(ret < 0, EXIT_FAILURE,
+				"cannot start the logging thread: %m");
+	}
+	if (comm.tr->caps & NETTEST_CAP_STREAM)
+		nettest_setup_arena(&comm, &arena, STREAM_CHUNKS,
+					STREAM_CHUNK_SIZE);
+	else
+		nettest_setup_arena(&comm, &arena, ARENA_BUFS,
+					sizeof(struct data_packet_s));
+	nettest_setup_lowlat(s, &comm);
+	if (sweep.file)
+		sent = sweep_loop(s, &comm);
+	else if (replay.file)
+		sent = replay_loop(s, &comm);
+	else if (comm.tr->caps & NETTEST_CAP_STREAM)
+		sent = stream_loop(s, &comm);
+	else
+		sent = mainloop(s, &comm);
+	nettest_report_ifstats(&comm, true);
+	ret = comm.ctrl.port ? ctrl_report(&comm, sent) : EXIT_SUCCESS;
 
-	s = open_socket(&comm);
-	mainloop(s, &comm);
+	for (i = 1; i < comm.classes_num; i++)
+		if (comm.classes[i].s != s)
+			comm.tr->close(comm.classes[i].s);
+	comm.tr->close(s);
+	nettest_ifmon_close(&comm.ifmon);
+	nettest_arena_destroy(&arena);
 
-	return 0;
+	return ret;
 }
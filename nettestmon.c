@@ -0,0 +1,333 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <getopt.h>
+#include <signal.h>
+#include "misc.h"
+#include "live.h"
+
+int __debug_level;
+int __add_time;
+
+#define DEFAULT_INTERVAL_S	1
+
+struct sample_s {
+	uint64_t tests;
+	unsigned int flows;
+	uint64_t start_ns;
+	uint64_t t_ns;			/* when the sample was taken */
+	struct nettest_live_flow_s *flow;
+	struct nettest_live_flow_s sum;
+};
+
+static void take_sample(const struct nettest_live_s *l, struct sample_s *s)
+{
+	struct nettest_live_flow_s *f, *sum = &s->sum;
+	unsigned int i, j;
+
+	nettest_live_read_header(l, &s->tests, &s->flows, &s->start_ns);
+	s->t_ns = nettest_now_ns();
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < s->flows; i++) {
+		f = &s->flow[i];
+		nettest_live_read_flow(l, i, f);
+
+		sum->received += f->received;
+		sum->bytes += f->bytes;
+		sum->lost += f->lost;
+		sum->lost_local += f->lost_local;
+		sum->dup += f->dup;
+		sum->reordered += f->reordered;
+		sum->ipt_max_ns = max(sum->ipt_max_ns, f->ipt_max_ns);
+		sum->last_ns = max(sum->last_ns, f->last_ns);
+		for (j = 0; j < NETTEST_LIVE_IPT_SLOTS; j++)
+			sum->ipt[j] += f->ipt[j];
+	}
+}
+
+/* Return the upper bound of the slot below which percent of the ipt fall */
+static uint64_t ipt_percentile(const uint64_t *ipt, const uint64_t *prev,
+			double percent)
+{
+	uint64_t count = 0, n = 0, target;
+	unsigned int i;
+
+	for (i = 0; i < NETTEST_LIVE_IPT_SLOTS; i++)
+		count += ipt[i] - (prev ? prev[i] : 0);
+	if (count == 0)
+		return 0;
+
+	target = count * percent / 100.;
+	for (i = 0; i < NETTEST_LIVE_IPT_SLOTS; i++) {
+		n += ipt[i] - (prev ? prev[i] : 0);
+		if (n > target)
+			break;
+	}
+
+	return 2ULL << min(i, NETTEST_LIVE_IPT_SLOTS - 1U);
+}
+
+/*
+ * Rates mode
+ */
+
+static void print_rates(const char *title, const struct nettest_live_flow_s *f,
+			const struct nettest_live_flow_s *p, double secs)
+{
+	/* Late packets decrement the lost counter, so the delta is signed */
+	info("%s: %.0f pps, %.3f Mbps, %ld lost (%ld by local drops), "
+		"%lu dup, %lu reordered, ipt p50/p99 < %.1f/%.1fus",
+		title, (f->received - p->received) / secs,
+		(f->bytes - p->bytes) * 8 / secs / 1e6,
+		(int64_t) (f->lost - p->lost),
+		(int64_t) (f->lost_local - p->lost_local),
+		f->dup - p->dup, f->reordered - p->reordered,
+		ipt_percentile(f->ipt, p->ipt, 50) / (double) NSEC_PER_USEC,
+		ipt_percentile(f->ipt, p->ipt, 99) / (double) NSEC_PER_USEC);
+}
+
+static void report_rates(const struct sample_s *cur,
+			const struct sample_s *prev, bool per_flow)
+{
+	double secs = (double) (cur->t_ns - prev->t_ns) / NSEC_PER_SEC;
+	char title[32];
+	unsigned int i;
+
+	if (secs <= 0)
+		secs = 1;
+
+	print_rates("total", &cur->sum, &prev->sum, secs);
+	if (!per_flow)
+		return;
+	for (i = 0; i < cur->flows; i++) {
+		snprintf(title, sizeof(title), "  flow %u", i);
+		print_rates(title, &cur->flow[i], &prev->flow[i], secs);
+	}
+}
+
+/*
+ * Metrics mode (Prometheus text exposition format)
+ */
+
+static void print_counter(const char *name, const char *help,
+			const struct sample_s *s, size_t offset)
+{
+	unsigned int i;
+
+	printf("# HELP nettest_%s %s\n", name, help);
+	printf("# TYPE nettest_%s counter\n", name);
+	for (i = 0; i < s->flows; i++)
+		printf("nettest_%s{flow=\"%u\"} %lu\n", name, i,
+			*(uint64_t *) ((char *) &s->flow[i] + offset));
+}
+
+static void report_metrics(const struct nettest_live_s *l,
+			const struct sample_s *s)
+{
+	const struct nettest_live_flow_s *f;
+	uint64_t n;
+	unsigned int i, j;
+
+	printf("# HELP nettest_tests_total Tests started by the server\n");
+	printf("# TYPE nettest_tests_total counter\n");
+	printf("nettest_tests_total{pid=\"%u\"} %lu\n", l->pid, s->tests);
+	printf("# HELP nettest_test_seconds Time since the test start\n");
+	printf("# TYPE nettest_test_seconds gauge\n");
+	printf("nettest_test_seconds %.3f\n",
+		(double) (s->t_ns - s->start_ns) / NSEC_PER_SEC);
+
+	print_counter("received_packets_total", "Packets received",
+		s, offsetof(struct nettest_live_flow_s, received));
+	print_counter("received_bytes_total", "Bytes received",
+		s, offsetof(struct nettest_live_flow_s, bytes));
+	print_counter("lost_packets_total", "Packets lost",
+		s, offsetof(struct nettest_live_flow_s, lost));
+	print_counter("local_drops_total",
+		"Lost packets dropped by the server socket",
+		s, offsetof(struct nettest_live_flow_s, lost_local));
+	print_counter("dup_packets_total", "Duplicated packets",
+		s, offsetof(struct nettest_live_flow_s, dup));
+	print_counter("reordered_packets_total", "Packets out of order",
+		s, offsetof(struct nettest_live_flow_s, reordered));
+
+	printf("# HELP nettest_ipt_seconds Inter packet time\n");
+	printf("# TYPE nettest_ipt_seconds histogram\n");
+	for (i = 0; i < s->flows; i++) {
+		f = &s->flow[i];
+		n = 0;
+		for (j = 0; j < NETTEST_LIVE_IPT_SLOTS - 1; j++) {
+			n += f->ipt[j];
+			printf("nettest_ipt_seconds_bucket{flow=\"%u\","
+				"le=\"%g\"} %lu\n", i,
+				(double) (2ULL << j) / NSEC_PER_SEC, n);
+		}
+		n += f->ipt[j];
+		printf("nettest_ipt_seconds_bucket{flow=\"%u\",le=\"+Inf\"} "
+			"%lu\n", i, n);
+		printf("nettest_ipt_seconds_count{flow=\"%u\"} %lu\n", i, n);
+	}
+	fflush(stdout);
+}
+
+/*
+ * Usage
+ */
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: %s [-h | --help] [-i | --interval <secs>]\n"
+		"               [-n | --count <samples>] [-f | --flows]\n"
+		"               [-m | --metrics]  <name>\n"
+		"  defaults are:\n"
+		"    - interval is %ds\n"
+		"    - print the total rates of the test forever, with -f\n"
+		"      the rates of each flow too\n"
+		"    - with -m print the counters once in the Prometheus text\n"
+		"      format\n",
+			NAME, DEFAULT_INTERVAL_S);
+
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Main
+ */
+
+int main(int argc, char **argv)
+{
+	int c;
+	struct option long_options[] = {
+		{ "help",		no_argument,		NULL, 'h'},
+		{ "interval",		required_argument,	NULL, 'i'},
+		{ "count",		required_argument,	NULL, 'n'},
+		{ "flows",		no_argument,		NULL, 'f'},
+		{ "metrics",		no_argument,		NULL, 'm'},
+		{ 0, 0, 0, 0    /* END */ }
+	};
+	int option_index = 0;
+	double interval = DEFAULT_INTERVAL_S;
+	long count = -1;
+	bool per_flow = false, metrics = false;
+	struct nettest_live_s *l;
+	struct sample_s sample[2], *cur, *prev;
+	struct timespec ts;
+	char *name;
+	int i;
+
+	opterr = 0;          /* disbale default error message */
+	while (1) {
+		option_index = 0; /* getopt_long stores the option index here */
+
+		c = getopt_long(argc, argv, "hi:n:fm",
+				long_options, &option_index);
+
+		/* Detect the end of the options */
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage();
+
+		case 'i':
+			interval = strtod(optarg, NULL);
+			err_if_exit(interval <= 0, EXIT_FAILURE,
+				    "interval must be positive");
+			break;
+
+		case 'n':
+			count = strtol(optarg, NULL, 10);
+			break;
+
+		case 'f':
+			per_flow = true;
+			break;
+
+		case 'm':
+			metrics = true;
+			break;
+
+		case ':':
+		case '?':
+			err("invalid option %s", argv[optind - 1]);
+			exit(EXIT_FAILURE);
+
+		default:
+			BUG();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+	name = argv[optind];
+	if (count < 0)
+		count = metrics ? 1 : 0;
+
+	l = nettest_live_open(name);
+	err_if_exit(!l, EXIT_FAILURE,
+		"cannot open live statistics %s: %m", name);
+	for (i = 0; i < 2; i++) {
+		sample[i].flow = calloc(l->flows_max, sizeof(*sample[i].flow));
+		err_if_exit(!sample[i].flow, EXIT_FAILURE,
+			"cannot allocate the samples");
+	}
+	if (!metrics)
+		info("monitoring server pid %u (up to %u flows)",
+			l->pid, l->flows_max);
+
+	cur = &sample[0];
+	prev = &sample[1];
+	take_sample(l, prev);
+	ts.tv_sec = interval;
+	ts.tv_nsec = (interval - ts.tv_sec) * NSEC_PER_SEC;
+	for (i = 0; count == 0 || i < count; i++) {
+		if (metrics) {
+			take_sample(l, cur);
+			report_metrics(l, cur);
+			if (count && i + 1 == count)
+				break;
+			nanosleep(&ts, NULL);
+			continue;
+		}
+
+		nanosleep(&ts, NULL);
+		if (kill(l->pid, 0) < 0 && errno == ESRCH) {
+			info("server pid %u is gone", l->pid);
+			break;
+		}
+		take_sample(l, cur);
+
+		/* A new test restarts all the counters */
+		if (cur->tests != prev->tests) {
+			info("new test detected (%u flows)", cur->flows);
+			memset(&prev->sum, 0, sizeof(prev->sum));
+			memset(prev->flow, 0,
+				cur->flows * sizeof(*prev->flow));
+			prev->t_ns = max(cur->start_ns, prev->t_ns);
+		}
+		report_rates(cur, prev, per_flow);
+
+		cur = prev;
+		prev = cur == &sample[0] ? &sample[1] : &sample[0];
+	}
+
+	nettest_live_close(l);
+
+	return 0;
+}
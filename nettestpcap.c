@@ -0,0 +1,526 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <getopt.h>
+#include <pthread.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include "nettest.h"
+#include "pcap.h"
+
+int __debug_level;
+int __add_time;
+
+/*
+ * The main thread walks the capture and extracts a small record of each
+ * nettest packet, which is queued to the worker owning its stream. Each
+ * stream (sender, receiver and flow number) belongs to one worker only,
+ * so the sequence analysis needs no locking.
+ */
+
+#define STREAMS_MAX		65536
+#define HASH_SIZE		(2 * STREAMS_MAX)
+#define RING_SIZE		65536		/* entries per worker */
+#define RING_PUBLISH		64		/* entries per head update */
+
+struct stream_key_s {
+	uint64_t src, dst;		/* IPv4 address and port or MAC */
+	uint16_t flow;
+	uint8_t eth;
+};
+
+struct stream_s {
+	struct stream_key_s key;
+	uint64_t tests;			/* START commands seen */
+	struct nettest_stats_s st;	/* of the current test */
+	struct nettest_stats_s sum;	/* of the previous tests */
+};
+
+struct item_s {
+	uint32_t stream;
+	uint32_t seq;
+	uint64_t ts_ns;
+	uint32_t size;
+	uint8_t command;
+};
+
+struct ring_s {
+	struct item_s *item;
+	uint64_t head __attribute__((aligned(64)));	/* written by main */
+	uint64_t tail __attribute__((aligned(64)));	/* written by worker */
+	bool done;
+
+	/* Private to the main thread */
+	uint64_t head_local __attribute__((aligned(64)));
+	uint64_t tail_cached;
+
+	pthread_t tid;
+};
+
+static struct stream_s *streams[STREAMS_MAX];
+static unsigned int streams_num;
+static uint32_t hash[HASH_SIZE];		/* stream index + 1 */
+static struct ring_s *rings;
+static unsigned int rings_num;
+
+/* Capture counters */
+static uint64_t frames, packets, truncated, overflow, foreign;
+
+/*
+ * Workers
+ */
+
+static void stats_add(struct nettest_stats_s *sum,
+			const struct nettest_stats_s *st)
+{
+	sum->received += st->received;
+	sum->bytes += st->bytes;
+	sum->lost += st->lost;
+	sum->dup += st->dup;
+	sum->reordered += st->reordered;
+	sum->outages += st->outages;
+	sum->outage_total_ns += st->outage_total_ns;
+	sum->outage_max_ns = max(sum->outage_max_ns, st->outage_max_ns);
+	sum->ipt_max_ns = max(sum->ipt_max_ns, st->ipt_max_ns);
+	if (st->received > 1)
+		sum->ipt_avg_ns = sum->ipt_avg_ns ?
+				(sum->ipt_avg_ns + st->ipt_avg_ns) / 2 :
+				st->ipt_avg_ns;
+}
+
+static void analyze(const struct item_s *it)
+{
+	struct stream_s *s = streams[it->stream];
+	enum nettest_event_e ev;
+	uint32_t missed;
+
+	/* A new test starts from scratch, as nettests does */
+	if (it->command == NETTEST_CMD_START) {
+		if (s->st.received)
+			stats_add(&s->sum, &s->st);
+		nettest_stats_reset(&s->st);
+		s->tests++;
+	}
+
+	ev = nettest_stats_update(&s->st, it->seq, it->ts_ns, it->size,
+					&missed);
+	switch (ev) {
+	case NETTEST_EV_DUP:
+		dbg("stream %u: duplicated packet received (curr=%u)",
+			it->stream, it->seq);
+		break;
+
+	case NETTEST_EV_REORDER:
+		dbg("stream %u: packet out of order (last=%u curr=%u)",
+			it->stream, s->st.last_seq, it->seq);
+		break;
+
+	case NETTEST_EV_GAP:
+		dbg("stream %u: %u packets missed (downtime=%03gms)",
+			it->stream, missed,
+			s->st.ipt_ns / (double) NSEC_PER_MSEC);
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void *worker(void *arg)
+{
+	struct ring_s *r = arg;
+	uint64_t head, tail = 0;
+	bool done;
+
+	while (1) {
+		done = __atomic_load_n(&r->done, __ATOMIC_ACQUIRE);
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		if (tail == head) {
+			if (done)
+				break;
+			sched_yield();
+			continue;
+		}
+
+		for (; tail != head; tail++)
+			analyze(&r->item[tail % RING_SIZE]);
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+/*
+ * Capture walk
+ */
+
+static void ring_publish(struct ring_s *r)
+{
+	__atomic_store_n(&r->head, r->head_local, __ATOMIC_RELEASE);
+}
+
+static void ring_push(struct ring_s *r, const struct item_s *it)
+{
+	while (r->head_local - r->tail_cached == RING_SIZE) {
+		r->tail_cached = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (r->head_local - r->tail_cached < RING_SIZE)
+			break;
+
+		/* The worker is behind, let it see what we have */
+		ring_publish(r);
+		sched_yield();
+	}
+
+	r->item[r->head_local % RING_SIZE] = *it;
+	if (++r->head_local % RING_PUBLISH == 0)
+		ring_publish(r);
+}
+
+/* Return the index of the stream of key, -1 if there is no room */
+static int stream_get(const struct stream_key_s *key)
+{
+	struct stream_s *s;
+	uint64_t h;
+	uint32_t i;
+
+	h = (key->src * 0x9e3779b97f4a7c15ULL) ^ key->dst ^
+			((uint64_t) key->flow << 48 | key->eth);
+	h *= 0xff51afd7ed558ccdULL;
+	for (i = h >> 40; ; i++) {
+		i %= HASH_SIZE;
+		if (!hash[i])
+			break;
+		s = streams[hash[i] - 1];
+		if (!memcmp(&s->key, key, sizeof(*key)))
+			return hash[i] - 1;
+	}
+
+	if (streams_num == STREAMS_MAX)
+		return -1;
+	s = calloc(1, sizeof(*s));
+	err_if_exit(!s, EXIT_FAILURE, "cannot allocate stream");
+	s->key = *key;
+	streams[streams_num] = s;
+	hash[i] = ++streams_num;
+
+	return streams_num - 1;
+}
+
+static inline uint16_t get_be16(const uint8_t *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+/*
+ * Look for our packet into the frame and return the offset of its struct
+ * data_packet_s (whose proto part is the Ethernet header or unused with
+ * UDP), or -1 if the frame doesn't carry one. The stream key is filled
+ * too.
+ */
+static int parse_frame(const struct nettest_pcap_rec_s *rec,
+			unsigned int port, struct stream_key_s *key)
+{
+	const uint8_t *d = rec->data;
+	const struct iphdr *ip;
+	const struct udphdr *udp;
+	uint32_t off, caplen = rec->caplen;
+	uint16_t type;
+
+	memset(key, 0, sizeof(*key));
+
+	/* Get the EtherType and skip the VLAN tags, if any */
+	if (rec->linktype == NETTEST_PCAP_LINKTYPE_RAW) {
+		off = 0;
+		type = caplen && d[0] >> 4 == 4 ? ETHERTYPE_IP : 0;
+	} else {
+		off = 12 + rec->link_len;
+		if (caplen < off + 2)
+			return -1;
+		type = get_be16(d + off);
+		off += 2;
+		while ((type == ETHERTYPE_VLAN || type == 0x88a8) &&
+		       caplen >= off + 4) {
+			type = get_be16(d + off + 2);
+			off += 4;
+		}
+	}
+
+	switch (type) {
+	case NETTEST_ETH_P:
+		if (rec->linktype != NETTEST_PCAP_LINKTYPE_ETHERNET)
+			return -1;
+		key->eth = 1;
+		memcpy(&key->dst, d, ETH_ALEN);
+		memcpy(&key->src, d + ETH_ALEN, ETH_ALEN);
+		return off - offsetof(struct data_packet_s, command);
+
+	case ETHERTYPE_IP:
+		if (caplen < off + sizeof(*ip))
+			return -1;
+		ip = (const struct iphdr *) (d + off);
+		if (ip->protocol != IPPROTO_UDP ||
+		    (ntohs(ip->frag_off) & IP_OFFMASK))
+			return -1;
+		off += ip->ihl * 4;
+		if (caplen < off + sizeof(*udp))
+			return -1;
+		udp = (const struct udphdr *) (d + off);
+		if (ntohs(udp->dest) != port)
+			return -1;
+		key->src = (uint64_t) ip->saddr << 16 | ntohs(udp->source);
+		key->dst = (uint64_t) ip->daddr << 16 | port;
+		return off + sizeof(*udp);
+
+	default:
+		return -1;
+	}
+}
+
+static void walk(struct nettest_pcap_s *p, unsigned int port)
+{
+	const size_t cmd_off = offsetof(struct data_packet_s, command);
+	const size_t hdr_len = sizeof(struct data_packet_s) -
+			NETTEST_FILLER_SIZE;
+	struct nettest_pcap_rec_s rec;
+	struct stream_key_s key;
+	struct data_packet_s pkt;
+	struct item_s it;
+	unsigned int i;
+	int off, idx, ret;
+
+	while ((ret = nettest_pcap_next(p, &rec)) > 0) {
+		frames++;
+		off = parse_frame(&rec, port, &key);
+		if (off < 0)
+			continue;
+		if (rec.caplen - off < hdr_len) {
+			truncated++;
+			continue;
+		}
+		memcpy(&pkt.command, rec.data + off + cmd_off,
+				hdr_len - cmd_off);
+		if (pkt.version != NETTEST_PKT_VERSION) {
+			foreign++;
+			continue;
+		}
+		key.flow = pkt.flow;
+		packets++;
+
+		idx = stream_get(&key);
+		if (idx < 0) {
+			overflow++;
+			continue;
+		}
+		it.stream = idx;
+		it.seq = pkt.pkt_num;
+		it.ts_ns = rec.ts_ns;
+		it.size = rec.len - off;
+		it.command = pkt.command;
+		ring_push(&rings[idx % rings_num], &it);
+	}
+	warn_if(ret < 0, "capture is truncated or corrupted at offset %zu",
+		p->off);
+
+	for (i = 0; i < rings_num; i++) {
+		ring_publish(&rings[i]);
+		__atomic_store_n(&rings[i].done, true, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Report
+ */
+
+static void stream_name(const struct stream_s *s, char *buf, size_t len)
+{
+	const struct stream_key_s *k = &s->key;
+	struct in_addr src = { .s_addr = k->src >> 16 };
+	struct in_addr dst = { .s_addr = k->dst >> 16 };
+	char src_str[INET_ADDRSTRLEN];
+	const uint8_t *m;
+
+	if (k->eth) {
+		m = (const uint8_t *) &k->src;
+		snprintf(buf, len, "%02x:%02x:%02x:%02x:%02x:%02x > ",
+			m[0], m[1], m[2], m[3], m[4], m[5]);
+		m = (const uint8_t *) &k->dst;
+		snprintf(buf + strlen(buf), len - strlen(buf),
+			"%02x:%02x:%02x:%02x:%02x:%02x flow %u",
+			m[0], m[1], m[2], m[3], m[4], m[5], k->flow);
+		return;
+	}
+
+	inet_ntop(AF_INET, &src, src_str, sizeof(src_str));
+	snprintf(buf, len, "%s:%u > %s flow %u", src_str,
+		(unsigned int) (k->src & 0xffff), inet_ntoa(dst), k->flow);
+}
+
+static bool report(void)
+{
+	struct nettest_stats_s total = { 0 };
+	struct stream_s *s;
+	char name[128], buf[256];
+	unsigned int i;
+
+	for (i = 0; i < streams_num; i++) {
+		s = streams[i];
+		stats_add(&s->sum, &s->st);
+		stream_name(s, name, sizeof(name));
+		nettest_stats_snprintf(buf, sizeof(buf), &s->sum);
+		info("%s: %lu test%s, %s", name, s->tests,
+			s->tests == 1 ? "" : "s", buf);
+		if (s->sum.outages)
+			info("%s: %lu outages, max %.3fms, total %.3fms", name,
+				s->sum.outages,
+				s->sum.outage_max_ns / (double) NSEC_PER_MSEC,
+				s->sum.outage_total_ns / (double) NSEC_PER_MSEC);
+		stats_add(&total, &s->sum);
+	}
+
+	nettest_stats_snprintf(buf, sizeof(buf), &total);
+	info("total of %u streams: %s", streams_num, buf);
+
+	return total.lost != 0;
+}
+
+/*
+ * Usage
+ */
+
+static void usage(void)
+{
+	fprintf(stderr,
+		"usage: %s [-h | --help] [-d | --debug] [-p <port>]\n"
+		"               [-j | --jobs <threads>]  <pcap>\n"
+		"  defaults are:\n"
+		"    - UDP port is %d, Ethernet frames are recognized by\n"
+		"      their EtherType 0x%04x\n"
+		"    - one thread per online CPU\n"
+		"    - exit code is %d if any packet has been lost\n",
+			NAME, NETTEST_UDP_PORT, NETTEST_ETH_P,
+			NETTEST_EXIT_LOSS);
+
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * Main
+ */
+
+int main(int argc, char **argv)
+{
+	int c;
+	struct option long_options[] = {
+		{ "help",		no_argument,		NULL, 'h'},
+		{ "debug",		no_argument,		NULL, 'd'},
+		{ "jobs",		required_argument,	NULL, 'j'},
+		{ 0, 0, 0, 0    /* END */ }
+	};
+	int option_index = 0;
+	unsigned int port = NETTEST_UDP_PORT;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	static struct nettest_pcap_s pcap;
+	uint64_t t0, elapsed_ns;
+	unsigned int i;
+	bool lost;
+	int ret;
+
+	opterr = 0;          /* disbale default error message */
+	while (1) {
+		option_index = 0; /* getopt_long stores the option index here */
+
+		c = getopt_long(argc, argv, "hdp:j:",
+				long_options, &option_index);
+
+		/* Detect the end of the options */
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'h':
+			usage();
+
+		case 'd':
+			__debug_level++;
+			break;
+
+		case 'p':
+			port = strtoul(optarg, NULL, 10);
+			err_if_exit(port == 0 || port > 65535,
+				EXIT_FAILURE, "port number must in in [1, 65535]");
+			break;
+
+		case 'j':
+			jobs = strtol(optarg, NULL, 10);
+			err_if_exit(jobs < 1 || jobs > 256, EXIT_FAILURE,
+				"threads must be in [1, 256]");
+			break;
+
+		case ':':
+		case '?':
+			err("invalid option %s", argv[optind - 1]);
+			exit(EXIT_FAILURE);
+
+		default:
+			BUG();
+		}
+	}
+	if (argc - optind != 1)
+		usage();
+
+	ret = nettest_pcap_open(&pcap, argv[optind]);
+	err_if_exit(ret < 0, EXIT_FAILURE, "cannot open capture %s: %m",
+		argv[optind]);
+
+	rings_num = max(jobs, 1L);
+	rings = aligned_alloc(64, rings_num * sizeof(*rings));
+	err_if_exit(!rings, EXIT_FAILURE, "cannot allocate the workers");
+	memset(rings, 0, rings_num * sizeof(*rings));
+	for (i = 0; i < rings_num; i++) {
+		rings[i].item = calloc(RING_SIZE, sizeof(*rings[i].item));
+		err_if_exit(!rings[i].item, EXIT_FAILURE,
+			"cannot allocate the workers");
+		ret = pthread_create(&rings[i].tid, NULL, worker, &rings[i]);
+		err_if_exit(ret, EXIT_FAILURE, "cannot start the workers: %s",
+			strerror(ret));
+	}
+
+	t0 = nettest_now_ns();
+	walk(&pcap, port);
+	for (i = 0; i < rings_num; i++)
+		pthread_join(rings[i].tid, NULL);
+	elapsed_ns = nettest_now_ns() - t0;
+
+	info("read %lu frames (%lu nettest packets) in %.3fs "
+		"(%.2f Mframes/s) with %u thread%s", frames, packets,
+		elapsed_ns / (double) NSEC_PER_SEC,
+		frames * 1000. / max(elapsed_ns, 1UL), rings_num,
+		rings_num == 1 ? "" : "s");
+	warn_if(pcap.skipped, "%lu frames of unsupported link types skipped",
+		pcap.skipped);
+	warn_if(truncated, "%lu packets not captured whole enough to be "
+		"analyzed (snaplen too short?)", truncated);
+	warn_if(foreign, "%lu packets of another nettest version ignored",
+		foreign);
+	warn_if(overflow, "%lu packets of streams beyond the first %d "
+		"ignored", overflow, STREAMS_MAX);
+	lost = report();
+	nettest_pcap_close(&pcap);
+
+	return lost ? NETTEST_EXIT_LOSS : EXIT_SUCCESS;
+}
@@ -17,7 +17,10 @@
  */
 
 #include <getopt.h>
+#include <signal.h>
 #include "nettest.h"
+#include "prof.h"
+#include "live.h"
 
 int __debug_level;
 int __add_time;
@@ -25,239 +28,1020 @@ int __add_time;
 static int prompt_n;
 static char prompt_symbol[] = { '|', '/', '-', '\\' };
 
-static int open_socket(struct comm_info_s *comm)
+static volatile sig_atomic_t stop_request;
+
+/* Per traffic class accounting, on top of the flows table */
+struct class_stats_s {
+	int prio;			/* marking set by the client */
+	int rx_prio;			/* marking of the last packet */
+	uint64_t remarked;		/* packets received with another one */
+	uint64_t early;			/* packets received before being sent */
+	struct nettest_hist_s latency;	/* one-way latency in us */
+};
+static struct class_stats_s classes[NETTEST_CLASSES_MAX];
+static unsigned int classes_num = 1;
+
+/* Loss by position of the packets into their burst (bursty patterns) */
+static struct burst_stats_s {
+	unsigned int size;		/* largest burst seen */
+	uint64_t received[NETTEST_BURST_MAX];
+	uint64_t lost[NETTEST_BURST_MAX];
+} bursts;
+
+/* The packet buffers of the main thread, a received batch */
+#define ARENA_BUFS		NETTEST_TRANSPORT_BATCH
+static struct nettest_arena_s arena;
+
+/* Counters published for external monitors, if any */
+static struct nettest_live_s *live;
+
+/*
+ * Loop detection: a packet received LOOP_COPIES times raises the alarm,
+ * which is cleared after LOOP_QUIET_MS without duplicates. Meanwhile
+ * the duplicates are only reported by a summary every LOOP_SUMMARY_MS.
+ */
+#define LOOP_COPIES		3
+#define LOOP_QUIET_MS		1000
+#define LOOP_SUMMARY_MS		1000
+
+static struct loop_state_s {
+	bool enabled;
+	bool active;			/* a loop is in progress */
+	uint64_t t_start, t_last_dup, t_summary;
+	uint64_t dups;			/* duplicates since the loop started */
+	unsigned int copies_max;
+	struct nettest_loop_s det;
+} loop;
+
+static void sig_handler(int signo)
+{
+	stop_request = 1;
+}
+
+/* Return the bytes of the packets of a batch */
+static inline size_t rx_bytes(const struct nettest_rx_s *rx, int n)
+{
+	size_t bytes = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		bytes += rx[i].len;
+
+	return bytes;
+}
+
+/* Return the bytes of the packets of a batch to send */
+static inline size_t tx_bytes(const struct nettest_tx_s *tx, int n)
+{
+	size_t bytes = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		bytes += tx[i].len;
+
+	return bytes;
+}
+
+/*
+ * Return the arrival time of a packet of a batch received at t_mono and
+ * t_real (by both clocks), by the monotonic clock. The kernel timestamps
+ * tell how long ago each packet arrived.
+ */
+static inline uint64_t rx_mono_ns(const struct nettest_rx_s *rx,
+			uint64_t t_mono, uint64_t t_real)
+{
+	if (!rx->ts_ns || rx->ts_ns > t_real || t_real - rx->ts_ns > t_mono)
+		return t_mono;
+
+	return t_mono - (t_real - rx->ts_ns);
+}
+
+static int __recv_data(int s, struct comm_info_s *comm,
+				struct nettest_rx_s *rx, unsigned int n, int flags)
 {
-	int s;
-	struct sockaddr_in addr;
-	struct ip_mreq mc_request;
 	int ret;
 
-	switch (comm->type) {
-	case NETTEST_INFO_TYPE_UDP:
-		dbg("selected communication protocol is UDP");
+	ret = comm->tr->recv(s, comm, rx, n, flags);
+	prof_syscall(PROF_RECV, ret > 0 ? rx_bytes(rx, ret) : ret);
+
+	return ret;
+}
 
-		s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-	        err_if_exit(s < 0, EXIT_FAILURE, "unable to open socket: %m");
+/*
+ * Receive a batch of up to n packets, waiting for the first one only, and
+ * return how many arrived
+ */
+static int recv_data(int s, struct comm_info_s *comm,
+				struct nettest_rx_s *rx, unsigned int n)
+{
+	uint64_t deadline = 0;
+	int ret;
 
-		if (comm->proto.udp.multicast_address) {
-			/* Construct a IGMP join request structure */
-			mc_request.imr_multiaddr.s_addr =
-				inet_addr(comm->proto.udp.multicast_address);
-			mc_request.imr_interface.s_addr = htonl(INADDR_ANY);
+	/* The signal may have arrived while we were not into recv */
+	if (stop_request) {
+		errno = EINTR;
+		return -1;
+	}
 
-			/* Set ADD MEMBERSHIP message */
-			ret = setsockopt(s, IPPROTO_IP, IP_ADD_MEMBERSHIP,
-                                (void *)&mc_request, sizeof(mc_request));
-			err_if_exit(ret < 0, EXIT_FAILURE,
-					"cannot add membership: %m");
-                }
-
-		/* Bind the socket */
-		addr.sin_family = AF_INET;
-		addr.sin_port = htons(comm->proto.udp.port);
-		addr.sin_addr.s_addr = htonl(INADDR_ANY);
-		ret = bind(s, (struct sockaddr *) &addr, sizeof(addr));
-		err_if_exit(ret < 0, EXIT_FAILURE, "cannot bind socket: %m");
-		break;
+	if (!comm->lowlat.enabled)
+		return __recv_data(s, comm, rx, n, 0);
+
+	/*
+	 * Spin on the socket instead of sleeping into the kernel, but
+	 * give back control from time to time to serve the control channel
+	 */
+	if (comm->ctrl.port)
+		deadline = nettest_now_ns() +
+				NETTEST_CTRL_POLL_MS * NSEC_PER_MSEC;
+	do {
+		ret = __recv_data(s, comm, rx, n, MSG_DONTWAIT);
+	} while (ret < 0 && errno == EAGAIN && !stop_request &&
+		 (!comm->ctrl.port || nettest_now_ns() < deadline));
+	if (ret < 0 && stop_request)
+		errno = EINTR;
+
+	return ret;
+}
+
+/*
+ * Update the counter of packets dropped by our socket. Some transports
+ * (i.e. UDP by SO_RXQ_OVFL) get it for free on each packet, for the
+ * others we ask the kernel.
+ */
+static void update_rx_drops(int s, struct comm_info_s *comm)
+{
+	if (comm->tr->drops)
+		comm->rx_drops += comm->tr->drops(s);
+}
+
+/*
+ * Remember the sender of the packet as the client of the test. Its
+ * headers are rebuilt only when it changes.
+ */
+static void update_peer(struct comm_info_s *comm,
+			const struct nettest_rx_s *rx)
+{
+	comm->rx_prio = rx->prio;
+	if (unlikely(memcmp(rx->from, &comm->peer.addr, sizeof(*rx->from)))) {
+		comm->peer.addr = *rx->from;
+		comm->tr->prepare_dest(comm, NULL, &comm->peer);
+	}
+}
+
+/*
+ * ACK reflection
+ *
+ * The ACKs requested by the packets of a batch are sent back to their
+ * senders before any other work on them, all by a single call, so that
+ * the RTT measured by the client includes as little of us as possible.
+ * Each ACK carries the arrival time of its packet (the kernel timestamp)
+ * and the time it was sent back: their difference, the residence time,
+ * is what we add to the RTT.
+ */
+
+static struct reflect_s {
+	struct comm_dest_s dest[ARENA_BUFS];	/* senders of the batch */
+	unsigned int copies[ARENA_BUFS];	/* by the loop detector */
+	uint64_t acks, batches;
+	struct nettest_hist_s residence;	/* in ns */
+} reflect;
+
+/*
+ * Packets of another version of nettest, or too short to be ours, can't be
+ * decoded: they are counted and dropped
+ */
+static uint64_t foreign;
+
+static bool foreign_packet(const struct nettest_rx_s *rx)
+{
+	const struct data_packet_s *pkt = rx->pkt;
+
+	if (rx->len >= offsetof(struct data_packet_s, filler) &&
+	    pkt->version == NETTEST_PKT_VERSION)
+		return false;
+	if (foreign++ == 0)
+		warn("dropping packets of another nettest version (%u, this "
+			"is %u): please use the same one on both sides",
+			rx->len > offsetof(struct data_packet_s, version) ?
+				pkt->version : 0, NETTEST_PKT_VERSION);
+
+	return true;
+}
 
-        case NETTEST_INFO_TYPE_ETHERNET:
-                dbg("selected communication protocol is Ethernet");
+static void reflect_batch(int s, struct comm_info_s *comm,
+			struct nettest_rx_s *rx, unsigned int n, uint64_t t_real)
+{
+	struct nettest_tx_s tx[ARENA_BUFS];
+	struct data_packet_s *pkt;
+	unsigned int i, k = 0;
+	uint64_t t_tx;
+	int ret;
 
-                s = socket(AF_PACKET, SOCK_RAW, htons(NETTEST_ETH_P));
-                err_if_exit(s < 0, EXIT_FAILURE, "unable to open socket: %m");
+	for (i = 0; i < n; i++) {
+		pkt = rx[i].pkt;
+		/* Don't feed a loop with more packets */
+		if (pkt->mode != NETTEST_MODE_ACK || reflect.copies[i] != 1)
+			continue;
+		/* A new test, which the ACK belongs to */
+		if (pkt->command == NETTEST_CMD_START) {
+			reflect.acks = reflect.batches = 0;
+			memset(&reflect.residence, 0,
+				sizeof(reflect.residence));
+		}
+		pkt->ack_rx_ns = rx[i].ts_ns ? rx[i].ts_ns : t_real;
+		/* The headers are built again only for a new sender */
+		if (likely(!memcmp(rx[i].from, &comm->peer.addr,
+					sizeof(*rx[i].from))))
+			tx[k].dest = &comm->peer;
+		else {
+			comm->tr->prepare_dest(comm, NULL, &reflect.dest[i]);
+			tx[k].dest = &reflect.dest[i];
+		}
+		tx[k].pkt = pkt;
+		tx[k].len = rx[i].len;
+		k++;
+	}
+	if (k == 0)
+		return;
 
-                /* Complete the Ethernet sockaddr_ll data */
-                ret = get_ifindex(s, comm->proto.eth.if_name);
-                err_if_exit(ret < 0, EXIT_FAILURE,
-                                        "cannot get interface index");
-                comm->proto.eth.raw_address.sll_ifindex = ret;
-                comm->proto.eth.raw_address.sll_family = AF_PACKET;
-                comm->proto.eth.raw_address.sll_protocol = htons(NETTEST_ETH_P);
-                comm->proto.eth.raw_address.sll_halen = ETH_ALEN;
+	/* Let the client estimate the offset of our clock */
+	t_tx = nettest_realtime_ns();
+	for (i = 0; i < k; i++)
+		tx[i].pkt->ack_tx_ns = t_tx;
+	prof_start(PROF_SEND);
+	for (i = 0; i < k; i += ret) {
+		ret = comm->tr->send(s, tx + i, k - i, 0);
+		prof_syscall(PROF_SEND, ret > 0 ? tx_bytes(tx + i, ret) : ret);
+		err_if_exit(ret <= 0, EXIT_FAILURE,
+				"cannot send ACK packets: %m");
+	}
+	prof_end(PROF_SEND);
+	dbg("sent %u ACKs required by the client", k);
 
-                ret = bind(s, (struct sockaddr *) &comm->proto.eth.raw_address,
-                                sizeof(comm->proto.eth.raw_address));
-                err_if_exit(ret < 0, EXIT_FAILURE,
-                                        "cannot bind interface");
+	reflect.acks += k;
+	reflect.batches++;
+	for (i = 0; i < k; i++)
+		nettest_hist_add(&reflect.residence,
+			t_tx > tx[i].pkt->ack_rx_ns ?
+				t_tx - tx[i].pkt->ack_rx_ns : 0);
+}
 
-                /* Get the MAC address of the interface to recv from */
-                ret = get_ifaddr(s, comm->proto.eth.if_name,
-                                        comm->proto.eth.raw_if_address);
-                err_if_exit(ret < 0, EXIT_FAILURE,
-                                        "cannot get MAC address: %m");
+static void report_reflect(void)
+{
+	struct nettest_hist_s *h = &reflect.residence;
 
-                break;
+	if (reflect.acks == 0)
+		return;
 
-        default:
-                err("unsupported communication protocol!");
-                exit(EXIT_FAILURE);
-        }
+	info("ACKs: %lu sent in %lu batches (%.1f per batch), residence "
+		"min/p50/p90/p99/max: %.1f/%.1f/%.1f/%.1f/%.1fus", reflect.acks,
+		reflect.batches, (double) reflect.acks / reflect.batches,
+		h->min / (double) NSEC_PER_USEC,
+		nettest_hist_percentile(h, 50) / (double) NSEC_PER_USEC,
+		nettest_hist_percentile(h, 90) / (double) NSEC_PER_USEC,
+		nettest_hist_percentile(h, 99) / (double) NSEC_PER_USEC,
+		h->max / (double) NSEC_PER_USEC);
+}
+
+/* Print the statistics of the last interval */
+static void report_interval(struct nettest_flows_s *flows,
+			struct nettest_stats_s *prev, uint64_t elapsed_ns)
+{
+	struct nettest_stats_s stats;
+	char buf[256];
 
-        return s;
+	nettest_flows_sum(flows, &stats);
+	nettest_stats_snprintf_interval(buf, sizeof(buf), &stats, prev,
+					elapsed_ns);
+	info("interval: %s", buf);
+	*prev = stats;
+	prof_report();
 }
 
-static ssize_t send_data(int s, struct comm_info_s *comm,
-                                struct data_packet_s *pkt, size_t len)
+/*
+ * Print the TCP statistics of the connection since the prev sample, which
+ * is updated
+ */
+static void report_tcp(int s, struct comm_info_s *comm,
+			struct nettest_tcp_info_s *prev, uint64_t elapsed_ns)
 {
-	socklen_t addr_len;
+	struct nettest_tcp_info_s ti;
+	char buf[256];
 
-        switch (comm->type) {
-        case NETTEST_INFO_TYPE_UDP:
-		addr_len = sizeof(comm->proto.udp.raw_peer_address);
-                return sendto(s, pkt, len, 0,
-                       (struct sockaddr *) &comm->proto.udp.raw_peer_address,
-				addr_len);
+	if (!comm->tr->tcp_info || comm->tr->tcp_info(s, &ti) < 0)
+		return;
+	nettest_tcp_info_snprintf(buf, sizeof(buf), &ti, prev, elapsed_ns);
+	info("%s", buf);
+	*prev = ti;
+}
 
-        case NETTEST_INFO_TYPE_ETHERNET:
-		addr_len = sizeof(comm->proto.eth.raw_peer_address);
-                memcpy(pkt->proto.eth.eth.ether_shost,
-                                comm->proto.eth.raw_if_address, ETH_ALEN);
-                memcpy(pkt->proto.eth.eth.ether_dhost,
-                                comm->proto.eth.raw_peer_address.sll_addr,
-								ETH_ALEN);
-                pkt->proto.eth.eth.ether_type = htons(0xabba);
+static void reset_classes(unsigned int num)
+{
+	memset(classes, 0, sizeof(classes));
+	classes_num = min(max(num, 1U), (unsigned int) NETTEST_CLASSES_MAX);
+}
 
-                return sendto(s, pkt, len, 0, NULL, 0);
+/*
+ * Account the marking and the one-way latency of a packet. The latter is
+ * meaningful only if the clocks of the hosts are synchronized (i.e. by
+ * PTP), so packets which seem to come from the future are just counted.
+ */
+static void update_class(struct comm_info_s *comm,
+			struct data_packet_s *pkt, uint64_t rx_ns)
+{
+	struct class_stats_s *cl;
+
+	if (unlikely(pkt->cls >= classes_num))
+		return;
+	cl = &classes[pkt->cls];
 
-        default:
-                err("unsupported communication protocol!");
-                exit(EXIT_FAILURE);
-        }
+	cl->prio = pkt->prio;
+	cl->rx_prio = comm->rx_prio;
+	if (pkt->prio >= 0 && (comm->tr->caps & NETTEST_CAP_RX_PRIO) &&
+	    comm->rx_prio != pkt->prio)
+		cl->remarked++;
+
+	if (rx_ns >= pkt->tx_ns)
+		nettest_hist_add(&cl->latency,
+				(rx_ns - pkt->tx_ns) / NSEC_PER_USEC);
+	else
+		cl->early++;
 }
 
-static ssize_t recv_data(int s, struct comm_info_s *comm,
-                                struct data_packet_s *pkt, size_t len)
+/* Add up the counters of the flows of a traffic class */
+static void class_counters(struct nettest_flows_s *flows, unsigned int c,
+			uint64_t *received, uint64_t *lost)
 {
-	socklen_t addr_len;
+	unsigned int i, per_class = flows->num / classes_num;
 
-        switch (comm->type) {
-        case NETTEST_INFO_TYPE_UDP:
-		addr_len = sizeof(comm->proto.udp.raw_peer_address);
-                return recvfrom(s, pkt, len, 0,
-                       (struct sockaddr *) &comm->proto.udp.raw_peer_address,
-				& addr_len);
+	*received = *lost = 0;
+	for (i = c * per_class; i < (c + 1) * per_class; i++) {
+		*received += flows->st[i].received;
+		*lost += flows->st[i].lost;
+	}
+}
 
-	case NETTEST_INFO_TYPE_ETHERNET:
-		addr_len = sizeof(comm->proto.eth.raw_peer_address);
-		return recvfrom(s, pkt, len, 0,
-			(struct sockaddr *) &comm->proto.eth.raw_peer_address,
-                                & addr_len);
+/* Print loss, marking and latency of each traffic class */
+static void report_classes(struct nettest_flows_s *flows)
+{
+	struct class_stats_s *cl;
+	unsigned int c;
+	uint64_t received, lost;
+	char buf[64];
+
+	if (classes_num == 1 && classes[0].prio < 0)
+		return;
+
+	for (c = 0; c < classes_num; c++) {
+		cl = &classes[c];
+		class_counters(flows, c, &received, &lost);
+
+		if (cl->rx_prio >= 0)
+			snprintf(buf, sizeof(buf), ", last seen as %d, "
+				"%lu remarked", cl->rx_prio, cl->remarked);
+		else
+			buf[0] = '\0';
+		info("class %u (prio %d): %lu received, %lu lost (%.3f%%)%s",
+			c, cl->prio, received, lost,
+			received + lost ? 100. * lost / (received + lost) : 0,
+			buf);
+		if (cl->latency.count)
+			info("class %u latency min/p50/p90/p99/max: "
+				"%lu/%lu/%lu/%lu/%luus%s", c,
+				cl->latency.min,
+				nettest_hist_percentile(&cl->latency, 50),
+				nettest_hist_percentile(&cl->latency, 90),
+				nettest_hist_percentile(&cl->latency, 99),
+				cl->latency.max,
+				cl->early ? " (clocks not in sync!)" : "");
+	}
+}
+
+/*
+ * Account the packet, the packets missed before it (if any) or the late
+ * packet by their position into the bursts of the flow, that is the
+ * sequence number modulo the burst size.
+ */
+static void update_bursts(struct data_packet_s *pkt, enum nettest_event_e ev,
+			uint32_t missed, bool late)
+{
+	unsigned int n = pkt->burst, i;
+	uint32_t first;
+
+	if (n == 0 || n > NETTEST_BURST_MAX || ev == NETTEST_EV_DUP)
+		return;
+	bursts.size = max(bursts.size, n);
+
+	bursts.received[pkt->pkt_num % n]++;
+	if (late)
+		bursts.lost[pkt->pkt_num % n]--;
+	if (ev != NETTEST_EV_GAP)
+		return;
+
+	first = pkt->pkt_num - missed;
+	if (missed >= n)
+		for (i = 0; i < n; i++)
+			bursts.lost[i] += missed / n;
+	for (i = 0; i < missed % n; i++)
+		bursts.lost[(first + i) % n]++;
+}
+
+/* Print the loss percentage of each burst position, 8 per line */
+static void report_bursts(void)
+{
+	unsigned int i, j;
+	uint64_t total;
+	char buf[128];
+	int len;
+
+	if (bursts.size == 0)
+		return;
+
+	info("loss by burst position (%u packets per burst):", bursts.size);
+	for (i = 0; i < bursts.size; i += 8) {
+		len = 0;
+		for (j = i; j < min(i + 8, bursts.size); j++) {
+			total = bursts.received[j] + bursts.lost[j];
+			len += snprintf(buf + len, sizeof(buf) - len, " %6.2f%%",
+				total ? 100. * bursts.lost[j] / total : 0);
+		}
+		info("  %4u-%4u:%s", i, j - 1, buf);
+	}
+}
+
+/*
+ * Print the final statistics. When the test is made of several flows we
+ * also report how long each one took to deliver its first packet after
+ * the reference time t_ref (the join or the test start, whichever is
+ * later) and the outages, then the flows which had troubles (or all of
+ * them when debugging).
+ */
+static void report_final(const char *title, struct nettest_flows_s *flows,
+			uint64_t t_ref)
+{
+	struct nettest_stats_s stats, *st;
+	unsigned int i, got = 0, bad = 0;
+	uint64_t first_ns, first_min = UINT64_MAX, first_max = 0;
+	uint64_t first_sum = 0, missed_before = 0;
+	char buf[256];
+
+	nettest_flows_sum(flows, &stats);
+	nettest_stats_snprintf(buf, sizeof(buf), &stats);
+	info("%s, %s", title, buf);
+	prof_report_total();
+	report_classes(flows);
+	report_bursts();
+	report_reflect();
+	warn_if(foreign, "%lu packets of another nettest version dropped",
+		foreign);
+	warn_if(loop.active, "a loop is still in progress, %lu duplicates "
+		"so far", loop.dups);
+
+	if (flows->num == 1)
+		return;
+
+	for (i = 0; i < flows->num; i++) {
+		st = &flows->st[i];
+		if (st->received == 0) {
+			bad++;
+			info("flow %u: no packets received", i);
+			continue;
+		}
+
+		got++;
+		first_ns = st->first_ns > t_ref ? st->first_ns - t_ref : 0;
+		first_min = min(first_min, first_ns);
+		first_max = max(first_max, first_ns);
+		first_sum += first_ns;
+		missed_before += st->first_seq;
+
+		if (st->lost || st->first_seq)
+			bad++;
+		else if (__debug_level == 0)
+			continue;
+		info("flow %u: %lu received, %u missed before the first "
+			"after %.3fms, %lu lost in %lu outages "
+			"(max %.3fms)", i, st->received, st->first_seq,
+			first_ns / (double) NSEC_PER_MSEC,
+			st->lost, st->outages,
+			st->outage_max_ns / (double) NSEC_PER_MSEC);
+	}
+
+	info("flows: %u/%u received, %u with losses, %lu unknown packets",
+		got, flows->num, bad, flows->unknown);
+	if (got)
+		info("first packet after min/avg/max: %.3f/%.3f/%.3fms "
+			"(%lu packets missed before)",
+			first_min / (double) NSEC_PER_MSEC,
+			first_sum / (double) got / NSEC_PER_MSEC,
+			first_max / (double) NSEC_PER_MSEC, missed_before);
+	info("outages: %lu, max %.3fms, total %.3fms", stats.outages,
+		stats.outage_max_ns / (double) NSEC_PER_MSEC,
+		stats.outage_total_ns / (double) NSEC_PER_MSEC);
+}
+
+/*
+ * Loop detection
+ */
+
+/* Print what the detector saw since the last summary and clear it */
+static void loop_summary(uint64_t t_now)
+{
+	struct nettest_loop_s *l = &loop.det;
+	double secs = (double) (t_now - loop.t_summary) / NSEC_PER_SEC;
+
+	if (secs <= 0)
+		secs = 1;
 
-        default:
-                err("unsupported communication protocol!");
-                exit(EXIT_FAILURE);
-        }
+	if (l->dups)
+		info("loop: %lu duplicates in %.1fs (%.0f/s, %.1f%% of the "
+			"packets), up to %u copies, period p50/max %lu/%luus",
+			l->dups, secs, l->dups / secs,
+			100. * l->dups / l->packets, l->copies_max,
+			nettest_hist_percentile(&l->period, 50),
+			l->period.max);
+	nettest_loop_clear(l);
+	loop.t_summary = t_now;
+}
+
+static void loop_end(void)
+{
+	alert("LOOP ENDED: it lasted %.3fs, %lu duplicates, up to %u "
+		"copies of a packet",
+		(loop.t_last_dup - loop.t_start) / (double) NSEC_PER_SEC,
+		loop.dups, loop.copies_max);
+	loop.active = false;
+}
+
+/*
+ * Account the received packet and raise or clear the alarm, return the
+ * number of copies received of the packet.
+ */
+static unsigned int loop_update(struct data_packet_s *pkt, uint64_t t_now)
+{
+	unsigned int copies;
+
+	copies = nettest_loop_update(&loop.det, pkt->flow, pkt->pkt_num,
+					pkt->tx_ns, t_now);
+	if (copies == 1) {
+		if (loop.active && t_now - loop.t_last_dup >=
+					LOOP_QUIET_MS * NSEC_PER_MSEC)
+			loop_end();
+	} else {
+		if (!loop.active && copies >= LOOP_COPIES) {
+			alert("LOOP DETECTED: flow %u packet %u received %u "
+				"times", pkt->flow, pkt->pkt_num, copies);
+			loop.active = true;
+			loop.t_start = t_now;
+			loop.dups = 0;
+			loop.copies_max = 0;
+		}
+		loop.t_last_dup = t_now;
+		loop.dups++;
+		loop.copies_max = max(loop.copies_max, copies);
+	}
+
+	if (t_now - loop.t_summary >= LOOP_SUMMARY_MS * NSEC_PER_MSEC)
+		loop_summary(t_now);
+
+	return copies;
+}
+
+/*
+ * Control channel
+ */
+
+static void ctrl_open(struct comm_info_s *comm)
+{
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(comm->ctrl.port),
+		.sin_addr.s_addr = htonl(INADDR_ANY),
+	};
+	int on = 1;
+	int ret;
+
+	comm->ctrl.conn = -1;
+	comm->ctrl.s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+	err_if_exit(comm->ctrl.s < 0, EXIT_FAILURE,
+			"unable to open control socket: %m");
+	setsockopt(comm->ctrl.s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	ret = bind(comm->ctrl.s, (struct sockaddr *) &addr, sizeof(addr));
+	err_if_exit(ret < 0, EXIT_FAILURE, "cannot bind control socket: %m");
+	ret = listen(comm->ctrl.s, 1);
+	err_if_exit(ret < 0, EXIT_FAILURE, "cannot listen for control: %m");
+}
+
+static void ctrl_close(struct comm_info_s *comm)
+{
+	close(comm->ctrl.conn);
+	comm->ctrl.conn = -1;
+	dbg("control connection closed");
+}
+
+static void ctrl_fill_result(struct nettest_flows_s *flows,
+			struct nettest_ctrl_result_s *res)
+{
+	struct nettest_stats_s stats;
+	struct nettest_ctrl_class_s *rc;
+	struct class_stats_s *cl;
+	uint64_t received, lost;
+	unsigned int i;
+
+	memset(res, 0, sizeof(*res));
+	nettest_flows_sum(flows, &stats);
+	res->received = stats.received;
+	res->lost = stats.lost;
+	res->lost_local = stats.lost_local;
+	res->dup = stats.dup;
+	res->reordered = stats.reordered;
+	res->outages = stats.outages;
+	res->outage_max_ns = stats.outage_max_ns;
+	res->unknown = flows->unknown;
+
+	res->flows = flows->num;
+	for (i = 0; i < flows->num; i++) {
+		if (flows->st[i].received)
+			res->flows_received++;
+		if (flows->st[i].lost || flows->st[i].first_seq)
+			res->flows_lossy++;
+	}
+
+	res->classes = classes_num;
+	for (i = 0; i < classes_num; i++) {
+		rc = &res->cls[i];
+		cl = &classes[i];
+		rc->prio = cl->prio;
+		class_counters(flows, i, &received, &lost);
+		rc->received = received;
+		rc->lost = lost;
+		rc->remarked = cl->remarked;
+		rc->latency_p50_us = nettest_hist_percentile(&cl->latency, 50);
+		rc->latency_p99_us = nettest_hist_percentile(&cl->latency, 99);
+		rc->latency_max_us = cl->latency.max;
+	}
+}
+
+static void ctrl_send_result(struct comm_info_s *comm,
+			struct nettest_flows_s *flows)
+{
+	struct nettest_ctrl_result_s res;
+	int ret;
+
+	if (comm->ctrl.conn < 0)
+		return;
+
+	ctrl_fill_result(flows, &res);
+	ret = nettest_ctrl_send(comm->ctrl.conn, NETTEST_CTRL_RESULT,
+				&res, sizeof(res));
+	if (ret < 0) {
+		warn("cannot send the results: %s", strerror(-ret));
+		ctrl_close(comm);
+	} else
+		dbg("results sent to the client");
+}
+
+/* Check the test parameters proposed by the client */
+static int ctrl_hello(int s, struct comm_info_s *comm,
+			struct nettest_ctrl_hello_s *hello,
+			struct nettest_ctrl_accept_s *acc)
+{
+	memset(acc, 0, sizeof(*acc));
+	if (hello->version != NETTEST_CTRL_VERSION)
+		snprintf(acc->reason, sizeof(acc->reason),
+			"unsupported version %u", hello->version);
+	else if (hello->type != comm->type)
+		snprintf(acc->reason, sizeof(acc->reason),
+			"server is not accepting %s packets",
+			nettest_transport_get(hello->type) ?
+				nettest_transport_get(hello->type)->name :
+				"unknown");
+	else if (hello->packet_size > sizeof(struct data_packet_s))
+		snprintf(acc->reason, sizeof(acc->reason),
+			"packet size %u too large", hello->packet_size);
+	else if (hello->flows > NETTEST_FLOWS_MAX ||
+		 hello->classes > NETTEST_CLASSES_MAX)
+		snprintf(acc->reason, sizeof(acc->reason),
+			"too many flows or classes");
+	else if (hello->burst > NETTEST_BURST_MAX)
+		snprintf(acc->reason, sizeof(acc->reason),
+			"burst of %u packets too large", hello->burst);
+	if (acc->reason[0]) {
+		acc->status = -EINVAL;
+		return -1;
+	}
+
+	/* Make room for the announced traffic before it starts */
+	if (!(comm->tr->caps & NETTEST_CAP_STREAM))
+		nettest_set_bufsize(s, true, nettest_bufsize(hello->period_us,
+					hello->burst, hello->packet_size));
+	info("control: test of %u packets of %u bytes every %gms over %u "
+		"flows negotiated", hello->packets_num, hello->packet_size,
+		hello->period_us / 1000., hello->flows);
+
+	return 0;
+}
+
+/*
+ * Serve the control channel without blocking: accept a new connection
+ * if none and handle the messages from the client, if any.
+ */
+static void ctrl_poll(int s, struct comm_info_s *comm,
+			struct nettest_flows_s *flows)
+{
+	struct nettest_ctrl_msg_s msg;
+	struct nettest_ctrl_accept_s acc;
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int ret;
+
+	if (comm->ctrl.conn < 0) {
+		comm->ctrl.conn = accept(comm->ctrl.s,
+					(struct sockaddr *) &addr, &len);
+		if (comm->ctrl.conn < 0)
+			return;
+		info("control connection from %s", inet_ntoa(addr.sin_addr));
+	}
+
+	ret = nettest_ctrl_recv(comm->ctrl.conn, &msg, MSG_DONTWAIT);
+	if (ret == -EAGAIN)
+		return;
+	if (ret <= 0) {
+		if (ret < 0)
+			warn("control channel error: %s", strerror(-ret));
+		ctrl_close(comm);
+		return;
+	}
+
+	switch (ret) {
+	case NETTEST_CTRL_HELLO:
+		ret = ctrl_hello(s, comm, &msg.body.hello, &acc);
+		if (ret < 0)
+			warn("control: test refused, %s", acc.reason);
+		ret = nettest_ctrl_send(comm->ctrl.conn, NETTEST_CTRL_ACCEPT,
+					&acc, sizeof(acc));
+		if (ret < 0)
+			ctrl_close(comm);
+		break;
+
+	case NETTEST_CTRL_RESULT_REQ:
+		ctrl_send_result(comm, flows);
+		break;
+
+	default:
+		warn("control: unexpected message %d", ret);
+		ctrl_close(comm);
+	}
 }
 
 static void mainloop(int s, struct comm_info_s *comm)
 {
 	int receive = 1;
-	unsigned int prev_pkt_num;
-	static struct data_packet_s pkt_recv;
-	struct timeval t1, t2, t3;
-	long delta_s, delta_u, delta_point;
-	unsigned long elapsed_us;
-	unsigned long long elapsed_avg_us;
-	ssize_t nrecv, nsent;
+	struct nettest_rx_s rx[ARENA_BUFS];
+	struct data_packet_s *pkt_recv;
+	static struct nettest_flows_s flows;
+	static struct nettest_stats_s stats_prev;
+	static struct nettest_tcp_info_s tcp_start, tcp_prev;
+	struct nettest_stats_s *st;
+	enum nettest_event_e ev;
+	uint64_t t_now, t_prompt, t_report, t_ref, t_ctrl, t_real;
+	uint64_t t_batch, t_batch_real;
+	uint64_t ctrl_ns = NETTEST_CTRL_POLL_MS * NSEC_PER_MSEC;
+	uint64_t report_ns = comm->report_s * NSEC_PER_SEC;
+	uint32_t missed, local = 0;
+	unsigned int copies, rx_num = 0, rx_pos = 0, i;
+	uint64_t lost;
+	ssize_t nrecv;
 	char *str;
+	int ret;
 
-	prev_pkt_num = 0;
-	elapsed_avg_us = 0;
-	t1.tv_sec = t2.tv_sec = t3.tv_sec = 0;
-	t1.tv_usec = t2.tv_usec = t3.tv_usec = 0;
-	delta_s = delta_u = delta_point = 0;
+	for (i = 0; i < ARENA_BUFS; i++) {
+		rx[i].pkt = nettest_arena_get(&arena);
+		BUG_ON(!rx[i].pkt);
+		rx[i].size = sizeof(*rx[i].pkt);
+		rx[i].from = &reflect.dest[i].addr;
+	}
+	ret = nettest_flows_init(&flows, NETTEST_FLOWS_MAX);
+	err_if_exit(ret < 0, EXIT_FAILURE, "cannot allocate flows table");
+	/* Until a START arrives we expect one flow per joined group */
+	if (comm->type == NETTEST_INFO_TYPE_UDP &&
+	    comm->proto.udp.multicast_address)
+		nettest_flows_reset(&flows, comm->proto.udp.groups_num, 0);
+	nettest_stats_reset(&stats_prev);
+	if (live)
+		nettest_live_reset(live, flows.num, nettest_now_ns());
+	t_prompt = t_batch_real = 0;
+	t_batch = t_report = t_ref = t_ctrl = loop.t_summary = nettest_now_ns();
+	prof_init();
+
+	/* Wake up from time to time to serve the control channel */
+	if (comm->ctrl.port) {
+		ctrl_open(comm);
+		ret = nettest_set_timeout(s, SO_RCVTIMEO, NETTEST_CTRL_POLL_MS);
+		err_if_exit(ret < 0, EXIT_FAILURE,
+				"cannot set receive timeout: %m");
+	}
+
+	/* Don't take page faults into the hot loop */
+	if (comm->lowlat.enabled)
+		nettest_prefault(flows.st, flows.max * sizeof(*flows.st));
 
 	while (receive) {
-		nrecv = recv_data(s, comm, &pkt_recv, sizeof(pkt_recv));
-		err_if_exit(nrecv < 0, EXIT_FAILURE,
+		/* Each packet of the batch in turn, then a new batch */
+		if (rx_pos == rx_num) {
+			prof_start(PROF_RECV);
+			ret = recv_data(s, comm, rx, ARENA_BUFS);
+			prof_end(PROF_RECV);
+			if (ret < 0 && errno == EINTR && stop_request) {
+				report_final("interrupted", &flows, t_ref);
+				report_tcp(s, comm, &tcp_start,
+						nettest_now_ns() - t_ref);
+				nettest_report_ifstats(comm, true);
+				break;
+			}
+			if (ret < 0 && errno == EAGAIN && comm->ctrl.port) {
+				ctrl_poll(s, comm, &flows);
+				continue;
+			}
+			err_if_exit(ret < 0, EXIT_FAILURE,
 					"cannot receive packet: %m");
+			t_batch = nettest_now_ns();
+			t_batch_real = nettest_realtime_ns();
+			rx_num = ret;
+			rx_pos = 0;
 
-		/*
-		 * Get current time and compute the time difference
-		 * from previus packet
-		 */
-		gettimeofday(&t2, NULL);
-		if (t1.tv_sec) {
-			delta_s = t2.tv_sec - t1.tv_sec;
-			delta_u = t2.tv_usec - t1.tv_usec;
+			/*
+			 * The copies of a looping packet must not restart the
+			 * test nor be echoed, neither the foreign packets (0
+			 * copies), the ACKs go before anything else
+			 */
+			for (i = 0; i < rx_num; i++)
+				reflect.copies[i] = foreign_packet(&rx[i]) ?
+					0 : !loop.enabled ? 1 :
+					loop_update(rx[i].pkt, rx_mono_ns(
+						&rx[i], t_batch, t_batch_real));
+			reflect_batch(s, comm, rx, rx_num, t_batch_real);
+
+			/*
+			 * Print nice prompt to easily see what's happening,
+			 * (if debugging is disabled):
+			 * - print rotating symbols continuosly
+			 * - print a 'dot' every second
+			 */
+			prof_start(PROF_PROMPT);
+			printf("\b%c", prompt_symbol[prompt_n]);
+			if (__debug_level == 0 &&
+			    t_batch - t_prompt > NSEC_PER_SEC) {
+				t_prompt = t_batch;
+				printf("\b.%c", prompt_symbol[prompt_n]);
+			}
+			prompt_n = (prompt_n + 1) % ARRAY_SIZE(prompt_symbol);
+			fflush(stdout);
+			prof_syscall(PROF_PROMPT, 0);
+			prof_end(PROF_PROMPT);
+		}
+		pkt_recv = rx[rx_pos].pkt;
+		nrecv = rx[rx_pos].len;
+		copies = reflect.copies[rx_pos];
+		if (copies == 0) {	/* a foreign packet */
+			rx_pos++;
+			continue;
+		}
+		/* The arrival time, the kernel one if any */
+		t_now = rx_mono_ns(&rx[rx_pos], t_batch, t_batch_real);
+		t_real = rx[rx_pos].ts_ns ? rx[rx_pos].ts_ns : t_batch_real;
+		update_peer(comm, &rx[rx_pos]);
+		rx_pos++;
+		prof_packet();
+
+		if (comm->ctrl.port && t_now - t_ctrl >= ctrl_ns) {
+			ctrl_poll(s, comm, &flows);
+			t_ctrl = t_now;
 		}
 
-		if (pkt_recv.command == NETTEST_CMD_START) {
+		if (pkt_recv->command == NETTEST_CMD_START && copies == 1) {
 			info("new transmission detected, resetting counters");
 
-			if (pkt_recv.period_ms)
+			if (pkt_recv->period_us)
 				info("frequency announced is 1 packet "
-					"every %dms", pkt_recv.period_ms);
+					"every %gms", pkt_recv->period_us / 1000.);
 			else
 				info("frequency announced is at wire speed");
+			if (pkt_recv->flows > 1)
+				info("packets are spread over %u flows",
+					pkt_recv->flows);
+			warn_if(pkt_recv->flows > flows.max,
+				"only the first %u flows are tracked",
+				flows.max);
 
 			info("client address is %s",
 				str = nettest_get_peer_address(comm));
 			free(str);
+			nettest_ifmon_follow(comm, &comm->peer);
+			if (nettest_setup_numa(comm, &arena)) {
+				ret = nettest_numa_move(flows.st,
+					flows.max * sizeof(*flows.st),
+					comm->lowlat.numa_placed);
+				warn_if(ret < 0, "cannot move the flows table "
+					"to NUMA node %d: %m",
+					comm->lowlat.numa_placed);
+			}
 
-			prev_pkt_num = 0;
-			elapsed_avg_us = 0;
-			t1.tv_usec = t3.tv_usec = 0;
-			t1.tv_sec = t3.tv_sec = 0;
-		} else if (pkt_recv.command == NETTEST_CMD_STOP)
-			info("transmission completed, "
-				"received %u packets (avg ipt %lluus)",
-				prev_pkt_num, elapsed_avg_us);
+			/* Make room for the announced traffic, TCP does it */
+			if (!(comm->tr->caps & NETTEST_CAP_STREAM))
+				nettest_set_bufsize(s, true,
+					nettest_bufsize(pkt_recv->period_us,
+							pkt_recv->burst, nrecv));
+			else if (comm->tr->tcp_info(s, &tcp_start) == 0)
+				tcp_prev = tcp_start;
 
-		/*
-		 * Print nice prompt to easily see what's happening,
-		 * (if debugging is disabled):
-		 * - print rotating symbols continuosly
-		 * - print a 'dot' every second
-		 */
-		printf("\b%c", prompt_symbol[prompt_n]);
-		if (__debug_level == 0 && (t2.tv_sec - t3.tv_sec) > 1) {
-			t3 = t2;
-			printf("\b.%c", prompt_symbol[prompt_n]);
+			update_rx_drops(s, comm);
+			nettest_flows_reset(&flows, pkt_recv->flows,
+						comm->rx_drops);
+			if (live)
+				nettest_live_reset(live, flows.num, t_now);
+			reset_classes(pkt_recv->classes);
+			memset(&bursts, 0, sizeof(bursts));
+			if (pkt_recv->classes > 1)
+				info("packets are in %u traffic classes",
+					pkt_recv->classes);
+			nettest_stats_reset(&stats_prev);
+			t_prompt = 0;
+			t_report = t_ref = t_now;
 		}
-		prompt_n = (prompt_n + 1) % ARRAY_SIZE(prompt_symbol);
-		/* Flush stdout and save current time for next loop */
-		fflush(stdout);
-		t1 = t2;
-
-		/* Calculate the inter packet time */
-		elapsed_us = (delta_s) * 1000000 + delta_u;
-
-		/* Update the averge interpacket time */
-		if (elapsed_avg_us)
-			elapsed_avg_us = (elapsed_avg_us + elapsed_us) / 2;
-		else
-			elapsed_avg_us = elapsed_us;
-		dbg("recv pkt=%u/%u size=%ld ipt=%luus",
-		     pkt_recv.pkt_num, prev_pkt_num, nrecv, elapsed_us);
 
 		/*
 		 * Check the sequence number of the received packet
 		 * and report warings if any.
 		 */
-		if (prev_pkt_num) {
-			if ((pkt_recv.pkt_num == prev_pkt_num))
-				info("duplicated packet received (curr=%d)",
-					pkt_recv.pkt_num);
-			else if ((pkt_recv.pkt_num < prev_pkt_num)) /* probable packed duplication */
-				info("packet out of order (last=%d curr=%d)",
-					prev_pkt_num, pkt_recv.pkt_num);
-			else if (pkt_recv.pkt_num != prev_pkt_num + 1) {
-				info("%d packets missed (downtime=%03gus)\n",
-				     abs(pkt_recv.pkt_num - prev_pkt_num),
-				     elapsed_us/1000.);
-
-				prev_pkt_num = pkt_recv.pkt_num;
-			} else
-				prev_pkt_num = pkt_recv.pkt_num;
-		} else
-			prev_pkt_num = pkt_recv.pkt_num;
-
-		if (pkt_recv.mode == NETTEST_MODE_ACK) {
-			dbg("sending ACK required by the client");
-			nsent = send_data(s, comm, &pkt_recv, nrecv);
-			err_if_exit(nsent < 0, EXIT_FAILURE,
-                                        "cannot send ACK packet: %m");
+		prof_start(PROF_ANALYSIS);
+		st = nettest_flows_get(&flows, pkt_recv->flow);
+		if (likely(st)) {
+			lost = st->lost;
+			ev = nettest_stats_update(st, pkt_recv->pkt_num, t_now,
+							nrecv, &missed);
+			if (likely(ev != NETTEST_EV_DUP))
+				nettest_stats_delay(st, pkt_recv->tx_ns, t_real);
+			if (unlikely(ev == NETTEST_EV_GAP)) {
+				update_rx_drops(s, comm);
+				local = nettest_flows_local_drops(&flows, st,
+						comm->rx_drops, missed);
+			}
+			update_bursts(pkt_recv, ev, missed, st->lost < lost);
+			if (live)
+				nettest_live_publish(live, pkt_recv->flow, st,
+						ev != NETTEST_EV_FIRST);
+		} else {
+			ev = NETTEST_EV_FIRST;
+			if (live)
+				nettest_live_unknown(live, flows.unknown);
+		}
+		update_class(comm, pkt_recv, t_real);
+		prof_end(PROF_ANALYSIS);
+
+		prof_start(PROF_PROMPT);
+		dbg("recv flow=%u pkt=%u size=%ld", pkt_recv->flow,
+		     pkt_recv->pkt_num, nrecv);
+		switch (ev) {
+		case NETTEST_EV_DUP:
+			if (loop.enabled)
+				break;
+			info("flow %u: duplicated packet received (curr=%u)",
+				pkt_recv->flow, pkt_recv->pkt_num);
+			break;
+
+		case NETTEST_EV_REORDER:
+			/* Old copies look like late packets */
+			if (loop.active)
+				break;
+			info("flow %u: packet out of order (last=%u curr=%u)",
+				pkt_recv->flow, st->last_seq, pkt_recv->pkt_num);
+			break;
+
+		case NETTEST_EV_GAP:
+			info("flow %u: %u packets missed (%u by local drops, "
+				"downtime=%03gms)", pkt_recv->flow, missed, local,
+				st->ipt_ns / (double) NSEC_PER_MSEC);
+			break;
+
+		default:
+			break;
+		}
+		prof_end(PROF_PROMPT);
+
+		if (pkt_recv->command == NETTEST_CMD_STOP && copies == 1) {
+			report_final("transmission completed", &flows, t_ref);
+			report_tcp(s, comm, &tcp_start, t_now - t_ref);
+			nettest_report_ifstats(comm, true);
+			ctrl_send_result(comm, &flows);
+		}
+
+		if (report_ns && t_now - t_report >= report_ns) {
+			report_interval(&flows, &stats_prev, t_now - t_report);
+			report_tcp(s, comm, &tcp_prev, t_now - t_report);
+			nettest_report_ifstats(comm, false);
+			t_report = t_now;
 		}
 	}
 }
@@ -271,11 +1055,34 @@ static void usage(void)
         fprintf(stderr,
                 "usage: %s [-h | --help] [-d | --debug] [-t | --print-time]\n"
                 "               [-v | --version]\n"
-                "               [-p <port>] [-m addr]\n"
-                "               [-i | --use-ethernet <iface>]\n"
+                "               [-p <port>] [-m addr] [-g <groups>]\n"
+                "               [-S <source>]\n"
+                "               [-i | --use-ethernet <iface>] [-T | --tcp]\n"
+                "               [-L | --low-latency] [-c | --cpu <cpu>]\n"
+                "               [-r | --rt-prio <prio>] [-R | --report <secs>]\n"
+                "               [-H | --hugepages] [-N | --numa-node <node>]\n"
+                "               [-k | --control <port>]\n"
+                "               [-M | --shm <name>] [-l | --loop-detect]\n"
+                "               [-A | --async-log]\n"
                 "  defaults are:\n"
-                "    - port is %d\n",
-                        NAME, NETTEST_UDP_PORT);
+                "    - port is %d\n"
+                "    - no control channel\n"
+                "    - no live statistics, otherwise they are published\n"
+                "      into the POSIX shared memory object <name>\n"
+                "    - every duplicate is printed, otherwise packets\n"
+                "      received %d times raise a loop alarm and the\n"
+                "      duplicates are summarized every second\n"
+                "    - messages printed at once, otherwise by a background\n"
+                "      thread not to slow down the reception\n"
+                "    - packet buffers on regular pages, otherwise on 2MB\n"
+                "      hugepages (if reserved, transparent ones if not)\n"
+                "    - threads and packet buffers on the NUMA node of the\n"
+                "      interface in use, otherwise on <node> (off is anywhere)\n"
+                "    - with -m, 1 group is joined (any source)\n"
+                "    - UDP datagrams, otherwise with -T the packets are\n"
+                "      records over TCP connections (reported every second\n"
+                "      with the TCP statistics), one at a time\n",
+                        NAME, NETTEST_UDP_PORT, LOOP_COPIES);
 
         exit(EXIT_FAILURE);
 }
@@ -293,14 +1100,44 @@ int main(int argc, char **argv)
                 { "print-time",         no_argument,            NULL, 't'},
                 { "version",            no_argument,            NULL, 'v'},
 		{ "use-ethernet",       required_argument,      NULL, 'i'},
+		{ "tcp",		no_argument,		NULL, 'T'},
+		{ "low-latency",	no_argument,		NULL, 'L'},
+		{ "cpu",		required_argument,	NULL, 'c'},
+		{ "rt-prio",		required_argument,	NULL, 'r'},
+		{ "report",		required_argument,	NULL, 'R'},
+		{ "groups",		required_argument,	NULL, 'g'},
+		{ "source",		required_argument,	NULL, 'S'},
+		{ "control",		required_argument,	NULL, 'k'},
+		{ "shm",		required_argument,	NULL, 'M'},
+		{ "loop-detect",	no_argument,		NULL, 'l'},
+		{ "async-log",		no_argument,		NULL, 'A'},
+		{ "hugepages",		no_argument,		NULL, 'H'},
+		{ "numa-node",		required_argument,	NULL, 'N'},
                 { 0, 0, 0, 0    /* END */ }
         };
         int option_index = 0;
 	int s;
-	struct comm_info_s comm = { .type = NETTEST_INFO_TYPE_UDP };
+	struct comm_info_s comm = {
+		.type = NETTEST_INFO_TYPE_UDP,
+		.lowlat.cpu = -1,
+		.lowlat.numa = NETTEST_NUMA_AUTO,
+		.lowlat.numa_placed = -1,
+		.ctrl.s = -1,
+		.ctrl.conn = -1,
+	};
 	unsigned int port = NETTEST_UDP_PORT;
 	char *if_name = NULL;
 	char *multicast_addr = NULL;
+	unsigned int groups_num = 1;
+	char *source_addr = NULL;
+	char *shm_name = NULL;
+	bool async_log = false;
+	bool use_tcp = false;
+	long report_s = -1;
+	char *end;
+	long val;
+	int on = 1, ret;
+	struct sigaction act;
 
         /*
          * Parse options in command line
@@ -310,7 +1147,7 @@ int main(int argc, char **argv)
         while (1) {
                 option_index = 0; /* getopt_long stores the option index here */
 
-                c = getopt_long(argc, argv, "hdtvp:m:i:",
+                c = getopt_long(argc, argv, "hdtvp:m:g:S:i:Tk:M:lALHN:c:r:R:",
                                 long_options, &option_index);
 
                 /* Detect the end of the options */
@@ -335,7 +1172,7 @@ int main(int argc, char **argv)
 
                 case 'p':
                         port = strtoul(optarg, NULL, 10);
-                        err_if_exit(port = 0 || port > 65535,
+                        err_if_exit(port == 0 || port > 65535,
                                 EXIT_FAILURE, "port number must in in [1, 65535]");
                         break;
 
@@ -344,10 +1181,90 @@ int main(int argc, char **argv)
                         comm.type = NETTEST_INFO_TYPE_ETHERNET;
                         break;
 
+		case 'T':
+			use_tcp = true;
+			break;
+
 		case 'm':
 			multicast_addr = optarg;
 			break;
 
+		case 'g':
+			groups_num = strtoul(optarg, NULL, 10);
+			err_if_exit(groups_num < 1 ||
+				    groups_num > NETTEST_FLOWS_MAX, EXIT_FAILURE,
+				    "groups number must be in [1, %d]",
+				    NETTEST_FLOWS_MAX);
+			break;
+
+		case 'S':
+			source_addr = optarg;
+			break;
+
+		case 'k':
+			comm.ctrl.port = strtoul(optarg, NULL, 10);
+			err_if_exit(comm.ctrl.port == 0 || comm.ctrl.port > 65535,
+				EXIT_FAILURE, "port number must in in [1, 65535]");
+			break;
+
+		case 'M':
+			shm_name = optarg;
+			break;
+
+		case 'l':
+			loop.enabled = true;
+			break;
+
+		case 'A':
+			async_log = true;
+			break;
+
+		case 'L':
+			comm.lowlat.enabled = true;
+			break;
+
+		case 'H':
+			comm.lowlat.hugepages = true;
+			break;
+
+		case 'N':
+			if (strcmp(optarg, "off") == 0) {
+				comm.lowlat.numa = NETTEST_NUMA_OFF;
+				break;
+			}
+			comm.lowlat.numa = strtol(optarg, &end, 10);
+			err_if_exit(end == optarg || *end ||
+				    comm.lowlat.numa < 0 ||
+				    comm.lowlat.numa >= nettest_numa_nodes(),
+				    EXIT_FAILURE, "NUMA node must be in [0, %d] "
+				    "or off", nettest_numa_nodes() - 1);
+			break;
+
+		case 'c':
+			val = strtol(optarg, &end, 10);
+			err_if_exit(end == optarg || *end || val < 0 ||
+				    val >= CPU_SETSIZE ||
+				    !nettest_cpu_online(val), EXIT_FAILURE,
+				    "invalid or offline CPU %s", optarg);
+			comm.lowlat.cpu = val;
+			break;
+
+		case 'r':
+			comm.lowlat.rt_prio = strtol(optarg, &end, 10);
+			err_if_exit(end == optarg || *end ||
+				    comm.lowlat.rt_prio < 1 ||
+				    comm.lowlat.rt_prio > 99, EXIT_FAILURE,
+				    "real-time priority must be in [1, 99]");
+			break;
+
+		case 'R':
+			report_s = strtol(optarg, &end, 10);
+			err_if_exit(end == optarg || *end || report_s < 0 ||
+				    report_s > NETTEST_REPORT_MAX, EXIT_FAILURE,
+				    "report interval must be in [0, %d] seconds",
+				    NETTEST_REPORT_MAX);
+			break;
+
                 case ':':
                 case '?':
                         err("invalid option %s", argv[optind - 1]);
@@ -359,10 +1276,28 @@ int main(int argc, char **argv)
 	}
 
         /* Setup communication information */
+	if (use_tcp) {
+		err_if_exit(comm.type == NETTEST_INFO_TYPE_ETHERNET,
+			EXIT_FAILURE, "TCP and Ethernet are mutually exclusive");
+		err_if_exit(multicast_addr, EXIT_FAILURE,
+			"TCP doesn't support multicast");
+		comm.type = NETTEST_INFO_TYPE_TCP;
+	}
+	comm.tr = nettest_transport_get(comm.type);
+	BUG_ON(!comm.tr);
+	/* A stream is worth nothing without its throughput */
+	if (report_s < 0)
+		report_s = comm.tr->caps & NETTEST_CAP_STREAM ? 1 : 0;
+	comm.report_s = report_s;
 	switch (comm.type) {
 	case NETTEST_INFO_TYPE_UDP:
 		comm.proto.udp.port = port;
 		comm.proto.udp.multicast_address = multicast_addr;
+		comm.proto.udp.groups_num = groups_num;
+		comm.proto.udp.source_address = source_addr;
+		break;
+	case NETTEST_INFO_TYPE_TCP:
+		comm.proto.udp.port = port;
 		break;
 	case NETTEST_INFO_TYPE_ETHERNET:
 		comm.proto.eth.if_name = if_name;
@@ -375,8 +1310,17 @@ int main(int argc, char **argv)
 	case NETTEST_INFO_TYPE_UDP:
 		info("accepting UDP packets on port: %d", comm.proto.udp.port);
 		if (comm.proto.udp.multicast_address)
-			printf("accepting packets from multicast address %s",
-				comm.proto.udp.multicast_address);
+			info("accepting packets from %u multicast group%s "
+				"starting at %s%s%s", comm.proto.udp.groups_num,
+				comm.proto.udp.groups_num > 1 ? "s" : "",
+				comm.proto.udp.multicast_address,
+				comm.proto.udp.source_address ?
+						" from source " : "",
+				comm.proto.udp.source_address ?
+					comm.proto.udp.source_address : "");
+		break;
+	case NETTEST_INFO_TYPE_TCP:
+		info("accepting TCP streams on port: %d", comm.proto.udp.port);
 		break;
 	case NETTEST_INFO_TYPE_ETHERNET:
 		info("accepting Ethernet packets on iface: %s",
@@ -384,8 +1328,53 @@ int main(int argc, char **argv)
 		break;
 	}
 
-	s = open_socket(&comm);
+	if (comm.ctrl.port)
+		info("accepting control connections on TCP port %u",
+						comm.ctrl.port);
+
+	if (loop.enabled)
+		info("loop detection is enabled");
+
+	if (shm_name) {
+		live = nettest_live_create(shm_name, NETTEST_FLOWS_MAX);
+		err_if_exit(!live, EXIT_FAILURE,
+			"cannot create shared memory object %s: %m", shm_name);
+		info("publishing live statistics into %s", shm_name);
+	}
+
+	/* Print the final statistics on termination */
+	act.sa_handler = sig_handler;
+	sigemptyset(&act.sa_mask);
+	act.sa_flags = 0;
+	sigaction(SIGINT, &act, NULL);
+	sigaction(SIGTERM, &act, NULL);
+
+	s = comm.tr->open(&comm, true);
+	/* The arrival times, for the delays and the ACK residence */
+	if (!(comm.tr->caps & NETTEST_CAP_STREAM)) {
+		ret = setsockopt(s, SOL_SOCKET, SO_TIMESTAMPNS, &on,
+					sizeof(on));
+		warn_if(ret < 0, "cannot enable receive timestamps: %m");
+	}
+	/* The Ethernet interface is already known, the others at START */
+	nettest_setup_numa(&comm, &arena);
+	/* Before the low-latency setup, which must not apply to its thread */
+	if (async_log) {
+		ret = nettest_log_start();
+		err_if_exit(ret < 0, EXIT_FAILURE,
+				"cannot start the logging thread: %m");
+	}
+	nettest_setup_arena(&comm, &arena, ARENA_BUFS,
+				sizeof(struct data_packet_s));
+	nettest_setup_ifmon(&comm);
+	nettest_setup_lowlat(s, &comm);
 	mainloop(s, &comm);
 
+	if (live)
+		nettest_live_destroy(live, shm_name);
+	comm.tr->close(s);
+	nettest_ifmon_close(&comm.ifmon);
+	nettest_arena_destroy(&arena);
+
 	return 0;
 }
@@ -0,0 +1,207 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "numa.h"
+
+#define NUMA_SYSFS_NODE		"/sys/devices/system/node"
+#define NUMA_SYSFS_CPU		"/sys/devices/system/cpu"
+#define NUMA_MASK_LONGS		(NETTEST_NUMA_NODES_MAX / (8 * sizeof(long)))
+
+/* Read the first line of a sysfs file into buf */
+static int numa_read(const char *path, char *buf, size_t len)
+{
+	FILE *f;
+	char *p;
+
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	p = fgets(buf, len, f);
+	fclose(f);
+	if (!p) {
+		errno = ENODATA;
+		return -1;
+	}
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return 0;
+}
+
+/*
+ * Call fn for each number of a list like "0-3,8-11" and return the
+ * highest one, or -1 on a bad list
+ */
+static int numa_parse_list(const char *str, void (*fn)(int n, void *arg),
+			void *arg)
+{
+	long first, last, n;
+	int highest = -1;
+	char *end;
+
+	while (*str) {
+		first = strtol(str, &end, 10);
+		if (end == str || first < 0)
+			return -1;
+		last = first;
+		if (*end == '-') {
+			str = end + 1;
+			last = strtol(str, &end, 10);
+			if (end == str || last < first)
+				return -1;
+		}
+		if (*end && *end != ',')
+			return -1;
+		for (n = first; fn && n <= last; n++)
+			fn(n, arg);
+		highest = last;
+		str = *end ? end + 1 : end;
+	}
+
+	return highest;
+}
+
+static void numa_set_cpu(int n, void *arg)
+{
+	if (n < CPU_SETSIZE)
+		CPU_SET(n, (cpu_set_t *) arg);
+}
+
+/* Return the number of possible nodes, 1 without NUMA support */
+int nettest_numa_nodes(void)
+{
+	char buf[256];
+	int ret;
+
+	if (numa_read(NUMA_SYSFS_NODE "/possible", buf, sizeof(buf)) < 0)
+		return 1;
+	ret = numa_parse_list(buf, NULL, NULL);
+
+	return ret < 0 ? 1 : ret + 1;
+}
+
+/* Return 1 if the CPU is online, 0 if not or if it cannot be told */
+int nettest_cpu_online(int cpu)
+{
+	char buf[4096];
+	cpu_set_t set;
+
+	if (cpu < 0 || cpu >= CPU_SETSIZE)
+		return 0;
+	if (numa_read(NUMA_SYSFS_CPU "/online", buf, sizeof(buf)) < 0)
+		return cpu < sysconf(_SC_NPROCESSORS_ONLN);
+
+	CPU_ZERO(&set);
+	if (numa_parse_list(buf, numa_set_cpu, &set) < 0)
+		return 0;
+
+	return CPU_ISSET(cpu, &set) ? 1 : 0;
+}
+
+/* Return the node the NIC of an interface is attached to, -1 if none */
+int nettest_numa_node_of(const char *if_name)
+{
+	char path[PATH_MAX], buf[32];
+	int node;
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s/device/numa_node",
+			if_name);
+	if (numa_read(path, buf, sizeof(buf)) < 0)
+		return -1;
+	node = strtol(buf, NULL, 10);
+
+	return node < NETTEST_NUMA_NODES_MAX ? node : -1;
+}
+
+/* Fill set with the CPUs of the node */
+int nettest_numa_cpus(int node, cpu_set_t *set)
+{
+	char path[PATH_MAX], buf[4096];
+
+	snprintf(path, sizeof(path), NUMA_SYSFS_NODE "/node%d/cpulist", node);
+	if (numa_read(path, buf, sizeof(buf)) < 0)
+		return -1;
+
+	CPU_ZERO(set);
+	if (numa_parse_list(buf, numa_set_cpu, set) < 0 || !CPU_COUNT(set)) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Run all the threads of the process on the CPUs of set, return how many
+ * they are
+ */
+int nettest_numa_run_on(const cpu_set_t *set)
+{
+	struct dirent *d;
+	int n = 0, ret = 0;
+	DIR *dir;
+
+	dir = opendir("/proc/self/task");
+	if (!dir)
+		return -1;
+	while (ret == 0 && (d = readdir(dir))) {
+		if (d->d_name[0] == '.')
+			continue;
+		ret = sched_setaffinity(atoi(d->d_name), sizeof(*set), set);
+		n++;
+	}
+	closedir(dir);
+
+	return ret < 0 ? -1 : n;
+}
+
+/* Allocate the memory of the calling thread on the node, if possible */
+int nettest_numa_prefer(int node)
+{
+	unsigned long mask[NUMA_MASK_LONGS] = { };
+
+	mask[node / (8 * sizeof(long))] = 1UL << node % (8 * sizeof(long));
+
+	/* The kernel wants one bit more than the mask has */
+	return syscall(SYS_set_mempolicy, MPOL_PREFERRED, mask,
+			NETTEST_NUMA_NODES_MAX + 1);
+}
+
+/* Move the pages of a memory area, already touched, to the node */
+int nettest_numa_move(void *addr, size_t len, int node)
+{
+	unsigned long mask[NUMA_MASK_LONGS] = { };
+	uintptr_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t) addr & ~(page - 1);
+	uintptr_t end = ((uintptr_t) addr + len + page - 1) & ~(page - 1);
+
+	mask[node / (8 * sizeof(long))] = 1UL << node % (8 * sizeof(long));
+
+	return syscall(SYS_mbind, start, end - start, MPOL_PREFERRED, mask,
+			NETTEST_NUMA_NODES_MAX + 1, MPOL_MF_MOVE);
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _NUMA_H
+#define _NUMA_H
+
+#include <sched.h>
+#include <stddef.h>
+
+/*
+ * NUMA placement
+ *
+ * On multi-socket hosts the hot loop and its packet buffers should run on
+ * the node the NIC is attached to, so that neither the descriptors nor the
+ * packets cross the interconnect. The node of an interface is read from
+ * sysfs (virtual interfaces have none), and the placement is done with
+ * the bare syscalls, no libnuma needed.
+ */
+
+#define NETTEST_NUMA_AUTO	-1	/* the node of the interface in use */
+#define NETTEST_NUMA_OFF	-2	/* no placement at all */
+#define NETTEST_NUMA_NODES_MAX	1024
+
+extern int nettest_numa_nodes(void);
+extern int nettest_numa_node_of(const char *if_name);
+extern int nettest_numa_cpus(int node, cpu_set_t *set);
+extern int nettest_numa_run_on(const cpu_set_t *set);
+extern int nettest_numa_prefer(int node);
+extern int nettest_numa_move(void *addr, size_t len, int node);
+extern int nettest_cpu_online(int cpu);
+
+#endif /* _NUMA_H */
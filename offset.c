@@ -0,0 +1,107 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "misc.h"
+#include "offset.h"
+
+void nettest_offset_init(struct nettest_offset_s *o)
+{
+	memset(o, 0, sizeof(*o));
+}
+
+/*
+ * Least squares fit of the best samples of the last periods, the drift is
+ * not estimated until there are enough of them. The error bound covers
+ * the half delay and the distance from the line of every sample.
+ */
+static void offset_fit(struct nettest_offset_s *o)
+{
+	const struct nettest_offset_sample_s *p;
+	double t_avg = 0, o_avg = 0, stt = 0, sto = 0, res;
+	unsigned int i, n = o->periods_num;
+
+	for (i = 0; i < n; i++) {
+		p = &o->period[i];
+		t_avg += p->t;
+		o_avg += p->offset;
+	}
+	t_avg /= n;
+	o_avg /= n;
+
+	for (i = 0; i < n; i++) {
+		p = &o->period[i];
+		stt += (p->t - t_avg) * (p->t - t_avg);
+		sto += (p->t - t_avg) * (p->offset - o_avg);
+	}
+	o->drift = n >= NETTEST_OFFSET_PERIODS_MIN && stt > 0 ? sto / stt : 0;
+	o->offset = o_avg - o->drift * t_avg;
+
+	o->bound = 0;
+	for (i = 0; i < n; i++) {
+		p = &o->period[i];
+		res = fabs(p->offset - (o->offset + o->drift * p->t));
+		o->bound = max(o->bound, p->delay / 2 + (int64_t) res);
+	}
+}
+
+/*
+ * Add the timestamps of an exchange and update the estimate, return false
+ * if they are not consistent (i.e. the delay is negative).
+ */
+bool nettest_offset_add(struct nettest_offset_s *o, uint64_t t1,
+			uint64_t t2, uint64_t t3, uint64_t t4)
+{
+	struct nettest_offset_sample_s s;
+
+	s.delay = (int64_t) (t4 - t1) - (int64_t) (t3 - t2);
+	if (s.delay < 0 || t4 < t1)
+		return false;
+	s.offset = ((int64_t) (t2 - t1) + (int64_t) (t3 - t4)) / 2;
+
+	if (o->samples++ == 0) {
+		o->t_base = t1;
+		s.t = 0;
+		o->best = s;
+		o->period[0] = s;
+		o->periods_num = 1;
+		offset_fit(o);
+
+		return true;
+	}
+	s.t = t1 + (t4 - t1) / 2 - o->t_base;
+
+	/* A new period starts: its best sample replaces the oldest one */
+	if (s.t - o->period_t >= (int64_t) NETTEST_OFFSET_PERIOD_NS) {
+		o->period_pos = (o->period_pos + 1) % NETTEST_OFFSET_PERIODS;
+		o->periods_num = min(o->periods_num + 1,
+					(unsigned int) NETTEST_OFFSET_PERIODS);
+		o->period_t = s.t;
+		o->best = s;
+	} else if (s.delay < o->best.delay)
+		o->best = s;
+	else
+		return true;
+
+	o->period[o->period_pos] = o->best;
+	offset_fit(o);
+
+	return true;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _OFFSET_H
+#define _OFFSET_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Clock offset estimation
+ *
+ * Each ACK gives the four NTP timestamps of an exchange: t1 the client
+ * sent the packet, t2 the server received it, t3 the server sent the ACK
+ * and t4 the client received it (each one by its own CLOCK_REALTIME).
+ * The offset of the server clock is ((t2 - t1) + (t3 - t4)) / 2, wrong
+ * at most by half the round trip delay (t4 - t1) - (t3 - t2), so only
+ * the exchange with the lowest delay of every NETTEST_OFFSET_PERIOD_NS
+ * is kept. The offset and the drift (the frequency error of the server
+ * clock) are the line fitting the last NETTEST_OFFSET_PERIODS of them.
+ */
+
+#define NETTEST_OFFSET_PERIOD_NS	((uint64_t) 1000000000)
+#define NETTEST_OFFSET_PERIODS		16
+#define NETTEST_OFFSET_PERIODS_MIN	4	/* to estimate the drift */
+
+struct nettest_offset_sample_s {
+	int64_t t;			/* client time from the first sample */
+	int64_t offset;
+	int64_t delay;
+};
+
+struct nettest_offset_s {
+	uint64_t samples;
+	uint64_t t_base;		/* client time of the first sample */
+
+	int64_t period_t;		/* start of the current period */
+	struct nettest_offset_sample_s best;	/* of the current period */
+	struct nettest_offset_sample_s period[NETTEST_OFFSET_PERIODS];
+	unsigned int periods_num, period_pos;
+
+	/* offset(t) = offset + drift * (t - t_base) */
+	double offset, drift;
+	int64_t bound;			/* max error of the offset */
+};
+
+extern void nettest_offset_init(struct nettest_offset_s *o);
+extern bool nettest_offset_add(struct nettest_offset_s *o, uint64_t t1,
+			uint64_t t2, uint64_t t3, uint64_t t4);
+
+static inline bool nettest_offset_valid(const struct nettest_offset_s *o)
+{
+	return o->samples > 0;
+}
+
+/* Offset of the server clock at the client time t */
+static inline int64_t nettest_offset_get(const struct nettest_offset_s *o,
+			uint64_t t)
+{
+	return o->offset + o->drift * (int64_t) (t - o->t_base);
+}
+
+#endif /* _OFFSET_H */
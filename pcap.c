@@ -0,0 +1,363 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <byteswap.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "misc.h"
+#include "stats.h"
+#include "pcap.h"
+
+#define PCAP_MAGIC_US		0xa1b2c3d4
+#define PCAP_MAGIC_NS		0xa1b23c4d
+#define PCAP_MAGIC_US_SWAPPED	0xd4c3b2a1
+#define PCAP_MAGIC_NS_SWAPPED	0x4d3cb2a1
+
+#define PCAPNG_BLOCK_SHB	0x0a0d0d0a
+#define PCAPNG_BLOCK_IDB	0x00000001
+#define PCAPNG_BLOCK_EPB	0x00000006
+#define PCAPNG_BOM		0x1a2b3c4d
+#define PCAPNG_BOM_SWAPPED	0x4d3c2b1a
+#define PCAPNG_OPT_END		0
+#define PCAPNG_OPT_TSRESOL	9
+
+struct pcap_file_header_s {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+} __packed;
+
+struct pcap_rec_header_s {
+	uint32_t ts_sec;
+	uint32_t ts_frac;		/* us or ns */
+	uint32_t caplen;
+	uint32_t len;
+} __packed;
+
+struct pcapng_block_s {
+	uint32_t type;
+	uint32_t len;			/* of the whole block */
+	uint8_t body[];
+} __packed;
+
+struct pcapng_idb_s {
+	uint16_t linktype;
+	uint16_t reserved;
+	uint32_t snaplen;
+	uint8_t options[];
+} __packed;
+
+struct pcapng_epb_s {
+	uint32_t iface;
+	uint32_t ts_high;
+	uint32_t ts_low;
+	uint32_t caplen;
+	uint32_t len;
+	uint8_t data[];
+} __packed;
+
+static inline uint16_t get16(const struct nettest_pcap_s *p, uint16_t v)
+{
+	return p->swapped ? bswap_16(v) : v;
+}
+
+static inline uint32_t get32(const struct nettest_pcap_s *p, uint32_t v)
+{
+	return p->swapped ? bswap_32(v) : v;
+}
+
+/* Get the link header length minus the Ethernet one, false if unsupported */
+static bool link_len(uint32_t linktype, int *len)
+{
+	switch (linktype) {
+	case NETTEST_PCAP_LINKTYPE_ETHERNET:
+		*len = 0;
+		return true;
+	case NETTEST_PCAP_LINKTYPE_RAW:
+		*len = -14;
+		return true;
+	case NETTEST_PCAP_LINKTYPE_LINUX_SLL:
+		*len = 16 - 14;
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Move to the next record, releasing the pages behind us */
+static void pcap_advance(struct nettest_pcap_s *p, size_t n)
+{
+	size_t chunk;
+
+	p->off += n;
+	if (p->off - p->released < NETTEST_PCAP_CHUNK)
+		return;
+
+	chunk = (p->off - p->released) & ~((size_t) getpagesize() - 1);
+	madvise((void *) (p->base + p->released), chunk, MADV_DONTNEED);
+	p->released += chunk;
+	madvise((void *) (p->base + p->released),
+			min(p->size - p->released,
+			    (size_t) 2 * NETTEST_PCAP_CHUNK),
+			MADV_WILLNEED);
+}
+
+int nettest_pcap_open(struct nettest_pcap_s *p, const char *path)
+{
+	const struct pcap_file_header_s *h;
+	struct nettest_pcap_iface_s *iface = &p->iface[0];
+	struct stat sb;
+	void *base;
+	int fd, ret;
+
+	memset(p, 0, sizeof(*p));
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	ret = fstat(fd, &sb);
+	if (ret < 0) {
+		close(fd);
+		return -1;
+	}
+	if (sb.st_size < sizeof(*h)) {
+		close(fd);
+		errno = EINVAL;
+		return -1;
+	}
+
+	base = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED)
+		return -1;
+	madvise(base, sb.st_size, MADV_SEQUENTIAL);
+	p->base = base;
+	p->size = sb.st_size;
+
+	h = (const struct pcap_file_header_s *) p->base;
+	switch (h->magic) {
+	case PCAPNG_BLOCK_SHB:
+		/* Sections and interfaces are read along with the records */
+		p->ng = true;
+		return 0;
+	case PCAP_MAGIC_US:
+	case PCAP_MAGIC_NS:
+		break;
+	case PCAP_MAGIC_US_SWAPPED:
+	case PCAP_MAGIC_NS_SWAPPED:
+		p->swapped = true;
+		break;
+	default:
+		nettest_pcap_close(p);
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+
+	/* A classic pcap file is like a single interface */
+	iface->linktype = get32(p, h->linktype);
+	iface->ts_units = get32(p, h->magic) == PCAP_MAGIC_NS ?
+					NSEC_PER_SEC : 1000000;
+	if (!link_len(iface->linktype, &iface->link_len)) {
+		nettest_pcap_close(p);
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+	p->ifaces_num = 1;
+	p->off = sizeof(*h);
+
+	return 0;
+}
+
+static int pcap_next(struct nettest_pcap_s *p, struct nettest_pcap_rec_s *rec)
+{
+	const struct pcap_rec_header_s *h;
+	const struct nettest_pcap_iface_s *iface = &p->iface[0];
+
+	if (p->off == p->size)
+		return 0;
+	if (p->size - p->off < sizeof(*h))
+		return -1;
+
+	h = (const struct pcap_rec_header_s *) (p->base + p->off);
+	rec->ts_ns = get32(p, h->ts_sec) * NSEC_PER_SEC +
+			(uint64_t) get32(p, h->ts_frac) *
+					(NSEC_PER_SEC / iface->ts_units);
+	rec->caplen = get32(p, h->caplen);
+	rec->len = get32(p, h->len);
+	rec->data = (const uint8_t *) (h + 1);
+	rec->linktype = iface->linktype;
+	rec->link_len = iface->link_len;
+	if (p->size - p->off - sizeof(*h) < rec->caplen)
+		return -1;
+	pcap_advance(p, sizeof(*h) + rec->caplen);
+
+	return 1;
+}
+
+/* Parse a section header block, return false if it isn't valid */
+static bool pcapng_shb(struct nettest_pcap_s *p, const uint8_t *body)
+{
+	uint32_t bom = *(const uint32_t *) body;
+
+	if (bom != PCAPNG_BOM && bom != PCAPNG_BOM_SWAPPED)
+		return false;
+	p->swapped = bom == PCAPNG_BOM_SWAPPED;
+	p->ifaces_num = 0;
+
+	return true;
+}
+
+/*
+ * Parse an interface description block, body_len bytes long, return false
+ * if its timestamps resolution can't be represented.
+ */
+static bool pcapng_idb(struct nettest_pcap_s *p, const uint8_t *body,
+			size_t body_len)
+{
+	const struct pcapng_idb_s *idb = (const struct pcapng_idb_s *) body;
+	struct nettest_pcap_iface_s *iface;
+	const uint8_t *opt, *end = body + body_len;
+	uint16_t code, len;
+	uint8_t resol;
+
+	if (p->ifaces_num == NETTEST_PCAP_IFACES_MAX ||
+	    body_len < sizeof(*idb))
+		return true;
+	iface = &p->iface[p->ifaces_num++];
+	iface->linktype = get16(p, idb->linktype);
+	if (!link_len(iface->linktype, &iface->link_len))
+		iface->linktype = UINT32_MAX;
+	iface->ts_units = 1000000;
+
+	/* Look for the timestamps resolution */
+	for (opt = idb->options; opt + 4 <= end; opt += 4 + ((len + 3) & ~3)) {
+		code = get16(p, *(const uint16_t *) opt);
+		len = get16(p, *(const uint16_t *) (opt + 2));
+		if (code == PCAPNG_OPT_END || opt + 4 + len > end)
+			break;
+		if (code != PCAPNG_OPT_TSRESOL || len != 1)
+			continue;
+
+		/* Negative power of 10, or of 2 if the MSB is set */
+		resol = opt[4];
+		if (resol & 0x80)
+			iface->ts_units = 1ULL << min(resol & 0x7f, 63);
+		else if (resol <= 19)	/* 10^19 is the largest in 64 bits */
+			for (iface->ts_units = 1; resol; resol--)
+				iface->ts_units *= 10;
+		else
+			return false;
+	}
+
+	return true;
+}
+
+static int pcapng_next(struct nettest_pcap_s *p,
+			struct nettest_pcap_rec_s *rec)
+{
+	const struct pcapng_block_s *b;
+	const struct pcapng_epb_s *epb;
+	const struct nettest_pcap_iface_s *iface;
+	uint64_t ts;
+	size_t len;
+
+	while (p->off < p->size) {
+		if (p->size - p->off < sizeof(*b) + sizeof(uint32_t))
+			return -1;
+		b = (const struct pcapng_block_s *) (p->base + p->off);
+
+		/* The section header tells the endianness of the section */
+		if (b->type == PCAPNG_BLOCK_SHB && !pcapng_shb(p, b->body))
+			return -1;
+		len = get32(p, b->len);
+		if (len < sizeof(*b) + sizeof(uint32_t) || len % 4 ||
+		    len > p->size - p->off)
+			return -1;
+		len -= sizeof(*b) + sizeof(uint32_t);
+
+		switch (get32(p, b->type)) {
+		case PCAPNG_BLOCK_IDB:
+			if (!pcapng_idb(p, b->body, len))
+				return -1;
+			break;
+
+		case PCAPNG_BLOCK_EPB:
+			epb = (const struct pcapng_epb_s *) b->body;
+			if (len < sizeof(*epb) ||
+			    get32(p, epb->caplen) > len - sizeof(*epb))
+				return -1;
+			if (get32(p, epb->iface) >= p->ifaces_num ||
+			    p->iface[get32(p, epb->iface)].linktype ==
+								UINT32_MAX) {
+				p->skipped++;
+				break;
+			}
+			iface = &p->iface[get32(p, epb->iface)];
+
+			ts = (uint64_t) get32(p, epb->ts_high) << 32 |
+						get32(p, epb->ts_low);
+			rec->ts_ns = ts / iface->ts_units * NSEC_PER_SEC +
+				(unsigned __int128) (ts % iface->ts_units) *
+					NSEC_PER_SEC / iface->ts_units;
+			rec->caplen = get32(p, epb->caplen);
+			rec->len = get32(p, epb->len);
+			rec->data = epb->data;
+			rec->linktype = iface->linktype;
+			rec->link_len = iface->link_len;
+			pcap_advance(p, get32(p, b->len));
+
+			return 1;
+
+		default:
+			/* Simple packet blocks have no timestamps */
+			break;
+		}
+		pcap_advance(p, get32(p, b->len));
+	}
+
+	return 0;
+}
+
+/*
+ * Get the next record, return 1 on success, 0 at the end of the file and
+ * -1 if the file is truncated or corrupted
+ */
+int nettest_pcap_next(struct nettest_pcap_s *p, struct nettest_pcap_rec_s *rec)
+{
+	return p->ng ? pcapng_next(p, rec) : pcap_next(p, rec);
+}
+
+void nettest_pcap_rewind(struct nettest_pcap_s *p)
+{
+	p->off = p->ng ? 0 : sizeof(struct pcap_file_header_s);
+	p->released = 0;
+}
+
+void nettest_pcap_close(struct nettest_pcap_s *p)
+{
+	munmap((void *) p->base, p->size);
+	p->base = NULL;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _PCAP_H
+#define _PCAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Capture files reader
+ *
+ * pcap and pcapng files are mapped into memory and walked one record at
+ * a time without copying them. Captures can be much larger than the
+ * memory, so the pages already walked are released from time to time and
+ * the following ones are read ahead.
+ *
+ * Only records of the link types below, which can be looked at as
+ * Ethernet frames, are returned, the others are skipped.
+ */
+
+#define NETTEST_PCAP_LINKTYPE_ETHERNET	1
+#define NETTEST_PCAP_LINKTYPE_RAW	101	/* IPv4 or IPv6 */
+#define NETTEST_PCAP_LINKTYPE_LINUX_SLL	113
+#define NETTEST_PCAP_CHUNK		(32 << 20)	/* release/read ahead */
+#define NETTEST_PCAP_IFACES_MAX		64	/* per pcapng section */
+
+struct nettest_pcap_iface_s {
+	uint32_t linktype;
+	int link_len;			/* link header length minus Ethernet's */
+	uint64_t ts_units;		/* timestamp units per second */
+};
+
+struct nettest_pcap_s {
+	const uint8_t *base;		/* the mapped file */
+	size_t size;
+	size_t off;			/* next record */
+	size_t released;		/* pages before this are released */
+	bool ng;			/* pcapng format */
+	bool swapped;			/* written with the other endianness */
+	struct nettest_pcap_iface_s iface[NETTEST_PCAP_IFACES_MAX];
+	unsigned int ifaces_num;
+	uint64_t skipped;		/* records of unsupported link types */
+};
+
+struct nettest_pcap_rec_s {
+	uint64_t ts_ns;
+	uint32_t caplen;		/* bytes into the file */
+	uint32_t len;			/* bytes on the wire */
+	const uint8_t *data;
+	uint32_t linktype;
+	int link_len;
+};
+
+extern int nettest_pcap_open(struct nettest_pcap_s *p, const char *path);
+extern int nettest_pcap_next(struct nettest_pcap_s *p,
+			struct nettest_pcap_rec_s *rec);
+extern void nettest_pcap_rewind(struct nettest_pcap_s *p);
+extern void nettest_pcap_close(struct nettest_pcap_s *p);
+
+/* Return the length the frame of rec would have as an Ethernet frame */
+static inline uint32_t nettest_pcap_eth_len(
+			const struct nettest_pcap_rec_s *rec)
+{
+	return rec->len - rec->link_len;
+}
+
+/*
+ * Return how many bytes of the frame of rec, seen as an Ethernet frame,
+ * have been captured starting from offset off and point data to them
+ */
+static inline uint32_t nettest_pcap_eth_data(
+			const struct nettest_pcap_rec_s *rec, uint32_t off,
+			const uint8_t **data)
+{
+	int64_t i = (int64_t) off + rec->link_len;
+
+	if (i < 0 || i >= rec->caplen)
+		return 0;
+	*data = rec->data + i;
+
+	return rec->caplen - i;
+}
+
+#endif /* _PCAP_H */
@@ -0,0 +1,186 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _PROF_H
+#define _PROF_H
+
+/*
+ * Hot path self-instrumentation
+ *
+ * Enabled by building with PROFILE=y (which defines NETTEST_PROFILE),
+ * otherwise all the macros below compile to nothing.
+ */
+
+enum prof_stage_e {
+	PROF_RECV,		/* recv_data() */
+	PROF_SEND,		/* send_data() */
+	PROF_ANALYSIS,		/* sequence checks and statistics */
+	PROF_PROMPT,		/* printf()/fflush() spinner and messages */
+	PROF_PACING,		/* waiting for the next packet to send */
+	PROF_STAGES_NUM
+};
+
+#ifdef NETTEST_PROFILE
+
+#include "misc.h"
+#include "stats.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROF_CLOCK		"TSC"
+static inline uint64_t prof_ticks(void)
+{
+	return __rdtsc();
+}
+#else
+#define PROF_CLOCK		"ns"
+static inline uint64_t prof_ticks(void)
+{
+	return nettest_now_ns();
+}
+#endif
+
+struct prof_stage_s {
+	uint64_t calls;
+	uint64_t ticks;
+	uint64_t syscalls;
+	uint64_t bytes;
+};
+
+struct prof_s {
+	uint64_t packets;
+	struct prof_stage_s stage[PROF_STAGES_NUM];
+};
+
+static const char *prof_stage_name[PROF_STAGES_NUM] = {
+	[PROF_RECV]	= "recv",
+	[PROF_SEND]	= "send",
+	[PROF_ANALYSIS]	= "analysis",
+	[PROF_PROMPT]	= "prompt",
+	[PROF_PACING]	= "pacing",
+};
+
+static struct prof_s __prof, __prof_total;
+static uint64_t __prof_t[PROF_STAGES_NUM];
+static uint64_t __prof_ticks0, __prof_ns0;
+
+#define prof_start(s)							\
+		do {							\
+			__prof_t[s] = prof_ticks();			\
+		} while (0)
+#define prof_end(s)							\
+		do {							\
+			__prof.stage[s].calls++;			\
+			__prof.stage[s].ticks +=			\
+					prof_ticks() - __prof_t[s];	\
+		} while (0)
+#define prof_syscall(s, n)						\
+		do {							\
+			__prof.stage[s].syscalls++;			\
+			if ((n) > 0)					\
+				__prof.stage[s].bytes += (n);		\
+		} while (0)
+#define prof_packet()							\
+		do {							\
+			__prof.packets++;				\
+		} while (0)
+
+static inline void prof_init(void)
+{
+	__prof_ticks0 = prof_ticks();
+	__prof_ns0 = nettest_now_ns();
+}
+
+static void prof_print(const char *title, struct prof_s *p)
+{
+	uint64_t packets = p->packets ? p->packets : 1;
+	uint64_t total = 0, syscalls = 0, bytes = 0;
+	double ns_per_tick;
+	int i;
+
+	/* Calibrate the ticks against CLOCK_MONOTONIC since prof_init() */
+	ns_per_tick = (double) (nettest_now_ns() - __prof_ns0) /
+			(prof_ticks() - __prof_ticks0);
+
+	for (i = 0; i < PROF_STAGES_NUM; i++) {
+		total += p->stage[i].ticks;
+		syscalls += p->stage[i].syscalls;
+		bytes += p->stage[i].bytes;
+	}
+	if (!total)
+		total = 1;
+
+	info("profile %s: %lu packets, %.2f syscalls and %.0f bytes "
+		"per packet", title, p->packets,
+		(double) syscalls / packets, (double) bytes / packets);
+	info("  %-10s %12s %12s %10s %12s %7s",
+		"stage", "calls", "syscalls", "ns/pkt",
+		PROF_CLOCK "/pkt", "%");
+	for (i = 0; i < PROF_STAGES_NUM; i++) {
+		if (!p->stage[i].calls)
+			continue;
+		info("  %-10s %12lu %12lu %10.1f %12.1f %6.1f%%",
+			prof_stage_name[i], p->stage[i].calls,
+			p->stage[i].syscalls,
+			p->stage[i].ticks * ns_per_tick / packets,
+			(double) p->stage[i].ticks / packets,
+			100. * p->stage[i].ticks / total);
+	}
+}
+
+static inline void prof_accumulate(void)
+{
+	int i;
+
+	__prof_total.packets += __prof.packets;
+	for (i = 0; i < PROF_STAGES_NUM; i++) {
+		__prof_total.stage[i].calls += __prof.stage[i].calls;
+		__prof_total.stage[i].ticks += __prof.stage[i].ticks;
+		__prof_total.stage[i].syscalls += __prof.stage[i].syscalls;
+		__prof_total.stage[i].bytes += __prof.stage[i].bytes;
+	}
+	memset(&__prof, 0, sizeof(__prof));
+}
+
+/* Print the interval breakdown and add it to the totals */
+static inline void prof_report(void)
+{
+	prof_print("interval", &__prof);
+	prof_accumulate();
+}
+
+/* Print the breakdown since the beginning */
+static inline void prof_report_total(void)
+{
+	prof_accumulate();
+	prof_print("total", &__prof_total);
+}
+
+#else  /* !NETTEST_PROFILE */
+
+#define prof_start(s)		do { } while (0)
+#define prof_end(s)		do { } while (0)
+#define prof_syscall(s, n)	do { } while (0)
+#define prof_packet()		do { } while (0)
+#define prof_init()		do { } while (0)
+#define prof_report()		do { } while (0)
+#define prof_report_total()	do { } while (0)
+
+#endif /* NETTEST_PROFILE */
+
+#endif /* _PROF_H */
@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdlib.h>
+#include <math.h>
+
+#include "misc.h"
+#include "schedule.h"
+
+static int sched_alloc(struct nettest_sched_s *s, unsigned int num)
+{
+	s->gap_ns = calloc(num, sizeof(*s->gap_ns));
+	if (!s->gap_ns)
+		return -1;
+	s->num = num;
+	s->burst = 0;
+	s->cycle_ns = 0;
+
+	return 0;
+}
+
+static inline uint64_t gap_from_pps(double pps)
+{
+	return min(1e9 / pps, 1e18);
+}
+
+int nettest_sched_periodic(struct nettest_sched_s *s, uint64_t period_ns)
+{
+	if (sched_alloc(s, 1) < 0)
+		return -1;
+	s->gap_ns[0] = period_ns;
+	s->cycle_ns = period_ns;
+
+	return 0;
+}
+
+/* Bursts of n packets back to back every period_ns */
+int nettest_sched_burst(struct nettest_sched_s *s, unsigned int n,
+			uint64_t period_ns)
+{
+	if (n == 0 || n > NETTEST_SCHED_MAX || sched_alloc(s, n) < 0)
+		return -1;
+	s->gap_ns[n - 1] = period_ns;
+	s->burst = n;
+	s->cycle_ns = period_ns;
+
+	return 0;
+}
+
+/*
+ * Poisson arrivals with the given mean rate, that is exponentially
+ * distributed gaps. The random generator is Marsaglia's xorshift.
+ */
+int nettest_sched_poisson(struct nettest_sched_s *s, double pps,
+			uint64_t seed)
+{
+	uint64_t x = seed ? seed : 88172645463325252ULL;
+	double u;
+	unsigned int i;
+
+	if (pps <= 0 || sched_alloc(s, NETTEST_SCHED_POISSON) < 0)
+		return -1;
+
+	for (i = 0; i < s->num; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		u = ((x >> 11) + 1) * (1.0 / ((1ULL << 53) + 1));
+		s->gap_ns[i] = gap_from_pps(pps / -log(u));
+		s->cycle_ns += s->gap_ns[i];
+	}
+
+	return 0;
+}
+
+/* Rate growing (or decreasing) linearly from from_pps to to_pps in secs */
+int nettest_sched_ramp(struct nettest_sched_s *s, double from_pps,
+			double to_pps, double secs)
+{
+	double t, pps, duration_ns = secs * 1e9;
+	unsigned int n;
+
+	if (from_pps <= 0 || to_pps <= 0 || secs <= 0)
+		return -1;
+
+	/* Count the packets first */
+	for (n = 0, t = 0; t < duration_ns && n < NETTEST_SCHED_MAX; n++) {
+		pps = from_pps + (to_pps - from_pps) * t / duration_ns;
+		t += gap_from_pps(pps);
+	}
+	if (sched_alloc(s, n) < 0)
+		return -1;
+
+	for (n = 0, t = 0; n < s->num; n++) {
+		pps = from_pps + (to_pps - from_pps) * t / duration_ns;
+		s->gap_ns[n] = gap_from_pps(pps);
+		t += s->gap_ns[n];
+	}
+	s->cycle_ns = t;
+
+	return 0;
+}
+
+void nettest_sched_free(struct nettest_sched_s *s)
+{
+	free(s->gap_ns);
+	s->gap_ns = NULL;
+	s->num = 0;
+}
@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _SCHEDULE_H
+#define _SCHEDULE_H
+
+#include <stdint.h>
+
+/*
+ * Transmission schedules
+ *
+ * A schedule is a precomputed array of inter-departure times which the
+ * client cycles through: after sending a packet the next deadline is
+ * moved forward by the next gap, so that the generator doesn't have to
+ * do any math into the hot loop and it stays accurate at high rates.
+ */
+
+#define NETTEST_SCHED_MAX	(16 << 20)	/* max gaps per schedule */
+#define NETTEST_SCHED_POISSON	65536		/* gaps of Poisson schedules */
+
+struct nettest_sched_s {
+	uint64_t *gap_ns;		/* wait after each packet */
+	unsigned int num;
+	unsigned int burst;		/* packets per burst, 0 if not bursty */
+	uint64_t cycle_ns;		/* duration of the whole schedule */
+};
+
+extern int nettest_sched_periodic(struct nettest_sched_s *s,
+			uint64_t period_ns);
+extern int nettest_sched_burst(struct nettest_sched_s *s, unsigned int n,
+			uint64_t period_ns);
+extern int nettest_sched_poisson(struct nettest_sched_s *s, double pps,
+			uint64_t seed);
+extern int nettest_sched_ramp(struct nettest_sched_s *s, double from_pps,
+			double to_pps, double secs);
+extern void nettest_sched_free(struct nettest_sched_s *s);
+
+/* Return the mean inter-departure time */
+static inline uint64_t nettest_sched_mean_ns(const struct nettest_sched_s *s)
+{
+	return s->cycle_ns / s->num;
+}
+
+/* Return the gap after the packet at *pos and move to the next one */
+static inline uint64_t nettest_sched_next(const struct nettest_sched_s *s,
+			unsigned int *pos)
+{
+	uint64_t gap = s->gap_ns[*pos];
+
+	if (++*pos == s->num)
+		*pos = 0;
+
+	return gap;
+}
+
+#endif /* _SCHEDULE_H */
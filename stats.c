@@ -0,0 +1,416 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "misc.h"
+#include "stats.h"
+
+/*
+ * Latency histogram
+ */
+
+uint64_t nettest_hist_value(unsigned int idx)
+{
+	int shift;
+
+	if (idx < NETTEST_HIST_SUB)
+		return idx;
+
+	shift = idx / NETTEST_HIST_SUB - 1;
+	return (uint64_t) (NETTEST_HIST_SUB + idx % NETTEST_HIST_SUB) << shift;
+}
+
+/* Return the value below which the given percent of samples fall */
+uint64_t nettest_hist_percentile(const struct nettest_hist_s *h,
+					double percent)
+{
+	uint64_t target, n;
+	unsigned int i;
+
+	if (h->count == 0)
+		return 0;
+
+	target = h->count * percent / 100.;
+	if (target >= h->count)
+		return h->max;
+
+	n = 0;
+	for (i = 0; i < NETTEST_HIST_SIZE; i++) {
+		n += h->slot[i];
+		if (n > target)
+			return min(max(nettest_hist_value(i), h->min), h->max);
+	}
+
+	return h->max;
+}
+
+/*
+ * Sequence analysis
+ */
+
+static inline bool seen_test(struct nettest_stats_s *st, uint32_t seq)
+{
+	seq %= NETTEST_SEQ_WINDOW;
+	return st->seen[seq / 64] & (1ULL << (seq % 64));
+}
+
+static inline void seen_set(struct nettest_stats_s *st, uint32_t seq)
+{
+	seq %= NETTEST_SEQ_WINDOW;
+	st->seen[seq / 64] |= 1ULL << (seq % 64);
+}
+
+static inline void seen_clear(struct nettest_stats_s *st, uint32_t seq)
+{
+	seq %= NETTEST_SEQ_WINDOW;
+	st->seen[seq / 64] &= ~(1ULL << (seq % 64));
+}
+
+void nettest_stats_reset(struct nettest_stats_s *st)
+{
+	memset(st, 0, sizeof(*st));
+}
+
+enum nettest_event_e nettest_stats_update(struct nettest_stats_s *st,
+			uint32_t seq, uint64_t ts_ns, size_t size,
+			uint32_t *missed)
+{
+	uint32_t d, i;
+	uint64_t ipt;
+
+	*missed = 0;
+
+	if (unlikely(st->received == 0)) {
+		st->received = 1;
+		st->bytes = size;
+		st->first_ns = st->last_ns = ts_ns;
+		st->first_seq = st->last_seq = seq;
+		seen_set(st, seq);
+
+		return NETTEST_EV_FIRST;
+	}
+
+	/* Update the inter packet time */
+	ipt = ts_ns - st->last_ns;
+	st->last_ns = ts_ns;
+	st->ipt_ns = ipt;
+	if (st->ipt_avg_ns)
+		st->ipt_avg_ns = (st->ipt_avg_ns + ipt) / 2;
+	else
+		st->ipt_avg_ns = ipt;
+	if (ipt > st->ipt_max_ns)
+		st->ipt_max_ns = ipt;
+
+	st->received++;
+	st->bytes += size;
+
+	/* Distance from the newest packet, wrap around safe */
+	d = seq - st->last_seq;
+	if (likely(d == 1)) {
+		seen_set(st, seq);
+		st->last_seq = seq;
+
+		return NETTEST_EV_IN_SEQ;
+	}
+
+	if (d == 0) {
+		st->dup++;
+
+		return NETTEST_EV_DUP;
+	}
+
+	if ((int32_t) d > 0) {
+		/* Forget the sequence numbers falling out of the window */
+		if (d >= NETTEST_SEQ_WINDOW)
+			memset(st->seen, 0, sizeof(st->seen));
+		else
+			for (i = 1; i < d; i++)
+				seen_clear(st, st->last_seq + i);
+		seen_set(st, seq);
+
+		*missed = d - 1;
+		st->lost += d - 1;
+		st->last_seq = seq;
+
+		st->outages++;
+		st->outage_total_ns += ipt;
+		if (ipt > st->outage_max_ns)
+			st->outage_max_ns = ipt;
+
+		return NETTEST_EV_GAP;
+	}
+
+	/*
+	 * An old packet: late arrival or duplicate? Packets older than the
+	 * stream start were never accounted as lost.
+	 */
+	if (st->last_seq - seq < NETTEST_SEQ_WINDOW) {
+		if (seen_test(st, seq)) {
+			st->dup++;
+
+			return NETTEST_EV_DUP;
+		}
+		seen_set(st, seq);
+		if ((int32_t) (seq - st->first_seq) > 0)
+			st->lost--;
+	}
+	st->reordered++;
+
+	return NETTEST_EV_REORDER;
+}
+
+/*
+ * Account the delay of a packet (not a duplicated one) sent at tx_ns and
+ * received at rx_ns, both CLOCK_REALTIME. The jitter is the smoothed
+ * difference of the transit times of consecutive packets as defined by
+ * RFC 3550 (section 6.4.1), computed in fixed point as its appendix A.8.
+ */
+void nettest_stats_delay(struct nettest_stats_s *st, uint64_t tx_ns,
+			uint64_t rx_ns)
+{
+	int64_t transit, d;
+
+	/* The sender doesn't set the timestamp */
+	if (tx_ns == 0)
+		return;
+
+	if (unlikely(st->delays == 0)) {
+		st->delays = 1;
+		st->transit_base = rx_ns - tx_ns;
+		st->transit_last = st->transit_min = st->transit_max = 0;
+		st->transit_sum = 0;
+		st->jitter_q4 = 0;
+
+		return;
+	}
+
+	transit = (int64_t) (rx_ns - tx_ns) - st->transit_base;
+	d = transit - st->transit_last;
+	if (d < 0)
+		d = -d;
+	st->jitter_q4 += d - (int64_t) ((st->jitter_q4 + 8) >> 4);
+	st->transit_last = transit;
+
+	if (transit < st->transit_min)
+		st->transit_min = transit;
+	if (transit > st->transit_max)
+		st->transit_max = transit;
+	st->transit_sum += transit;
+	st->delays++;
+}
+
+int nettest_stats_snprintf(char *buf, size_t len,
+			const struct nettest_stats_s *st)
+{
+	int n;
+
+	n = snprintf(buf, len, "received %lu packets "
+			"(%lu lost, %lu by local drops, %lu dup, %lu reordered, "
+			"avg ipt %luus)",
+			st->received, st->lost, st->lost_local,
+			st->dup, st->reordered,
+			st->ipt_avg_ns / NSEC_PER_USEC);
+	if (st->delays > 1 && n >= 0 && n < len)
+		n += snprintf(buf + n, len - n,
+			", jitter %.1fus, PDV avg/max %.1f/%.1fus",
+			nettest_stats_jitter_ns(st) / (double) NSEC_PER_USEC,
+			nettest_stats_pdv_avg_ns(st) / (double) NSEC_PER_USEC,
+			nettest_stats_pdv_max_ns(st) / (double) NSEC_PER_USEC);
+
+	return n;
+}
+
+/* Print what happened between the snapshot prev and now */
+int nettest_stats_snprintf_interval(char *buf, size_t len,
+			const struct nettest_stats_s *st,
+			const struct nettest_stats_s *prev, uint64_t elapsed_ns)
+{
+	uint64_t received = st->received - prev->received;
+	uint64_t delays = st->delays - prev->delays;
+	double secs = (double) elapsed_ns / NSEC_PER_SEC;
+	int64_t pdv = 0;
+	int n;
+
+	if (secs <= 0)
+		secs = 1;
+
+	/*
+	 * A late packet decrements the lost counter, so a packet filling a
+	 * gap of a previous interval makes the lost ones of this interval
+	 * negative.
+	 */
+	n = snprintf(buf, len, "received %lu packets (%.0f pps, %.3f Mbps, "
+			"%ld lost, %ld by local drops, %lu dup, %lu reordered, "
+			"avg ipt %luus)",
+			received, received / secs,
+			(st->bytes - prev->bytes) * 8 / secs / 1e6,
+			(int64_t) (st->lost - prev->lost),
+			(int64_t) (st->lost_local - prev->lost_local),
+			st->dup - prev->dup,
+			st->reordered - prev->reordered,
+			st->ipt_avg_ns / NSEC_PER_USEC);
+	if (delays && st->delays > 1 && n >= 0 && n < len) {
+		/* Average delay of the interval above the minimum so far */
+		pdv = (st->transit_sum - prev->transit_sum) / (int64_t) delays -
+				st->transit_min;
+		n += snprintf(buf + n, len - n, ", jitter %.1fus, PDV avg %.1fus",
+			nettest_stats_jitter_ns(st) / (double) NSEC_PER_USEC,
+			max(pdv, (int64_t) 0) / (double) NSEC_PER_USEC);
+	}
+
+	return n;
+}
+
+/*
+ * Flows table
+ */
+
+int nettest_flows_init(struct nettest_flows_s *f, unsigned int max)
+{
+	memset(f, 0, sizeof(*f));
+	f->st = calloc(max, sizeof(*f->st));
+	if (!f->st)
+		return -1;
+	f->max = max;
+	f->num = 1;
+
+	return 0;
+}
+
+/*
+ * Start a new test of num flows (clamped to the table size), drops is
+ * the current local drops counter.
+ */
+void nettest_flows_reset(struct nettest_flows_s *f, unsigned int num,
+			uint32_t drops)
+{
+	f->num = min(max(num, 1U), f->max);
+	memset(f->st, 0, f->num * sizeof(*f->st));
+	f->unknown = 0;
+	f->drops_seen = drops;
+	f->drops_pending = 0;
+}
+
+/*
+ * Given the counter of packets dropped so far by the local socket (as
+ * reported by SO_RXQ_OVFL or PACKET_STATISTICS), account how many of the
+ * packets missed by the last gap of the flow st have been dropped by us
+ * rather than by the network, and return that number.
+ */
+uint32_t nettest_flows_local_drops(struct nettest_flows_s *f,
+			struct nettest_stats_s *st,
+			uint32_t drops, uint32_t missed)
+{
+	uint32_t n;
+
+	f->drops_pending += drops - f->drops_seen;
+	f->drops_seen = drops;
+
+	n = min(missed, f->drops_pending);
+	f->drops_pending -= n;
+	st->lost_local += n;
+
+	return n;
+}
+
+/*
+ * Add up the counters of all the flows, the sequence state is left zeroed.
+ * Each flow has its own transit base, so the sum carries the delays over
+ * the minimum of each flow (transit_min is 0) and the worst jitter.
+ */
+void nettest_flows_sum(const struct nettest_flows_s *f,
+			struct nettest_stats_s *sum)
+{
+	const struct nettest_stats_s *st;
+	uint64_t ipt_sum = 0, n = 0;
+	unsigned int i;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < f->num; i++) {
+		st = &f->st[i];
+		sum->received += st->received;
+		sum->bytes += st->bytes;
+		sum->lost += st->lost;
+		sum->dup += st->dup;
+		sum->reordered += st->reordered;
+		sum->lost_local += st->lost_local;
+		sum->outages += st->outages;
+		sum->outage_total_ns += st->outage_total_ns;
+		sum->outage_max_ns = max(sum->outage_max_ns,
+					st->outage_max_ns);
+		sum->ipt_max_ns = max(sum->ipt_max_ns, st->ipt_max_ns);
+		sum->delays += st->delays;
+		sum->transit_sum += st->transit_sum -
+				(int64_t) st->delays * st->transit_min;
+		sum->transit_max = max(sum->transit_max,
+				st->transit_max - st->transit_min);
+		sum->jitter_q4 = max(sum->jitter_q4, st->jitter_q4);
+		if (st->received > 1) {
+			ipt_sum += st->ipt_avg_ns;
+			n++;
+		}
+	}
+	if (n)
+		sum->ipt_avg_ns = ipt_sum / n;
+}
+
+/*
+ * Loop detection
+ */
+
+/* Account a received packet and return how many copies of it arrived */
+unsigned int nettest_loop_update(struct nettest_loop_s *l,
+			unsigned int flow, uint32_t seq, uint64_t tx_ns,
+			uint64_t ts_ns)
+{
+	struct nettest_loop_slot_s *sl;
+
+	l->packets++;
+	sl = &l->slot[(seq ^ (flow * 0x9e3779b1U)) & (NETTEST_LOOP_WINDOW - 1)];
+	if (sl->seq != seq || sl->flow != flow || sl->tx_ns != tx_ns ||
+	    sl->copies == 0) {
+		sl->seq = seq;
+		sl->flow = flow;
+		sl->tx_ns = tx_ns;
+		sl->copies = 1;
+		sl->last_ns = ts_ns;
+
+		return 1;
+	}
+
+	if (sl->copies < UINT16_MAX)
+		sl->copies++;
+	l->dups++;
+	l->copies_max = max(l->copies_max, (unsigned int) sl->copies);
+	nettest_hist_add(&l->period, (ts_ns - sl->last_ns) / NSEC_PER_USEC);
+	sl->last_ns = ts_ns;
+
+	return sl->copies;
+}
+
+/* Start a new accounting interval, the window of packets is kept */
+void nettest_loop_clear(struct nettest_loop_s *l)
+{
+	l->packets = 0;
+	l->dups = 0;
+	l->copies_max = 0;
+	memset(&l->period, 0, sizeof(l->period));
+}
@@ -0,0 +1,261 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+/*
+ * Time helpers
+ */
+
+#define NSEC_PER_USEC		((uint64_t) 1000)
+#define NSEC_PER_MSEC		((uint64_t) 1000000)
+#define NSEC_PER_SEC		((uint64_t) 1000000000)
+
+static inline uint64_t timespec_to_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * NSEC_PER_SEC + ts->tv_nsec;
+}
+
+static inline uint64_t nettest_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return timespec_to_ns(&ts);
+}
+
+/* Wall clock time, the one to be compared among hosts */
+static inline uint64_t nettest_realtime_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return timespec_to_ns(&ts);
+}
+
+/*
+ * Latency histogram
+ *
+ * Values below NETTEST_HIST_SUB are counted exactly, then each power of
+ * two is split into NETTEST_HIST_SUB slots so that the relative error of
+ * a percentile is always below 1/NETTEST_HIST_SUB.
+ */
+
+#define NETTEST_HIST_SUB_BITS	5
+#define NETTEST_HIST_SUB	(1 << NETTEST_HIST_SUB_BITS)
+#define NETTEST_HIST_SIZE	((64 - NETTEST_HIST_SUB_BITS + 1) * \
+					NETTEST_HIST_SUB)
+struct nettest_hist_s {
+	uint64_t count;
+	uint64_t min, max;
+	uint64_t sum;
+	uint64_t slot[NETTEST_HIST_SIZE];
+};
+
+static inline unsigned int nettest_hist_index(uint64_t v)
+{
+	int shift;
+
+	if (v < NETTEST_HIST_SUB)
+		return v;
+
+	shift = 63 - __builtin_clzll(v) - NETTEST_HIST_SUB_BITS;
+	return (shift + 1) * NETTEST_HIST_SUB +
+			((v >> shift) & (NETTEST_HIST_SUB - 1));
+}
+
+static inline void nettest_hist_add(struct nettest_hist_s *h, uint64_t v)
+{
+	if (h->count == 0 || v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+	h->count++;
+	h->sum += v;
+	h->slot[nettest_hist_index(v)]++;
+}
+
+extern uint64_t nettest_hist_value(unsigned int idx);
+extern uint64_t nettest_hist_percentile(const struct nettest_hist_s *h,
+					double percent);
+
+/*
+ * Sequence analysis
+ *
+ * The receiver feeds every packet as a (seq, timestamp, size) tuple and
+ * gets back what the packet means for the stream. A bitmap of the last
+ * NETTEST_SEQ_WINDOW sequence numbers allows to tell a late packet
+ * (previously accounted as lost) from a duplicated one.
+ */
+
+#define NETTEST_SEQ_WINDOW	1024
+
+enum nettest_event_e {
+	NETTEST_EV_FIRST,	/* first packet of the stream */
+	NETTEST_EV_IN_SEQ,	/* the expected packet */
+	NETTEST_EV_GAP,		/* some packets are missing before this one */
+	NETTEST_EV_DUP,		/* packet already received */
+	NETTEST_EV_REORDER,	/* packet arrived later than a newer one */
+};
+
+struct nettest_stats_s {
+	uint64_t received;
+	uint64_t bytes;
+	uint64_t lost;
+	uint64_t dup;
+	uint64_t reordered;
+
+	uint64_t lost_local;		/* lost packets dropped by our socket */
+	uint64_t outages;		/* number of gaps */
+	uint64_t outage_max_ns;		/* longest time without packets */
+	uint64_t outage_total_ns;
+
+	uint32_t first_seq, last_seq;
+	uint64_t first_ns, last_ns;
+	uint64_t ipt_ns;		/* last inter packet time */
+	uint64_t ipt_avg_ns;		/* smoothed inter packet time */
+	uint64_t ipt_max_ns;
+
+	/*
+	 * Delay variation, from the sender timestamps. The transit times
+	 * are relative to the one of the first packet, so that the offset
+	 * between the clocks of the hosts cancels out.
+	 */
+	uint64_t delays;		/* packets with a sender timestamp */
+	int64_t transit_base;		/* transit time of the first one */
+	int64_t transit_last;
+	int64_t transit_min, transit_max;
+	int64_t transit_sum;
+	uint64_t jitter_q4;		/* RFC 3550 jitter, 4 bits fraction */
+
+	uint64_t seen[NETTEST_SEQ_WINDOW / 64];
+};
+
+extern void nettest_stats_reset(struct nettest_stats_s *st);
+extern enum nettest_event_e nettest_stats_update(struct nettest_stats_s *st,
+			uint32_t seq, uint64_t ts_ns, size_t size,
+			uint32_t *missed);
+extern void nettest_stats_delay(struct nettest_stats_s *st,
+			uint64_t tx_ns, uint64_t rx_ns);
+extern int nettest_stats_snprintf(char *buf, size_t len,
+			const struct nettest_stats_s *st);
+extern int nettest_stats_snprintf_interval(char *buf, size_t len,
+			const struct nettest_stats_s *st,
+			const struct nettest_stats_s *prev, uint64_t elapsed_ns);
+
+/* RFC 3550 interarrival jitter */
+static inline uint64_t nettest_stats_jitter_ns(const struct nettest_stats_s *st)
+{
+	return st->jitter_q4 >> 4;
+}
+
+/* Packet delay variation, relative to the minimum delay (ITU-T Y.1540) */
+static inline uint64_t nettest_stats_pdv_avg_ns(const struct nettest_stats_s *st)
+{
+	return st->delays ? st->transit_sum / (int64_t) st->delays -
+				st->transit_min : 0;
+}
+
+static inline uint64_t nettest_stats_pdv_max_ns(const struct nettest_stats_s *st)
+{
+	return st->transit_max - st->transit_min;
+}
+
+/*
+ * Flows table
+ *
+ * A test may be made of several independent streams (i.e. one per
+ * multicast group), each one with its own sequence numbers space, which
+ * are tracked by an array indexed by the flow number carried by the
+ * packets. The socket drops counter is shared by all the flows, so the
+ * local drops are attributed here.
+ */
+
+struct nettest_flows_s {
+	unsigned int num;		/* active flows */
+	unsigned int max;		/* allocated flows */
+	struct nettest_stats_s *st;
+	uint64_t unknown;		/* packets of flows out of the table */
+
+	uint32_t drops_seen;		/* last local drops counter seen */
+	uint32_t drops_pending;		/* local drops not yet attributed */
+};
+
+extern int nettest_flows_init(struct nettest_flows_s *f, unsigned int max);
+extern void nettest_flows_reset(struct nettest_flows_s *f, unsigned int num,
+			uint32_t drops);
+extern uint32_t nettest_flows_local_drops(struct nettest_flows_s *f,
+			struct nettest_stats_s *st,
+			uint32_t drops, uint32_t missed);
+extern void nettest_flows_sum(const struct nettest_flows_s *f,
+			struct nettest_stats_s *sum);
+
+/* Return the stats of the given flow or NULL if it is unknown */
+static inline struct nettest_stats_s *nettest_flows_get(
+			struct nettest_flows_s *f, unsigned int flow)
+{
+	if (flow >= f->num) {
+		f->unknown++;
+		return NULL;
+	}
+
+	return &f->st[flow];
+}
+
+/*
+ * Loop detection
+ *
+ * Into a network loop every packet is received again and again. The
+ * last NETTEST_LOOP_WINDOW packets are remembered, by flow, sequence
+ * number and transmission time (so a new test is never mistaken for a
+ * copy of the previous one), to count how many copies of each one
+ * arrived and how long they took to come back, that is the loop period.
+ * Counters are about the packets since the last nettest_loop_clear().
+ */
+
+#define NETTEST_LOOP_WINDOW	4096	/* must be a power of 2 */
+
+struct nettest_loop_slot_s {
+	uint64_t tx_ns;
+	uint64_t last_ns;		/* arrival of the last copy */
+	uint32_t seq;
+	uint16_t flow;
+	uint16_t copies;
+};
+
+struct nettest_loop_s {
+	uint64_t packets;
+	uint64_t dups;
+	unsigned int copies_max;	/* largest multiplicity seen */
+	struct nettest_hist_s period;	/* time between copies in us */
+
+	struct nettest_loop_slot_s slot[NETTEST_LOOP_WINDOW];
+};
+
+extern unsigned int nettest_loop_update(struct nettest_loop_s *l,
+			unsigned int flow, uint32_t seq, uint64_t tx_ns,
+			uint64_t ts_ns);
+extern void nettest_loop_clear(struct nettest_loop_s *l);
+
+#endif /* _STATS_H */
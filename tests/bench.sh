@@ -0,0 +1,265 @@
+#!/bin/bash
+
+# Source file for common definitions
+. misc.sh.inc
+
+#
+# Benchmark matrix (can be overridden from the environment)
+#
+
+PROTOS=${PROTOS:-"udp eth"}	# or vlan, Ethernet 802.1Q tagged
+SIZES=${SIZES:-"128 512 1400"}	# at least the header size
+PERIODS=${PERIODS:-"1 0"}		# period in ms, 0 means wire speed
+BACKENDS=${BACKENDS:-"default lowlat"}
+PACKETS=${PACKETS:-100000}
+ACK_PACKETS=${ACK_PACKETS:-10000}
+OUTPUT=${OUTPUT:-bench.csv}
+
+NS=nsbench
+VETH_SRV=vbench0
+VETH_CLI=vbench1
+ADDR_SRV=192.168.23.1
+ADDR_CLI=192.168.23.2
+
+CSV_HEADER="version,proto,size,period_ms,backend,sent,received,lost,loss_pct,duration_s,pps,client_cpu_pct,server_cpu_pct,rtt_min_us,rtt_p50_us,rtt_p90_us,rtt_p99_us,rtt_max_us"
+
+#
+# Local functions
+#
+
+# Return the extra options for a given I/O backend.
+# Usage: backend_args <backend> <server | client>
+function backend_args () {
+	case $1 in
+	default)
+		echo ""
+		;;
+	lowlat)
+		# Spinning needs a CPU for each side, otherwise the server
+		# starves the client (or viceversa) so keep it blocking
+		if [ $(nproc) -lt 2 ] ; then
+			[ $2 == "client" ] && echo "-L"
+		elif [ $2 == "server" ] ; then
+			echo "-L -c 1"
+		else
+			echo "-L -c 0"
+		fi
+		;;
+	*)
+		fatal "unknown backend $1"
+		;;
+	esac
+}
+
+# Return user + system CPU ticks of a running process
+function cpu_ticks () {
+	awk '{ print $14 + $15 }' /proc/$1/stat 2> /dev/null || echo 0
+}
+
+function topology_setup () {
+	debug "creating topology..."
+	R ip link add $VETH_SRV type veth peer name $VETH_CLI
+	R ip netns add $NS
+	R ip link set $VETH_SRV netns $NS
+	R ip netns exec $NS ip addr add $ADDR_SRV/24 dev $VETH_SRV
+	R ip netns exec $NS ip link set $VETH_SRV up
+	R ip netns exec $NS ip link set lo up
+	R ip addr add $ADDR_CLI/24 dev $VETH_CLI
+	R ip link set $VETH_CLI up
+	mac_srv=$(ip netns exec $NS ip link show $VETH_SRV | \
+			awk '/link\/ether/ { print $2 }')
+}
+
+function topology_destroy () {
+	debug "destroying topology..."
+	ip netns pids $NS 2> /dev/null | xargs -r kill
+	ip link del $VETH_CLI 2> /dev/null
+	ip netns delete $NS 2> /dev/null
+}
+
+# Run a single test and print a CSV line.
+# Usage: run_one <proto> <size> <period> <backend> <ack>
+function run_one () {
+	local proto=$1 size=$2 period=$3 backend=$4 ack=$5
+	local slog=$(mktemp) clog=$(mktemp)
+	local sargs cargs dest packets spid t0 t1 hz
+	local sent received lost real user sys rtt
+
+	sargs=$(backend_args $backend server)
+	cargs=$(backend_args $backend client)
+	if [ $proto == "eth" ] ; then
+		sargs="$sargs -i $VETH_SRV"
+		cargs="$cargs -i $VETH_CLI"
+		dest=$mac_srv
+	elif [ $proto == "vlan" ] ; then
+		sargs="$sargs -i $VETH_SRV"
+		cargs="$cargs -i $VETH_CLI -C 3:$period:100"
+		dest=$mac_srv
+	else
+		dest=$ADDR_SRV
+	fi
+	packets=$PACKETS
+	if [ $ack -eq 1 ] ; then
+		cargs="$cargs -a"
+		packets=$ACK_PACKETS
+	fi
+
+	ip netns exec $NS ../nettests $sargs > /dev/null 2> $slog &
+	spid=$!
+	sleep 0.5
+	t0=$(cpu_ticks $spid)
+
+	TIMEFORMAT="%R %U %S"
+	{ time ../nettestc $cargs -s $size -f $period -n $packets $dest \
+		> /dev/null 2> $clog ; } 2>> $clog
+
+	sleep 0.5
+	t1=$(cpu_ticks $spid)
+	kill -INT $spid ; wait $spid 2> /dev/null
+
+	hz=$(getconf CLK_TCK)
+	sent=$(awk '/transmitted/ { print $3 }' $clog)
+	sent=${sent:-0}
+	read real user sys <<< "$(tail -n 1 $clog)"
+	# The lost packets as told by the server, received counts the dups
+	read received lost <<< "$(sed -n 's/.*received \([0-9]*\) packets (\([0-9]*\) lost.*/\1 \2/p' $slog | tail -n 1)"
+	received=${received:-0}
+	lost=${lost:-0}
+	rtt=$(sed -n 's/.*RTT min\/p50\/p90\/p99\/max: \([0-9\/]*\)us/\1/p' $clog | tr '/' ',')
+	[ -z "$rtt" ] && rtt=",,,,"
+
+	[ $ack -eq 1 ] && backend="$backend-ack"
+	awk -v v=$VERSION -v p=$proto -v sz=$size -v f=$period -v b=$backend \
+	    -v s=$sent -v r=$received -v l=$lost -v rt=$real \
+	    -v u=$user -v sy=$sys -v st=$((t1 - t0)) -v hz=$hz \
+	    -v rtt=$rtt 'BEGIN {
+		if (s == 0 || rt == 0) { s = 1 ; rt = 1 }
+		printf "%s,%s,%s,%s,%s,%d,%d,%d,%.3f,%.3f,%.0f,%.1f,%.1f,%s\n",
+			v, p, sz, f, b, s, r, l, 100 * l / s, rt, s / rt,
+			100 * (u + sy) / rt, 100 * st / hz / rt, rtt
+	}'
+
+	rm -f $slog $clog
+}
+
+#
+# Commands
+#
+
+function do_run () {
+	local proto size period backend
+
+	debug "building programs..."
+	make -C .. > /dev/null || fatal "cannot build programs"
+	VERSION=$(../nettestc -v 2>&1 | awk '{ print $NF }')
+
+	topology_destroy
+	trap "topology_destroy" EXIT
+	topology_setup
+
+	[ -f $OUTPUT ] || echo $CSV_HEADER > $OUTPUT
+	for proto in $PROTOS ; do
+	for size in $SIZES ; do
+	for period in $PERIODS ; do
+	for backend in $BACKENDS ; do
+		info "running $proto size=$size period=${period}ms backend=$backend..."
+		run_one $proto $size $period $backend 0 | tee -a $OUTPUT
+		run_one $proto $size $period $backend 1 | tee -a $OUTPUT
+	done
+	done
+	done
+	done
+	info "results saved into $OUTPUT"
+}
+
+function do_compare () {
+	[ $# -lt 2 ] && usage
+	# Print pps and p99 RTT of the two versions side by side
+	awk -F, 'FNR == 1 { next }
+		{
+			key = $2 "," $3 "," $4 "," $5
+			if (FILENAME == ARGV[1]) { pps[key] = $11 ; p99[key] = $17 }
+			else if (key in pps)
+				printf "%-28s pps %10s -> %-10s (%+.1f%%)  p99 %6s -> %-6s\n",
+					key, pps[key], $11,
+					pps[key] ? 100 * ($11 - pps[key]) / pps[key] : 0,
+					p99[key], $17
+		}' $1 $2
+}
+
+#
+# Usage
+#
+
+function usage () {
+	echo "usage: $NAME [-h | --help] [-d | --debug] [-o <file>] <COMMAND>" >&2
+	echo "  where <COMMAND> can be:" >&2
+	echo "    run                 - run the benchmark matrix and append to CSV file" >&2
+	echo "    compare <old> <new> - compare two CSV files" >&2
+	echo "  the matrix can be tuned with environment variables PROTOS (udp, eth" >&2
+	echo "  or vlan), SIZES," >&2
+	echo "  PERIODS, BACKENDS, PACKETS and ACK_PACKETS" >&2
+	echo "  defaults are:" >&2
+	echo "    - output file is $OUTPUT" >&2
+        exit 1
+}
+
+#
+# Main
+#
+
+# Check command line
+ARGS=("$@")
+TEMP=$(getopt -o hdo: --long help,debug -n $NAME -- "$@")
+[ $? != 0 ] && exit 1
+eval set -- "$TEMP"
+while true ; do
+        case "$1" in
+	-h|--help)
+                usage
+                ;;
+
+	-d|--debug)
+                DEBUG=1
+		shift
+                ;;
+
+	-o)
+		OUTPUT=$2
+		shift 2
+		;;
+
+        --)
+                shift
+                break
+                ;;
+
+        *)
+                fatal "internal error!"
+                ;;
+        esac
+done
+[ $# -lt 1 ] && usage
+eval cmd=$1
+shift
+
+case $cmd in
+run)
+	# Check for root user
+	if [ $EUID != 0 ]; then
+		sudo env "PATH=$PATH" PROTOS="$PROTOS" SIZES="$SIZES" \
+			PERIODS="$PERIODS" BACKENDS="$BACKENDS" \
+			PACKETS="$PACKETS" ACK_PACKETS="$ACK_PACKETS" \
+			OUTPUT="$OUTPUT" "$0" "${ARGS[@]}"
+		exit $?
+	fi
+	do_run
+	;;
+compare)
+	do_compare "$@"
+	;;
+*)
+	fatal "invalid sub command"
+esac
+
+exit 0
@@ -0,0 +1,372 @@
+#!/bin/bash
+
+# Source file for common definitions
+. misc.sh.inc
+
+#
+# Test matrix (can be overridden from the environment)
+#
+# The expected values and tolerances below have not been checked against
+# a real netem qdisc yet.
+#
+
+CASES=${CASES:-"loss dup reorder outage delay"}
+RATES=${RATES:-"10000 50000 100000 0"}	# pps, 0 means wire speed
+PACKETS=${PACKETS:-100000}
+ACK_PACKETS=${ACK_PACKETS:-1000}
+SIZE=${SIZE:-100}
+LOSS_PCT=${LOSS_PCT:-1}
+DUP_PCT=${DUP_PCT:-1}
+REORDER_GAP=${REORDER_GAP:-5}		# every Nth packet overtakes the others
+REORDER_MS=${REORDER_MS:-1}
+DELAY_MS=${DELAY_MS:-5}
+OUTAGE_MS=${OUTAGE_MS:-200}
+OUTAGE_S=${OUTAGE_S:-3}			# test duration
+TOLERANCE_PCT=${TOLERANCE_PCT:-2}
+
+NS=nsnetem
+VETH_SRV=vnetem0
+VETH_CLI=vnetem1
+ADDR_SRV=192.168.24.1
+ADDR_CLI=192.168.24.2
+
+CHECKS=0
+FAILED=0
+
+#
+# Local functions
+#
+
+function topology_setup () {
+	debug "creating topology..."
+	R ip link add $VETH_SRV type veth peer name $VETH_CLI
+	R ip netns add $NS
+	R ip link set $VETH_SRV netns $NS
+	R ip netns exec $NS ip addr add $ADDR_SRV/24 dev $VETH_SRV
+	R ip netns exec $NS ip link set $VETH_SRV up
+	R ip netns exec $NS ip link set lo up
+	R ip addr add $ADDR_CLI/24 dev $VETH_CLI
+	R ip link set $VETH_CLI up
+
+	# Only our packets must cross netem: no IPv6 chatter, no ARP
+	R sysctl -q -w net.ipv6.conf.$VETH_CLI.disable_ipv6=1
+	R ip netns exec $NS sysctl -q -w net.ipv6.conf.$VETH_SRV.disable_ipv6=1
+	mac_srv=$(ip netns exec $NS ip link show $VETH_SRV | \
+			awk '/link\/ether/ { print $2 }')
+	mac_cli=$(ip link show $VETH_CLI | awk '/link\/ether/ { print $2 }')
+	R ip neigh replace $ADDR_SRV lladdr $mac_srv dev $VETH_CLI nud permanent
+	R ip netns exec $NS ip neigh replace $ADDR_CLI lladdr $mac_cli \
+			dev $VETH_SRV nud permanent
+}
+
+function topology_destroy () {
+	debug "destroying topology..."
+	ip netns pids $NS 2> /dev/null | xargs -r kill
+	ip link del $VETH_CLI 2> /dev/null
+	ip netns delete $NS 2> /dev/null
+}
+
+# Impair the packets from the client to the server.
+# Usage: netem_set <add | change> <netem parameters>
+function netem_set () {
+	local cmd=$1
+	shift
+	R tc qdisc $cmd dev $VETH_CLI root netem limit 100000 $@ || \
+		fatal "cannot $cmd netem $@ (is sch_netem available?)"
+}
+
+function netem_del () {
+	tc qdisc del dev $VETH_CLI root 2> /dev/null
+}
+
+# Print the packets netem transmitted and dropped
+function netem_stats () {
+	tc -s qdisc show dev $VETH_CLI | \
+		awk '/Sent/ { gsub(",", "") ; print $4, $7 ; exit }'
+}
+
+# Return the nettestc options for a rate in pps
+function rate_args () {
+	if [ $1 -eq 0 ] ; then
+		echo "-f 0"
+	else
+		echo "-f $(awk -v r=$1 'BEGIN { print 1000 / r }')"
+	fi
+}
+
+# Return the tolerance on a count: TOLERANCE_PCT of it, at least 2 since
+# the packets around the START and the STOP ones can't always be told.
+function tolerance () {
+	awk -v n=$1 -v t=$TOLERANCE_PCT 'BEGIN {
+		n = n * t / 100
+		printf "%d\n", (n > 2 ? n : 2)
+	}'
+}
+
+# Run a whole test against a new server, leaving the outputs into $slog
+# and $clog.
+# Usage: run_test <nettestc options>
+function run_test () {
+	local spid
+
+	ip netns exec $NS ../nettests > /dev/null 2> $slog &
+	spid=$!
+	sleep 0.5
+	../nettestc -s $SIZE $@ $ADDR_SRV > /dev/null 2> $clog
+	sleep 0.5
+	kill -INT $spid ; wait $spid 2> /dev/null
+}
+
+# Print the packets sent by the client
+function client_sent () {
+	awk '/transmitted/ { print $3 }' $clog
+}
+
+# Print received, lost, local drops, dup and reordered of the last
+# server report
+function server_counters () {
+	sed -n 's/.*received \([0-9]*\) packets (\([0-9]*\) lost, \([0-9]*\) by local drops, \([0-9]*\) dup, \([0-9]*\) reordered.*/\1 \2 \3 \4 \5/p' $slog | tail -n 1
+}
+
+# Compare a reported figure with the expected one and print the result.
+# Usage: check <case> <rate> <what> <reported> <expected> <tolerance>
+function check () {
+	local res=ok
+
+	CHECKS=$((CHECKS + 1))
+	if ! awk -v g=$4 -v e=$5 -v t=$6 \
+			'BEGIN { exit !(g - e <= t && e - g <= t) }' ; then
+		res=FAIL
+		FAILED=$((FAILED + 1))
+	fi
+	printf "%-8s %8s  %-12s %10s %10s %8s  %s\n" $1 $2 $3 $4 $5 "+/-$6" \
+		$res
+}
+
+#
+# Test cases, each one runs at the given rate in pps
+#
+
+# Random loss: the server must find all the packets netem dropped, and
+# tell them from the ones dropped by its socket
+function case_loss () {
+	local sent received lost local dup reordered tx dropped
+
+	netem_set add loss $LOSS_PCT%
+	run_test $(rate_args $1) -n $PACKETS
+	read tx dropped <<< "$(netem_stats)"
+	netem_del
+	sent=$(client_sent)
+	read received lost local dup reordered <<< "$(server_counters)"
+
+	check loss $1 lost $((lost - local)) $dropped $(tolerance $dropped)
+	check loss $1 missing $((sent - received + dup)) $((dropped + local)) \
+		$(tolerance $dropped)
+	check loss $1 dup $dup 0 0
+}
+
+# Duplication: netem transmits the copies too
+function case_dup () {
+	local sent received lost local dup reordered tx dropped
+
+	netem_set add duplicate $DUP_PCT%
+	run_test $(rate_args $1) -n $PACKETS
+	read tx dropped <<< "$(netem_stats)"
+	netem_del
+	sent=$(client_sent)
+	read received lost local dup reordered <<< "$(server_counters)"
+
+	check dup $1 dup $dup $((tx - sent)) $(tolerance $((tx - sent)))
+	check dup $1 lost $((lost - local)) 0 2
+}
+
+# Reordering: every REORDER_GAP-th packet is sent at once while the others
+# are delayed by REORDER_MS, so it overtakes the delayed ones still in
+# flight, that is the REORDER_GAP - 1 before it at most and the ones sent
+# into REORDER_MS at the least (wire speed on a veth pair is way above
+# the rate which fills the gap). The late packets must be counted as
+# reordered and no more as lost.
+function case_reorder () {
+	local sent received lost local dup reordered tx dropped late
+
+	netem_set add delay ${REORDER_MS}ms reorder 100% gap $REORDER_GAP
+	run_test $(rate_args $1) -n $PACKETS
+	netem_del
+	sent=$(client_sent)
+	read received lost local dup reordered <<< "$(server_counters)"
+	late=$(awk -v n=$sent -v g=$REORDER_GAP -v r=$1 -v ms=$REORDER_MS \
+		'BEGIN {
+			f = int(r * ms / 1000)
+			if (r == 0 || f > g - 1)
+				f = g - 1
+			printf "%d\n", int(n / g) * f
+		}')
+
+	check reorder $1 reordered $reordered $late $(tolerance $late)
+	check reorder $1 lost $((lost - local)) 0 2
+	check reorder $1 dup $dup 0 0
+}
+
+# Outage: all the packets are dropped for OUTAGE_MS in the middle of the
+# test, the server must report a single outage. Its length is checked
+# against the packets netem dropped rather than OUTAGE_MS, since the tc
+# commands take a while: at a known rate the two must agree within a
+# couple of intervals between the packets and the timer slack.
+function case_outage () {
+	local sent received lost local dup reordered tx dropped
+	local outages longest tol length
+
+	if [ $1 -eq 0 ] ; then
+		debug "outage needs a known rate, skipping wire speed"
+		return
+	fi
+
+	netem_set add loss 0%
+	(
+		sleep $(awk -v s=$OUTAGE_S 'BEGIN { print s / 2 }')
+		netem_set change loss 100%
+		sleep $(awk -v ms=$OUTAGE_MS 'BEGIN { print ms / 1000 }')
+		netem_set change loss 0%
+	) &
+	run_test $(rate_args $1) -n $(($1 * OUTAGE_S))
+	wait
+	read tx dropped <<< "$(netem_stats)"
+	netem_del
+	read received lost local dup reordered <<< "$(server_counters)"
+	read outages longest <<< "$(sed -n 's/.*downtime=\([0-9.]*\)ms.*/\1/p' $slog | \
+		awk -v ms=$OUTAGE_MS '$1 > ms / 2 { n++ }
+			$1 > max { max = $1 }
+			END { printf "%d %.0f\n", n, max }')"
+	length=$(awk -v r=$1 -v n=$dropped 'BEGIN { printf "%.0f\n", n * 1000 / r }')
+	tol=$(awk -v r=$1 'BEGIN { printf "%.0f\n", 5 + 2000 / r }')
+
+	check outage $1 outages $outages 1 0
+	check outage $1 length_ms $longest $length $tol
+	check outage $1 lost $((lost - local)) $dropped $(tolerance $dropped)
+}
+
+# Delay: the ACKs come back without impairment, so the RTT must grow by
+# DELAY_MS (within 500us for the veth pair and the timers). The rate is
+# given by the ACKs.
+function case_delay () {
+	local rtt min p50 p90 p99 max
+
+	netem_set add delay ${DELAY_MS}ms
+	run_test -a -f 0 -n $ACK_PACKETS
+	netem_del
+	rtt=$(sed -n 's/.*RTT min\/p50\/p90\/p99\/max: \([0-9\/]*\)us/\1/p' $clog)
+	IFS=/ read min p50 p90 p99 max <<< "$rtt"
+
+	check delay ack rtt_min_us ${min:-0} $((DELAY_MS * 1000 + 250)) 250
+	check delay ack rtt_p50_us ${p50:-0} $((DELAY_MS * 1000 + 250)) 250
+}
+
+#
+# Commands
+#
+
+function do_run () {
+	local c rate
+
+	debug "building programs..."
+	make -C .. > /dev/null || fatal "cannot build programs"
+
+	topology_destroy
+	slog=$(mktemp)
+	clog=$(mktemp)
+	trap "topology_destroy ; rm -f $slog $clog" EXIT
+	topology_setup
+
+	printf "%-8s %8s  %-12s %10s %10s %8s  %s\n" case rate check \
+		reported expected tolerance result
+	for c in $CASES ; do
+		if [ $c == "delay" ] ; then
+			debug "running $c..."
+			case_delay
+			continue
+		fi
+		for rate in $RATES ; do
+			debug "running $c at ${rate}pps..."
+			case_$c $rate
+		done
+	done
+
+	if [ $FAILED -gt 0 ] ; then
+		warn "$FAILED of $CHECKS checks failed"
+		exit 1
+	fi
+	info "all $CHECKS checks passed"
+}
+
+#
+# Usage
+#
+
+function usage () {
+	echo "usage: $NAME [-h | --help] [-d | --debug] <COMMAND>" >&2
+	echo "  where <COMMAND> can be:" >&2
+	echo "    run                 - impair the traffic with netem and check the statistics" >&2
+	echo "  the test can be tuned with environment variables CASES, RATES," >&2
+	echo "  PACKETS, ACK_PACKETS, SIZE, LOSS_PCT, DUP_PCT, REORDER_GAP," >&2
+	echo "  REORDER_MS, DELAY_MS, OUTAGE_MS, OUTAGE_S and TOLERANCE_PCT" >&2
+	echo "  defaults are:" >&2
+	echo "    - cases are $CASES" >&2
+	echo "    - rates are $RATES pps (0 is wire speed)" >&2
+	echo "    - tolerance is $TOLERANCE_PCT% (at least 2 packets)" >&2
+        exit 1
+}
+
+#
+# Main
+#
+
+# Check command line
+ARGS=("$@")
+TEMP=$(getopt -o hd --long help,debug -n $NAME -- "$@")
+[ $? != 0 ] && exit 1
+eval set -- "$TEMP"
+while true ; do
+        case "$1" in
+	-h|--help)
+                usage
+                ;;
+
+	-d|--debug)
+                DEBUG=1
+		shift
+                ;;
+
+        --)
+                shift
+                break
+                ;;
+
+        *)
+                fatal "internal error!"
+                ;;
+        esac
+done
+[ $# -lt 1 ] && usage
+eval cmd=$1
+shift
+
+case $cmd in
+run)
+	# Check for root user
+	if [ $EUID != 0 ]; then
+		sudo env "PATH=$PATH" CASES="$CASES" RATES="$RATES" \
+			PACKETS="$PACKETS" ACK_PACKETS="$ACK_PACKETS" \
+			SIZE="$SIZE" LOSS_PCT="$LOSS_PCT" DUP_PCT="$DUP_PCT" \
+			REORDER_GAP="$REORDER_GAP" REORDER_MS="$REORDER_MS" \
+			DELAY_MS="$DELAY_MS" OUTAGE_MS="$OUTAGE_MS" \
+			OUTAGE_S="$OUTAGE_S" TOLERANCE_PCT="$TOLERANCE_PCT" \
+			"$0" "${ARGS[@]}"
+		exit $?
+	fi
+	do_run
+	;;
+*)
+	fatal "invalid sub command"
+esac
+
+exit 0
@@ -0,0 +1,892 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h>
+#include <linux/errqueue.h>
+#include <linux/tcp.h>
+
+#include "nettest.h"
+#include "transport.h"
+
+/* Room for SO_RXQ_OVFL, IP_TOS and SO_TIMESTAMPNS */
+#define CTRL_SIZE	(CMSG_SPACE(sizeof(uint32_t)) + \
+			 CMSG_SPACE(sizeof(int)) + \
+			 CMSG_SPACE(sizeof(struct timespec)))
+
+/*
+ * Helpers
+ */
+
+static int send_msgs(int s, struct mmsghdr *msgs, unsigned int n, int flags)
+{
+	if (n > 1)
+		return sendmmsg(s, msgs, n, flags);
+
+	return sendmsg(s, &msgs[0].msg_hdr, flags) < 0 ? -1 : 1;
+}
+
+static int recv_msgs(int s, struct mmsghdr *msgs, unsigned int n, int flags)
+{
+	ssize_t ret;
+
+	/* Don't wait for the whole batch but only for its first packet */
+	if (n > 1)
+		return recvmmsg(s, msgs, n, flags | MSG_WAITFORONE, NULL);
+
+	ret = recvmsg(s, &msgs[0].msg_hdr, flags);
+	if (ret < 0)
+		return -1;
+	msgs[0].msg_len = ret;
+
+	return 1;
+}
+
+/* Get the ancillary data of a received packet */
+static void parse_cmsgs(struct msghdr *msg, struct comm_info_s *comm,
+			struct nettest_rx_s *rx)
+{
+	struct cmsghdr *cmsg;
+
+	rx->prio = -1;
+	rx->ts_ns = 0;
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg))
+		if (cmsg->cmsg_level == SOL_SOCKET &&
+		    cmsg->cmsg_type == SO_RXQ_OVFL)
+			memcpy(&comm->rx_drops, CMSG_DATA(cmsg),
+					sizeof(comm->rx_drops));
+		else if (cmsg->cmsg_level == SOL_SOCKET &&
+			 cmsg->cmsg_type == SCM_TIMESTAMPNS)
+			rx->ts_ns = timespec_to_ns(
+					(struct timespec *) CMSG_DATA(cmsg));
+		else if (cmsg->cmsg_level == IPPROTO_IP &&
+			 cmsg->cmsg_type == IP_TOS)
+			rx->prio = *CMSG_DATA(cmsg) >> 2;
+}
+
+static void transport_close(int s)
+{
+	close(s);
+}
+
+/*
+ * UDP
+ */
+
+/* Return how many groups a single socket can join */
+static unsigned int get_max_memberships(void)
+{
+	FILE *f;
+	unsigned int n = 20;	/* kernel default */
+	int ret;
+
+	f = fopen("/proc/sys/net/ipv4/igmp_max_memberships", "r");
+	if (!f)
+		return n;
+	ret = fscanf(f, "%u", &n);
+	fclose(f);
+
+	return ret == 1 && n > 0 ? n : 20;
+}
+
+/*
+ * Join groups_num consecutive multicast groups starting from the
+ * multicast address, source specific if a source address is given.
+ * Each socket can join up to igmp_max_memberships groups so we spread the
+ * memberships over helper sockets: thanks to IP_MULTICAST_ALL the traffic
+ * of all of them is delivered to the socket s bound to the test port.
+ */
+static void join_groups(int s, struct comm_info_s *comm)
+{
+	struct comm_udp_data_s *udp = &comm->proto.udp;
+	struct ip_mreq_source mreq;
+	unsigned int per_socket = get_max_memberships();
+	unsigned int i, sockets = 1;
+	in_addr_t group;
+	int on = 1;
+	int fd = s;
+	int ret;
+
+	ret = setsockopt(s, IPPROTO_IP, IP_MULTICAST_ALL, &on, sizeof(on));
+	warn_if(ret < 0, "cannot enable IP_MULTICAST_ALL: %m");
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+	if (udp->source_address) {
+		ret = inet_aton(udp->source_address, &mreq.imr_sourceaddr);
+		err_if_exit(ret == 0, EXIT_FAILURE,
+				"invalid source address %s", udp->source_address);
+	}
+	group = ntohl(inet_addr(udp->multicast_address));
+
+	for (i = 0; i < udp->groups_num; i++) {
+		if (i > 0 && i % per_socket == 0) {
+			fd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+			err_if_exit(fd < 0, EXIT_FAILURE,
+					"unable to open socket: %m");
+			sockets++;
+		}
+
+		mreq.imr_multiaddr.s_addr = htonl(group + i);
+		if (udp->source_address)
+			ret = setsockopt(fd, IPPROTO_IP,
+					IP_ADD_SOURCE_MEMBERSHIP,
+					&mreq, sizeof(mreq));
+		else
+			ret = setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+					&mreq, sizeof(struct ip_mreq));
+		err_if_exit(ret < 0, EXIT_FAILURE,
+				"cannot add membership for %s: %m",
+				inet_ntoa(mreq.imr_multiaddr));
+	}
+
+	dbg("joined %u groups using %u sockets", udp->groups_num, sockets);
+}
+
+static int udp_open(struct comm_info_s *comm, bool server)
+{
+	struct sockaddr_in addr;
+	u_char ttl;
+	int on = 1;
+	int s;
+	int ret;
+
+	dbg("selected communication protocol is UDP");
+
+	s = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	err_if_exit(s < 0, EXIT_FAILURE, "unable to open socket: %m");
+
+	if (!server) {
+		/* Set socket to allow broadcast */
+		ret = setsockopt(s, SOL_SOCKET, SO_BROADCAST,
+					(void *) &on, sizeof(on));
+		err_if_exit(ret < 0, EXIT_FAILURE,
+					"cannot set broadcast permission: %m");
+
+		/* Set multicast TTL for multicast packets */
+		ttl = 5;
+		ret = setsockopt(s, IPPROTO_IP, IP_MULTICAST_TTL,
+					&ttl, sizeof(ttl));
+		err_if_exit(ret < 0, EXIT_FAILURE,
+					"cannot set multicast TTL: %m");
+
+		/* Complete UDP struct sockaddr_in data */
+		comm->proto.udp.raw_address.sin_family = AF_INET;
+		comm->proto.udp.raw_address.sin_port =
+					htons(comm->proto.udp.port);
+
+		return s;
+	}
+
+	/* Ask for the socket drops counter on each packet */
+	ret = setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &on, sizeof(on));
+	warn_if(ret < 0, "cannot enable SO_RXQ_OVFL: %m");
+
+	/* and for the TOS byte to check the DSCP marking */
+	ret = setsockopt(s, IPPROTO_IP, IP_RECVTOS, &on, sizeof(on));
+	warn_if(ret < 0, "cannot enable IP_RECVTOS: %m");
+
+	if (comm->proto.udp.multicast_address)
+		join_groups(s, comm);
+
+	/* Bind the socket */
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(comm->proto.udp.port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	ret = bind(s, (struct sockaddr *) &addr, sizeof(addr));
+	err_if_exit(ret < 0, EXIT_FAILURE, "cannot bind socket: %m");
+
+	return s;
+}
+
+/* The kernel builds the headers from the address */
+static void ip_prepare_dest(struct comm_info_s *comm,
+			const struct comm_class_s *cls,
+			struct comm_dest_s *dest)
+{
+	dest->hdr_len = 0;
+}
+
+static int udp_send(int s, struct nettest_tx_s *tx, unsigned int n,
+			int flags)
+{
+	struct mmsghdr msgs[NETTEST_TRANSPORT_BATCH];
+	struct iovec iov[NETTEST_TRANSPORT_BATCH];
+	unsigned int i;
+
+	n = min(n, (unsigned int) NETTEST_TRANSPORT_BATCH);
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = tx[i].pkt;
+		iov[i].iov_len = tx[i].len;
+		msgs[i].msg_hdr = (struct msghdr) {
+			.msg_name = &tx[i].dest->addr.in,
+			.msg_namelen = sizeof(tx[i].dest->addr.in),
+			.msg_iov = &iov[i],
+			.msg_iovlen = 1,
+		};
+	}
+
+	return send_msgs(s, msgs, n, flags);
+}
+
+static int udp_recv(int s, struct comm_info_s *comm, struct nettest_rx_s *rx,
+			unsigned int n, int flags)
+{
+	struct mmsghdr msgs[NETTEST_TRANSPORT_BATCH];
+	struct iovec iov[NETTEST_TRANSPORT_BATCH];
+	char ctrl[NETTEST_TRANSPORT_BATCH][CTRL_SIZE];
+	unsigned int i;
+	int ret;
+
+	n = min(n, (unsigned int) NETTEST_TRANSPORT_BATCH);
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = rx[i].pkt;
+		iov[i].iov_len = rx[i].size;
+		msgs[i].msg_hdr = (struct msghdr) {
+			.msg_name = rx[i].from ? &rx[i].from->in : NULL,
+			.msg_namelen = sizeof(rx[i].from->in),
+			.msg_iov = &iov[i],
+			.msg_iovlen = 1,
+			.msg_control = ctrl[i],
+			.msg_controllen = sizeof(ctrl[i]),
+		};
+	}
+
+	ret = recv_msgs(s, msgs, n, flags);
+	if (ret < 0)
+		return ret;
+	for (i = 0; i < ret; i++) {
+		rx[i].len = msgs[i].msg_len;
+		parse_cmsgs(&msgs[i].msg_hdr, comm, &rx[i]);
+	}
+
+	return ret;
+}
+
+static const struct nettest_transport_s udp_transport = {
+	.name = "UDP",
+	.type = NETTEST_INFO_TYPE_UDP,
+	.caps = NETTEST_CAP_CLASS_SOCKET | NETTEST_CAP_GROUPS |
+		NETTEST_CAP_RX_PRIO,
+	.prio_max = 63,
+	.prio_name = "DSCP",
+	.open = udp_open,
+	.prepare_dest = ip_prepare_dest,
+	.send = udp_send,
+	.recv = udp_recv,
+	.close = transport_close,
+};
+
+/*
+ * Ethernet
+ */
+
+static int eth_open(struct comm_info_s *comm, bool server)
+{
+	struct comm_ethernt_data_s *eth = &comm->proto.eth;
+	int s;
+	int ret;
+
+	dbg("selected communication protocol is Ethernet");
+
+	s = socket(AF_PACKET, SOCK_RAW, htons(NETTEST_ETH_P));
+	err_if_exit(s < 0, EXIT_FAILURE, "unable to open socket: %m");
+
+	/* Complete the Ethernet sockaddr_ll data */
+	ret = get_ifindex(s, eth->if_name);
+	err_if_exit(ret < 0, EXIT_FAILURE, "cannot get interface index");
+	eth->raw_address.sll_ifindex = ret;
+	eth->raw_address.sll_family = AF_PACKET;
+	eth->raw_address.sll_protocol = htons(NETTEST_ETH_P);
+	eth->raw_address.sll_halen = ETH_ALEN;
+
+	ret = bind(s, (struct sockaddr *) &eth->raw_address,
+			sizeof(eth->raw_address));
+	err_if_exit(ret < 0, EXIT_FAILURE, "cannot bind interface");
+
+	/* Get the MAC address of the interface to send on */
+	ret = get_ifaddr(s, eth->if_name, eth->raw_if_address);
+	err_if_exit(ret < 0, EXIT_FAILURE, "cannot get MAC address: %m");
+
+	return s;
+}
+
+/* The frame header, with the 802.1Q tag of the class if it is marked */
+static void eth_prepare_dest(struct comm_info_s *comm,
+			const struct comm_class_s *cls,
+			struct comm_dest_s *dest)
+{
+	struct nettest_vlan_header_s *vh = &dest->hdr.vlan;
+	struct ether_header *eh = &dest->hdr.eth;
+
+	if (!cls || cls->prio < 0) {
+		memcpy(eh->ether_shost, comm->proto.eth.raw_if_address,
+				ETH_ALEN);
+		memcpy(eh->ether_dhost, dest->addr.ll.sll_addr, ETH_ALEN);
+		eh->ether_type = htons(NETTEST_ETH_P);
+		dest->hdr_len = sizeof(*eh);
+		return;
+	}
+
+	memcpy(vh->ether_shost, comm->proto.eth.raw_if_address, ETH_ALEN);
+	memcpy(vh->ether_dhost, dest->addr.ll.sll_addr, ETH_ALEN);
+	vh->tpid = htons(ETHERTYPE_VLAN);
+	vh->tci = htons(cls->prio << 13 | cls->vlan);
+	vh->ether_type = htons(NETTEST_ETH_P);
+	dest->hdr_len = sizeof(*vh);
+}
+
+/* The prepared header replaces the one into the packet */
+static int eth_send(int s, struct nettest_tx_s *tx, unsigned int n,
+			int flags)
+{
+	struct mmsghdr msgs[NETTEST_TRANSPORT_BATCH];
+	struct iovec iov[NETTEST_TRANSPORT_BATCH][2];
+	size_t hlen = sizeof(struct ether_header);
+	unsigned int i;
+
+	n = min(n, (unsigned int) NETTEST_TRANSPORT_BATCH);
+	for (i = 0; i < n; i++) {
+		iov[i][0].iov_base = &tx[i].dest->hdr;
+		iov[i][0].iov_len = tx[i].dest->hdr_len;
+		iov[i][1].iov_base = (char *) tx[i].pkt + hlen;
+		iov[i][1].iov_len = tx[i].len - hlen;
+		msgs[i].msg_hdr = (struct msghdr) {
+			.msg_iov = iov[i],
+			.msg_iovlen = 2,
+		};
+	}
+
+	return send_msgs(s, msgs, n, flags);
+}
+
+/*
+ * Note that the kernel doesn't pass the 802.1Q tag to the sockets bound
+ * to a protocol, so we can't get the PCP
+ */
+static int eth_recv(int s, struct comm_info_s *comm, struct nettest_rx_s *rx,
+			unsigned int n, int flags)
+{
+	struct mmsghdr msgs[NETTEST_TRANSPORT_BATCH];
+	struct iovec iov[NETTEST_TRANSPORT_BATCH];
+	char ctrl[NETTEST_TRANSPORT_BATCH][CTRL_SIZE];
+	unsigned int i;
+	int ret;
+
+	n = min(n, (unsigned int) NETTEST_TRANSPORT_BATCH);
+	for (i = 0; i < n; i++) {
+		iov[i].iov_base = rx[i].pkt;
+		iov[i].iov_len = rx[i].size;
+		msgs[i].msg_hdr = (struct msghdr) {
+			.msg_name = rx[i].from ? &rx[i].from->ll : NULL,
+			.msg_namelen = sizeof(rx[i].from->ll),
+			.msg_iov = &iov[i],
+			.msg_iovlen = 1,
+			.msg_control = ctrl[i],
+			.msg_controllen = sizeof(ctrl[i]),
+		};
+	}
+
+	ret = recv_msgs(s, msgs, n, flags);
+	if (ret < 0)
+		return ret;
+	for (i = 0; i < ret; i++) {
+		rx[i].len = msgs[i].msg_len;
+		parse_cmsgs(&msgs[i].msg_hdr, comm, &rx[i]);
+	}
+
+	return ret;
+}
+
+/* The kernel resets its counters on each request */
+static uint32_t eth_drops(int s)
+{
+	struct tpacket_stats st;
+	socklen_t len = sizeof(st);
+	int ret;
+
+	ret = getsockopt(s, SOL_PACKET, PACKET_STATISTICS, &st, &len);
+
+	return ret == 0 ? st.tp_drops : 0;
+}
+
+static const struct nettest_transport_s eth_transport = {
+	.name = "Ethernet",
+	.type = NETTEST_INFO_TYPE_ETHERNET,
+	.caps = NETTEST_CAP_VLAN,
+	.prio_max = 7,
+	.prio_name = "PCP",
+	.open = eth_open,
+	.prepare_dest = eth_prepare_dest,
+	.send = eth_send,
+	.recv = eth_recv,
+	.drops = eth_drops,
+	.close = transport_close,
+};
+
+/*
+ * TCP
+ *
+ * The records are written back to back into the stream, each one starts
+ * with its length (pkt->proto.tcp.len). A server socket serves a
+ * connection at a time: the receive accepts it, then splits the stream
+ * into records. Every socket returned by open() has its own stream, found
+ * by the socket itself, so the operations keep working on their argument
+ * as for the other backends.
+ */
+
+#define TCP_BUF_SIZE		(256 << 10)
+
+struct tcp_stream_s {
+	int fd;			/* connected socket, -1 if none */
+	struct sockaddr_in peer;
+	size_t head, tail;	/* of the data into buf */
+	uint8_t buf[TCP_BUF_SIZE];
+};
+
+/* The streams of the open sockets, indexed by the socket */
+static struct tcp_stream_s **tcp_streams;
+static unsigned int tcp_streams_num;
+
+static struct tcp_stream_s *tcp_stream_new(int s)
+{
+	struct tcp_stream_s **streams, *tcp;
+	unsigned int num;
+
+	if (s >= tcp_streams_num) {
+		num = max(s + 1U, 2 * tcp_streams_num);
+		streams = realloc(tcp_streams, num * sizeof(*streams));
+		err_if_exit(!streams, EXIT_FAILURE,
+				"cannot allocate TCP streams");
+		memset(streams + tcp_streams_num, 0,
+			(num - tcp_streams_num) * sizeof(*streams));
+		tcp_streams = streams;
+		tcp_streams_num = num;
+	}
+	tcp = malloc(sizeof(*tcp));
+	err_if_exit(!tcp, EXIT_FAILURE, "cannot allocate TCP stream buffer");
+	tcp->fd = -1;
+	tcp->head = tcp->tail = 0;
+	tcp_streams[s] = tcp;
+
+	return tcp;
+}
+
+/* The stream of a socket returned by open() */
+static inline struct tcp_stream_s *tcp_stream(int s)
+{
+	BUG_ON(s < 0 || s >= tcp_streams_num || !tcp_streams[s]);
+
+	return tcp_streams[s];
+}
+
+static int tcp_open(struct comm_info_s *comm, bool server)
+{
+	struct tcp_stream_s *tcp;
+	struct sockaddr_in addr;
+	int on = 1;
+	int s;
+	int ret;
+
+	dbg("selected communication protocol is TCP");
+
+	s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	err_if_exit(s < 0, EXIT_FAILURE, "unable to open socket: %m");
+	tcp = tcp_stream_new(s);
+
+	if (!server) {
+		/* The records sent at a rate must leave at once */
+		ret = setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+		warn_if(ret < 0, "cannot set TCP_NODELAY: %m");
+
+		comm->proto.udp.raw_address.sin_family = AF_INET;
+		comm->proto.udp.raw_address.sin_port =
+					htons(comm->proto.udp.port);
+		ret = connect(s, (struct sockaddr *) &comm->proto.udp.raw_address,
+				sizeof(comm->proto.udp.raw_address));
+		err_if_exit(ret < 0, EXIT_FAILURE, "cannot connect to %s:%u: %m",
+				inet_ntoa(comm->proto.udp.raw_address.sin_addr),
+				comm->proto.udp.port);
+		tcp->fd = s;
+		tcp->peer = comm->proto.udp.raw_address;
+
+		return s;
+	}
+
+	ret = setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	warn_if(ret < 0, "cannot set SO_REUSEADDR: %m");
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(comm->proto.udp.port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	ret = bind(s, (struct sockaddr *) &addr, sizeof(addr));
+	err_if_exit(ret < 0, EXIT_FAILURE, "cannot bind socket: %m");
+	ret = listen(s, 1);
+	err_if_exit(ret < 0, EXIT_FAILURE, "cannot listen on socket: %m");
+
+	return s;
+}
+
+static int tcp_accept(int s, struct tcp_stream_s *tcp, int flags)
+{
+	struct pollfd pfd = {
+		.fd = s,
+		.events = POLLIN,
+	};
+	socklen_t len = sizeof(tcp->peer);
+
+	if ((flags & MSG_DONTWAIT) && poll(&pfd, 1, 0) == 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	/* The timeout of the listening socket applies and is inherited */
+	tcp->fd = accept(s, (struct sockaddr *) &tcp->peer, &len);
+	if (tcp->fd < 0)
+		return -1;
+	tcp->head = tcp->tail = 0;
+	dbg("TCP connection from %s:%u", inet_ntoa(tcp->peer.sin_addr),
+		ntohs(tcp->peer.sin_port));
+
+	return 0;
+}
+
+static void tcp_disconnect(int s, struct tcp_stream_s *tcp)
+{
+	dbg("TCP connection from %s:%u closed", inet_ntoa(tcp->peer.sin_addr),
+		ntohs(tcp->peer.sin_port));
+	if (tcp->fd != s)
+		close(tcp->fd);
+	tcp->fd = -1;
+	tcp->head = tcp->tail = 0;
+}
+
+/* Write the records whole, a partial one would break the stream */
+static int tcp_send(int s, struct nettest_tx_s *tx, unsigned int n,
+			int flags)
+{
+	struct tcp_stream_s *tcp = tcp_stream(s);
+	struct iovec iov[NETTEST_TRANSPORT_BATCH];
+	struct msghdr msg = {
+		.msg_iov = iov,
+	};
+	size_t left = 0;
+	ssize_t ret;
+	unsigned int i;
+
+	if (tcp->fd < 0) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	n = min(n, (unsigned int) NETTEST_TRANSPORT_BATCH);
+	for (i = 0; i < n; i++) {
+		tx[i].pkt->proto.tcp.len = tx[i].len;
+		iov[i].iov_base = tx[i].pkt;
+		iov[i].iov_len = tx[i].len;
+		left += tx[i].len;
+	}
+	msg.msg_iovlen = n;
+
+	while (left) {
+		ret = sendmsg(tcp->fd, &msg, flags | MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		left -= ret;
+
+		/* Skip what has been sent and wait for the room for the rest */
+		while (msg.msg_iovlen && ret >= msg.msg_iov->iov_len) {
+			ret -= msg.msg_iov->iov_len;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (msg.msg_iovlen) {
+			msg.msg_iov->iov_base += ret;
+			msg.msg_iov->iov_len -= ret;
+		}
+		flags &= ~MSG_DONTWAIT;
+	}
+
+	return n;
+}
+
+static int tcp_recv(int s, struct comm_info_s *comm, struct nettest_rx_s *rx,
+			unsigned int n, int flags)
+{
+	struct tcp_stream_s *tcp = tcp_stream(s);
+	size_t hdr_size = offsetof(struct data_packet_s, filler);
+	unsigned int i = 0;
+	uint32_t len;
+	ssize_t ret;
+
+	while (i < n) {
+		/* Take the records already into the buffer */
+		if (tcp->tail - tcp->head >= sizeof(len)) {
+			memcpy(&len, tcp->buf + tcp->head, sizeof(len));
+			if (len < hdr_size || len > sizeof(struct data_packet_s)) {
+				warn("invalid TCP record of %u bytes", len);
+				tcp_disconnect(s, tcp);
+				continue;
+			}
+			if (tcp->tail - tcp->head >= len) {
+				rx[i].len = min((size_t) len, rx[i].size);
+				memcpy(rx[i].pkt, tcp->buf + tcp->head, rx[i].len);
+				if (rx[i].from)
+					rx[i].from->in = tcp->peer;
+				rx[i].ts_ns = 0;
+				rx[i].prio = -1;
+				tcp->head += len;
+				i++;
+				continue;
+			}
+		}
+		if (i > 0)
+			break;
+
+		if (tcp->fd < 0 && tcp_accept(s, tcp, flags) < 0)
+			return -1;
+		if (tcp->head) {
+			memmove(tcp->buf, tcp->buf + tcp->head, tcp->tail - tcp->head);
+			tcp->tail -= tcp->head;
+			tcp->head = 0;
+		}
+		ret = recv(tcp->fd, tcp->buf + tcp->tail,
+				sizeof(tcp->buf) - tcp->tail, flags);
+		if (ret < 0)
+			return -1;
+		if (ret == 0) {
+			tcp_disconnect(s, tcp);
+			continue;
+		}
+		tcp->tail += ret;
+	}
+
+	return i;
+}
+
+static int tcp_get_info(int s, struct nettest_tcp_info_s *ti)
+{
+	struct tcp_stream_s *tcp = tcp_stream(s);
+	struct tcp_info info;
+	socklen_t len = sizeof(info);
+	int ret;
+
+	memset(ti, 0, sizeof(*ti));
+	if (tcp->fd < 0) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	/* Older kernels fill only the first fields */
+	memset(&info, 0, sizeof(info));
+	ret = getsockopt(tcp->fd, IPPROTO_TCP, TCP_INFO, &info, &len);
+	if (ret < 0)
+		return ret;
+
+	ti->rtt_us = info.tcpi_rtt;
+	ti->rttvar_us = info.tcpi_rttvar;
+	ti->rcv_rtt_us = info.tcpi_rcv_rtt;
+	ti->cwnd = info.tcpi_snd_cwnd;
+	ti->mss = info.tcpi_snd_mss;
+	ti->retrans = info.tcpi_total_retrans;
+	ti->delivery_rate = info.tcpi_delivery_rate;
+	ti->bytes_acked = info.tcpi_bytes_acked;
+	ti->bytes_received = info.tcpi_bytes_received;
+
+	return 0;
+}
+
+static void tcp_close(int s)
+{
+	struct tcp_stream_s *tcp = tcp_stream(s);
+
+	if (tcp->fd >= 0 && tcp->fd != s)
+		close(tcp->fd);
+	close(s);
+	free(tcp);
+	tcp_streams[s] = NULL;
+}
+
+static const struct nettest_transport_s tcp_transport = {
+	.name = "TCP",
+	.type = NETTEST_INFO_TYPE_TCP,
+	.caps = NETTEST_CAP_CLASS_SOCKET | NETTEST_CAP_STREAM,
+	.prio_max = 63,
+	.prio_name = "DSCP",
+	.open = tcp_open,
+	.prepare_dest = ip_prepare_dest,
+	.send = tcp_send,
+	.recv = tcp_recv,
+	.tcp_info = tcp_get_info,
+	.close = tcp_close,
+};
+
+/*
+ * Exported functions
+ */
+
+static const struct nettest_transport_s *transports[] = {
+	&udp_transport,
+	&eth_transport,
+	&tcp_transport,
+};
+
+/* Return the backend of the communication type or NULL */
+const struct nettest_transport_s *nettest_transport_get(unsigned int type)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(transports); i++)
+		if (transports[i]->type == type)
+			return transports[i];
+
+	return NULL;
+}
+
+/*
+ * Print the connection statistics, with prev those of the interval since
+ * it was sampled, otherwise the totals, over elapsed_ns
+ */
+int nettest_tcp_info_snprintf(char *buf, size_t len,
+			const struct nettest_tcp_info_s *ti,
+			const struct nettest_tcp_info_s *prev,
+			uint64_t elapsed_ns)
+{
+	uint64_t bytes = ti->bytes_acked + ti->bytes_received;
+	uint64_t retrans = ti->retrans;
+	int n;
+
+	if (prev) {
+		bytes -= prev->bytes_acked + prev->bytes_received;
+		retrans -= prev->retrans;
+	}
+
+	n = snprintf(buf, len, "TCP %.2fMbit/s, rtt %uus (+/-%uus), "
+			"cwnd %u, %lu retransmits, delivery rate %.2fMbit/s",
+			elapsed_ns ? bytes * 8e3 / elapsed_ns : 0.,
+			ti->rtt_us, ti->rttvar_us, ti->cwnd, retrans,
+			ti->delivery_rate * 8e-6);
+	if (ti->rcv_rtt_us && n < len)
+		n += snprintf(buf + n, len - n, ", receiver rtt %uus",
+				ti->rcv_rtt_us);
+
+	return n;
+}
+
+void nettest_zc_init(int s, struct nettest_zc_s *zc)
+{
+	int on = 1;
+
+	memset(zc, 0, sizeof(*zc));
+	zc->enabled = setsockopt(s, SOL_SOCKET, SO_ZEROCOPY,
+					&on, sizeof(on)) == 0;
+	warn_if(!zc->enabled, "cannot enable zero-copy sends: %m");
+}
+
+/*
+ * Send the whole buffer, with MSG_ZEROCOPY if enabled and worth it. Return
+ * 0 or -1, *id is the notification to wait for before touching buf again.
+ */
+int nettest_zc_send(int s, struct nettest_zc_s *zc, const void *buf,
+			size_t len, int64_t *id)
+{
+	int flags = zc->enabled && len >= NETTEST_ZC_MIN ? MSG_ZEROCOPY : 0;
+	ssize_t ret;
+
+	*id = NETTEST_ZC_NONE;
+	while (len) {
+		ret = send(s, buf, len, flags | MSG_NOSIGNAL);
+		if (ret < 0 && errno == ENOBUFS && flags) {
+			/* No memory left for the notifications */
+			zc->fallbacks++;
+			flags = 0;
+			continue;
+		}
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+
+		/* Each call sending something takes the next id */
+		if (flags) {
+			*id = zc->sent++;
+			zc->sends++;
+		}
+		buf = (const char *) buf + ret;
+		len -= ret;
+	}
+
+	return 0;
+}
+
+/*
+ * Read the notifications, waiting up to timeout_ms for the first one.
+ * Return how many have been read or -1.
+ */
+int nettest_zc_reap(int s, struct nettest_zc_s *zc, int timeout_ms)
+{
+	struct pollfd pfd = {
+		.fd = s,		/* POLLERR means notifications */
+	};
+	char ctrl[CMSG_SPACE(sizeof(struct sock_extended_err) +
+			sizeof(struct sockaddr_in6))];
+	struct msghdr msg = {
+		.msg_control = ctrl,
+	};
+	struct sock_extended_err *ee;
+	struct cmsghdr *cmsg;
+	int n = 0;
+	int ret;
+
+	if (timeout_ms) {
+		ret = poll(&pfd, 1, timeout_ms);
+		if (ret <= 0)
+			return ret;
+	}
+
+	while (1) {
+		msg.msg_controllen = sizeof(ctrl);
+		ret = recvmsg(s, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+		if (ret < 0)
+			return errno == EAGAIN ? n : -1;
+
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+		     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!(cmsg->cmsg_level == SOL_IP &&
+			      cmsg->cmsg_type == IP_RECVERR) &&
+			    !(cmsg->cmsg_level == SOL_IPV6 &&
+			      cmsg->cmsg_type == IPV6_RECVERR))
+				continue;
+			ee = (struct sock_extended_err *) CMSG_DATA(cmsg);
+			if (ee->ee_errno != 0 ||
+			    ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			/* The ids [ee_info, ee_data] have been released */
+			if ((int32_t) (ee->ee_data + 1 - zc->done) > 0)
+				zc->done = ee->ee_data + 1;
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				zc->copied += ee->ee_data - ee->ee_info + 1;
+			n++;
+		}
+	}
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (C) 2022   Rodolfo Giometti <giometti@enneenne.com>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+#ifndef _TRANSPORT_H
+#define _TRANSPORT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Transport backends
+ *
+ * How the data packets travel (UDP datagrams, raw Ethernet frames, ...)
+ * is hidden behind a table of operations selected once at startup, so
+ * that the hot loops never switch on the communication type. The link
+ * headers of a destination are built once by prepare_dest() and packets
+ * are moved in batches, the indirect call is paid per batch.
+ */
+
+#define NETTEST_TRANSPORT_BATCH	64	/* max packets per send/recv */
+
+/* Capabilities */
+#define NETTEST_CAP_CLASS_SOCKET (1 << 0) /* marking is per socket */
+#define NETTEST_CAP_VLAN	(1 << 1)  /* 802.1Q tag per packet */
+#define NETTEST_CAP_GROUPS	(1 << 2)  /* many (multicast) destinations */
+#define NETTEST_CAP_RX_PRIO	(1 << 3)  /* marking of received packets */
+#define NETTEST_CAP_STREAM	(1 << 4)  /* reliable, kernel sized buffers */
+
+struct comm_info_s;
+struct comm_class_s;
+struct comm_dest_s;
+struct data_packet_s;
+union comm_dest_addr_u;
+
+struct nettest_tx_s {
+	struct comm_dest_s *dest;	/* with its headers prepared */
+	struct data_packet_s *pkt;
+	size_t len;
+};
+
+struct nettest_rx_s {
+	struct data_packet_s *pkt;
+	size_t size;			/* of the buffer */
+	size_t len;			/* received bytes */
+	union comm_dest_addr_u *from;	/* sender address, may be NULL */
+	uint64_t ts_ns;			/* SO_TIMESTAMPNS if enabled or 0 */
+	int prio;			/* PCP or DSCP, -1 if unknown */
+};
+
+/* Connection statistics of stream transports, from TCP_INFO */
+struct nettest_tcp_info_s {
+	uint32_t rtt_us, rttvar_us;
+	uint32_t rcv_rtt_us;		/* estimated by the receiver */
+	uint32_t cwnd;			/* congestion window in segments */
+	uint32_t mss;
+	uint64_t retrans;		/* retransmitted segments so far */
+	uint64_t delivery_rate;		/* bytes per second */
+	uint64_t bytes_acked;		/* sent and acknowledged */
+	uint64_t bytes_received;
+};
+
+struct nettest_transport_s {
+	const char *name;
+	unsigned int type;		/* NETTEST_INFO_TYPE_* */
+	unsigned int caps;		/* NETTEST_CAP_* */
+	int prio_max;
+	const char *prio_name;		/* what the class priority is */
+
+	/* Return a new socket, the server one is bound to the test port */
+	int (*open)(struct comm_info_s *comm, bool server);
+	/* Build the headers to reach dest, cls may be NULL (unmarked) */
+	void (*prepare_dest)(struct comm_info_s *comm,
+			const struct comm_class_s *cls,
+			struct comm_dest_s *dest);
+	/*
+	 * Return the number of packets sent or received, -1 on error. The
+	 * receive waits (unless MSG_DONTWAIT) for the first packet only.
+	 */
+	int (*send)(int s, struct nettest_tx_s *tx, unsigned int n,
+			int flags);
+	int (*recv)(int s, struct comm_info_s *comm, struct nettest_rx_s *rx,
+			unsigned int n, int flags);
+	/*
+	 * Return the packets dropped by the socket since the last call, NULL
+	 * if the counter comes with every packet into comm->rx_drops
+	 */
+	uint32_t (*drops)(int s);
+	/* Sample the connection, NULL for datagram transports */
+	int (*tcp_info)(int s, struct nettest_tcp_info_s *ti);
+	void (*close)(int s);
+};
+
+extern const struct nettest_transport_s *nettest_transport_get(
+			unsigned int type);
+extern int nettest_tcp_info_snprintf(char *buf, size_t len,
+			const struct nettest_tcp_info_s *ti,
+			const struct nettest_tcp_info_s *prev,
+			uint64_t elapsed_ns);
+
+/* Send or receive a single packet, return its length or -1 */
+static inline ssize_t nettest_send_one(const struct nettest_transport_s *tr,
+			int s, struct comm_dest_s *dest,
+			struct data_packet_s *pkt, size_t len, int flags)
+{
+	struct nettest_tx_s tx = {
+		.dest = dest,
+		.pkt = pkt,
+		.len = len,
+	};
+
+	return tr->send(s, &tx, 1, flags) < 0 ? -1 : len;
+}
+
+/*
+ * Zero-copy sends
+ *
+ * With MSG_ZEROCOPY the kernel sends from our pages, which must not be
+ * touched until it tells, through the error queue of the socket, that it
+ * is done with them. Each zero-copy send gets the next notification id,
+ * notifications of a TCP socket arrive in order.
+ */
+
+#define NETTEST_ZC_NONE		(-1)	/* data copied, nothing to wait */
+#define NETTEST_ZC_MIN		(16 << 10)	/* below it copying is cheaper */
+
+struct nettest_zc_s {
+	bool enabled;
+	uint32_t sent;			/* notification ids used */
+	uint32_t done;			/* the ids before this one arrived */
+	uint64_t sends;			/* with MSG_ZEROCOPY */
+	uint64_t copied;		/* the kernel copied the data anyway */
+	uint64_t fallbacks;		/* copied by us (ENOBUFS) */
+};
+
+extern void nettest_zc_init(int s, struct nettest_zc_s *zc);
+extern int nettest_zc_send(int s, struct nettest_zc_s *zc,
+			const void *buf, size_t len, int64_t *id);
+extern int nettest_zc_reap(int s, struct nettest_zc_s *zc, int timeout_ms);
+
+/* Return true if the buffer sent with the notification id is free */
+static inline bool nettest_zc_done(const struct nettest_zc_s *zc, int64_t id)
+{
+	return id == NETTEST_ZC_NONE || (int32_t) (zc->done - id) > 0;
+}
+
+#endif /* _TRANSPORT_H */